@@ -0,0 +1,384 @@
+/* HmSearch hash lookup library - buffered partition store
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <kcthread.h>
+#include <kcutil.h>
+
+#include "store.h"
+
+/* Every insert appends the hash to one record per partition, and
+ * Kyoto Cabinet rewrites the whole record on each append.  The
+ * buffered store collects the appends in memory instead, merging all
+ * data for the same key, and writes them out in group commits with a
+ * single append per key.
+ *
+ * The buffer is split into shards on the key hash.  Each shard has
+ * its own lock, so threads appending to different shards don't
+ * contend.  When a shard fills up, the thread that filled it swaps
+ * out its records and writes them while other threads keep buffering
+ * into the now empty shard.  A second lock per shard is held while
+ * writing, so that flush() doesn't return while another thread is
+ * still writing a batch it swapped out earlier.
+ */
+
+// Enough for the shards to rarely collide on a many-core machine
+static const size_t buffer_shards = 64;
+
+namespace {
+
+class BufferedStore : public PartitionStore
+{
+public:
+    BufferedStore(PartitionStore* store, size_t buffer_size, double flush_interval)
+        : _store(store)
+        , _shard_limit(buffer_size / buffer_shards + 1)
+        , _shards(buffer_shards)
+        , _flusher(NULL)
+        {
+            if (flush_interval > 0) {
+                _flusher = new Flusher(this, flush_interval);
+                _flusher->start();
+            }
+        }
+
+    ~BufferedStore() {
+        stop_flusher();
+        delete _store;
+    }
+
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result) {
+        return _store->get(key, key_length, buffer, value, value_length, cache_result);
+    }
+
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg);
+
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg);
+
+    bool flush(std::string* error_msg);
+
+    bool increment(const uint8_t* key, size_t key_length,
+                   int64_t num, int64_t* result,
+                   std::string* error_msg) {
+        return _store->increment(key, key_length, num, result, error_msg);
+    }
+
+    void advise(Advice advice) {
+        _store->advise(advice);
+    }
+
+    void prefetch(const uint8_t* keys, size_t key_length, size_t count) {
+        _store->prefetch(keys, key_length, count);
+    }
+
+    bool stamp(uint64_t* records, uint64_t* bytes) {
+        return _store->stamp(records, bytes);
+    }
+
+    bool iterate(Visitor& visitor, std::string* error_msg) {
+        return flush(error_msg) && _store->iterate(visitor, error_msg);
+    }
+
+    bool close(std::string* error_msg);
+
+private:
+    struct Shard {
+        Shard() : size(0) {}
+
+        kyotocabinet::Mutex lock;       // Protects records and size
+        kyotocabinet::Mutex write_lock; // Held while writing a batch
+        std::unordered_map<std::string, std::string> records;
+        size_t size;
+    };
+
+    /** Flushes the buffer at regular intervals until stopped.
+     */
+    class Flusher : public kyotocabinet::Thread
+    {
+    public:
+        Flusher(BufferedStore* store, double interval)
+            : _store(store), _interval(interval), _stop(false)
+            {}
+
+        void run();
+        void stop();
+
+    private:
+        BufferedStore* _store;
+        double _interval;
+        kyotocabinet::Mutex _lock;
+        kyotocabinet::CondVar _wakeup;
+        bool _stop;
+    };
+
+    bool flush_shard(Shard& shard, std::string* error_msg);
+    void stop_flusher();
+    bool check_error(std::string* error_msg);
+    void set_error(const std::string& error_msg);
+
+    PartitionStore* _store;
+    size_t _shard_limit;
+    std::vector<Shard> _shards;
+    Flusher* _flusher;
+
+    // Error from writing a full or timed out shard, reported until
+    // flush() succeeds
+    kyotocabinet::Mutex _error_lock;
+    std::string _error_msg;
+};
+
+
+bool BufferedStore::append(const uint8_t* key, size_t key_length,
+                           const uint8_t* value, size_t value_length,
+                           std::string* error_msg)
+{
+    if (!check_error(error_msg)) {
+        return false;
+    }
+
+    Shard& shard = _shards[kyotocabinet::hashmurmur(key, key_length) % _shards.size()];
+    bool full;
+
+    {
+        kyotocabinet::ScopedMutex lock(&shard.lock);
+        std::string& record = shard.records[std::string((const char*) key, key_length)];
+        if (record.empty()) {
+            shard.size += key_length;
+        }
+        record.append((const char*) value, value_length);
+        shard.size += value_length;
+        full = shard.size >= _shard_limit;
+    }
+
+    // The value is buffered even if writing the shard fails, and the
+    // records that weren't written are retried by the next flush, so
+    // the error is reported by the calls after this one
+    std::string flush_error;
+    if (full && !flush_shard(shard, &flush_error)) {
+        set_error(flush_error);
+    }
+    return true;
+}
+
+
+/* The copies still in the buffer are cut out of the buffered record,
+ * and the ones already written are removed from the store.  Holding
+ * the write lock of the shard meanwhile ensures that no batch swapped
+ * out before is still on its way to the store.
+ */
+bool BufferedStore::remove(const uint8_t* key, size_t key_length,
+                           const uint8_t* value, size_t value_length,
+                           size_t item_length, size_t* removed,
+                           std::string* error_msg)
+{
+    if (!check_error(error_msg)) {
+        return false;
+    }
+
+    Shard& shard = _shards[kyotocabinet::hashmurmur(key, key_length) % _shards.size()];
+    kyotocabinet::ScopedMutex write_lock(&shard.write_lock);
+    size_t buffered = 0;
+
+    {
+        kyotocabinet::ScopedMutex lock(&shard.lock);
+        std::unordered_map<std::string, std::string>::iterator i =
+            shard.records.find(std::string((const char*) key, key_length));
+
+        if (i != shard.records.end()) {
+            std::string& record = i->second;
+            std::string kept;
+
+            for (size_t n = 0; n + item_length <= record.length(); n += item_length) {
+                if (record.compare(n, value_length, (const char*) value, value_length) == 0) {
+                    buffered++;
+                }
+                else {
+                    kept.append(record, n, item_length);
+                }
+            }
+
+            shard.size -= record.length() - kept.length();
+            if (kept.empty()) {
+                shard.size -= key_length;
+                shard.records.erase(i);
+            }
+            else {
+                record.swap(kept);
+            }
+        }
+    }
+
+    if (!_store->remove(key, key_length, value, value_length,
+                        item_length, removed, error_msg)) {
+        return false;
+    }
+
+    *removed += buffered;
+    return true;
+}
+
+
+/* A failed background flush put its records back in the buffer, so
+ * writing the buffer again also retries them.
+ */
+bool BufferedStore::flush(std::string* error_msg)
+{
+    for (size_t i = 0; i < _shards.size(); i++) {
+        if (!flush_shard(_shards[i], error_msg)) {
+            return false;
+        }
+    }
+
+    if (!_store->flush(error_msg)) {
+        return false;
+    }
+
+    kyotocabinet::ScopedMutex lock(&_error_lock);
+    _error_msg.clear();
+    return true;
+}
+
+
+bool BufferedStore::close(std::string* error_msg)
+{
+    stop_flusher();
+
+    if (!flush(error_msg)) {
+        return false;
+    }
+
+    return _store->close(error_msg);
+}
+
+
+bool BufferedStore::flush_shard(Shard& shard, std::string* error_msg)
+{
+    kyotocabinet::ScopedMutex write_lock(&shard.write_lock);
+    std::unordered_map<std::string, std::string> records;
+
+    {
+        kyotocabinet::ScopedMutex lock(&shard.lock);
+        records.swap(shard.records);
+        shard.size = 0;
+    }
+
+    std::unordered_map<std::string, std::string>::iterator i;
+    for (i = records.begin(); i != records.end(); ++i) {
+        if (!_store->append((const uint8_t*) i->first.data(), i->first.length(),
+                            (const uint8_t*) i->second.data(), i->second.length(),
+                            error_msg)) {
+            break;
+        }
+    }
+
+    if (i == records.end()) {
+        return true;
+    }
+
+    // Put the records that weren't written back, in front of anything
+    // buffered for the same keys since, so that a later flush can
+    // retry them
+    kyotocabinet::ScopedMutex lock(&shard.lock);
+    for (; i != records.end(); ++i) {
+        std::string& record = shard.records[i->first];
+        if (record.empty()) {
+            shard.size += i->first.length();
+        }
+        shard.size += i->second.length();
+        record.insert(0, i->second);
+    }
+
+    return false;
+}
+
+
+void BufferedStore::stop_flusher()
+{
+    if (_flusher) {
+        _flusher->stop();
+        _flusher->join();
+        delete _flusher;
+        _flusher = NULL;
+    }
+}
+
+
+bool BufferedStore::check_error(std::string* error_msg)
+{
+    kyotocabinet::ScopedMutex lock(&_error_lock);
+
+    if (_error_msg.empty()) {
+        return true;
+    }
+
+    *error_msg = _error_msg;
+    return false;
+}
+
+
+void BufferedStore::set_error(const std::string& error_msg)
+{
+    kyotocabinet::ScopedMutex lock(&_error_lock);
+    _error_msg = error_msg;
+}
+
+
+void BufferedStore::Flusher::run()
+{
+    kyotocabinet::ScopedMutex lock(&_lock);
+
+    while (!_stop) {
+        _wakeup.wait(&_lock, _interval);
+        if (_stop) {
+            break;
+        }
+
+        std::string error_msg;
+        for (size_t i = 0; i < _store->_shards.size(); i++) {
+            if (!_store->flush_shard(_store->_shards[i], &error_msg)) {
+                _store->set_error(error_msg);
+                break;
+            }
+        }
+    }
+}
+
+
+void BufferedStore::Flusher::stop()
+{
+    kyotocabinet::ScopedMutex lock(&_lock);
+    _stop = true;
+    _wakeup.signal();
+}
+
+} // namespace
+
+
+PartitionStore* create_buffered_store(PartitionStore* store,
+                                      size_t buffer_size,
+                                      double flush_interval)
+{
+    return new BufferedStore(store, buffer_size, flush_interval);
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
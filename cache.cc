@@ -0,0 +1,322 @@
+/* HmSearch hash lookup library - partition record cache
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <kcthread.h>
+#include <kcutil.h>
+
+#include "store.h"
+
+/* Skewed query loads probe the same partition keys over and over,
+ * and most 1-variant probes miss.  The cache keeps recently used
+ * records and missing keys in memory, so that repeated probes don't
+ * have to go through the Kyoto Cabinet page lookups.
+ *
+ * The cache is split into shards on the key hash, each with its own
+ * lock and an equal share of the memory budget.  Each shard evicts
+ * with the CLOCK algorithm: a hit sets the referenced bit of the
+ * entry, and the clock hand clears referenced bits until it finds an
+ * entry without one to evict.
+ *
+ * append() and remove() invalidate the entry of the key after the
+ * underlying store has been updated.  Each shard also counts
+ * invalidations, and a record fetched on a miss is only cached if no
+ * invalidation happened in the shard while it was fetched, so that a
+ * concurrent update can't leave a stale record in the cache.
+ */
+
+static const size_t cache_shards = 16;
+
+// Approximate memory used by an entry in addition to the key and value
+static const size_t entry_overhead = 96;
+
+namespace {
+
+class CachedStore : public PartitionStore
+{
+public:
+    CachedStore(PartitionStore* store, size_t cache_size)
+        : _store(store)
+        , _shard_budget(cache_size / cache_shards)
+        , _shards(cache_shards)
+        { }
+
+    ~CachedStore() {
+        delete _store;
+    }
+
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result);
+
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg);
+
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg);
+
+    bool flush(std::string* error_msg) {
+        return _store->flush(error_msg);
+    }
+
+    bool increment(const uint8_t* key, size_t key_length,
+                   int64_t num, int64_t* result,
+                   std::string* error_msg) {
+        return _store->increment(key, key_length, num, result, error_msg);
+    }
+
+    void advise(Advice advice) {
+        _store->advise(advice);
+    }
+
+    void prefetch(const uint8_t* keys, size_t key_length, size_t count) {
+        _store->prefetch(keys, key_length, count);
+    }
+
+    bool stamp(uint64_t* records, uint64_t* bytes) {
+        return _store->stamp(records, bytes);
+    }
+
+    bool iterate(Visitor& visitor, std::string* error_msg) {
+        return _store->iterate(visitor, error_msg);
+    }
+
+    bool close(std::string* error_msg) {
+        return _store->close(error_msg);
+    }
+
+private:
+    struct Entry {
+        Entry() : live(false), found(false), referenced(false), cost(0) {}
+
+        std::string key;
+        std::string value;
+        bool live;
+        bool found;         // False for cached missing keys
+        bool referenced;
+        size_t cost;
+    };
+
+    struct Shard {
+        Shard() : hand(0), used(0), generation(0) {}
+
+        kyotocabinet::Mutex lock;
+        std::unordered_map<std::string, size_t> index;
+        std::vector<Entry> entries;
+        std::vector<size_t> free_entries;
+        size_t hand;
+        size_t used;
+        uint64_t generation;    // Bumped on each invalidation
+    };
+
+    Shard& shard_for(const uint8_t* key, size_t key_length) {
+        return _shards[kyotocabinet::hashmurmur(key, key_length) % _shards.size()];
+    }
+
+    void invalidate(const uint8_t* key, size_t key_length);
+    void add_entry(Shard& shard, const std::string& key, bool found,
+                   const uint8_t* value, size_t value_length);
+    void evict_entry(Shard& shard);
+    void remove_entry(Shard& shard, size_t i);
+
+    PartitionStore* _store;
+    size_t _shard_budget;
+    std::vector<Shard> _shards;
+};
+
+
+bool CachedStore::get(const uint8_t* key, size_t key_length,
+                      std::vector<char>& buffer,
+                      const uint8_t** value, size_t* value_length,
+                      CacheResult* cache_result)
+{
+    Shard& shard = shard_for(key, key_length);
+    std::string k((const char*) key, key_length);
+    uint64_t generation;
+
+    {
+        kyotocabinet::ScopedMutex lock(&shard.lock);
+
+        std::unordered_map<std::string, size_t>::const_iterator i = shard.index.find(k);
+        if (i != shard.index.end()) {
+            Entry& entry = shard.entries[i->second];
+            entry.referenced = true;
+
+            if (cache_result) {
+                *cache_result = CACHE_HIT;
+            }
+
+            if (!entry.found) {
+                return false;
+            }
+
+            // The entry may be evicted as soon as the lock is released
+            if (buffer.size() < entry.value.size()) {
+                buffer.resize(entry.value.size());
+            }
+            memcpy(buffer.data(), entry.value.data(), entry.value.size());
+
+            *value = (const uint8_t*) buffer.data();
+            *value_length = entry.value.size();
+            return true;
+        }
+
+        generation = shard.generation;
+    }
+
+    if (cache_result) {
+        *cache_result = CACHE_MISS;
+    }
+
+    bool found = _store->get(key, key_length, buffer, value, value_length, NULL);
+
+    kyotocabinet::ScopedMutex lock(&shard.lock);
+    if (shard.generation == generation && !shard.index.count(k)) {
+        add_entry(shard, k, found, found ? *value : NULL, found ? *value_length : 0);
+    }
+
+    return found;
+}
+
+
+bool CachedStore::append(const uint8_t* key, size_t key_length,
+                         const uint8_t* value, size_t value_length,
+                         std::string* error_msg)
+{
+    bool ok = _store->append(key, key_length, value, value_length, error_msg);
+
+    // Invalidate even on errors, since the record may have changed anyway
+    invalidate(key, key_length);
+    return ok;
+}
+
+
+bool CachedStore::remove(const uint8_t* key, size_t key_length,
+                         const uint8_t* value, size_t value_length,
+                         size_t item_length, size_t* removed,
+                         std::string* error_msg)
+{
+    bool ok = _store->remove(key, key_length, value, value_length,
+                             item_length, removed, error_msg);
+    invalidate(key, key_length);
+    return ok;
+}
+
+
+void CachedStore::invalidate(const uint8_t* key, size_t key_length)
+{
+    Shard& shard = shard_for(key, key_length);
+    kyotocabinet::ScopedMutex lock(&shard.lock);
+
+    shard.generation++;
+
+    std::unordered_map<std::string, size_t>::iterator i =
+        shard.index.find(std::string((const char*) key, key_length));
+    if (i != shard.index.end()) {
+        remove_entry(shard, i->second);
+    }
+}
+
+
+void CachedStore::add_entry(Shard& shard, const std::string& key, bool found,
+                            const uint8_t* value, size_t value_length)
+{
+    size_t cost = key.length() + value_length + entry_overhead;
+    if (cost > _shard_budget) {
+        return;
+    }
+
+    while (shard.used + cost > _shard_budget) {
+        evict_entry(shard);
+    }
+
+    size_t i;
+    if (!shard.free_entries.empty()) {
+        i = shard.free_entries.back();
+        shard.free_entries.pop_back();
+    }
+    else {
+        i = shard.entries.size();
+        shard.entries.push_back(Entry());
+    }
+
+    Entry& entry = shard.entries[i];
+    entry.key = key;
+    if (found) {
+        entry.value.assign((const char*) value, value_length);
+    }
+    entry.live = true;
+    entry.found = found;
+    entry.referenced = false;
+    entry.cost = cost;
+
+    shard.index[key] = i;
+    shard.used += cost;
+}
+
+
+void CachedStore::evict_entry(Shard& shard)
+{
+    // There is always a live entry when used > 0, so this terminates
+    for (;;) {
+        if (shard.hand >= shard.entries.size()) {
+            shard.hand = 0;
+        }
+
+        Entry& entry = shard.entries[shard.hand++];
+        if (!entry.live) {
+            continue;
+        }
+
+        if (entry.referenced) {
+            entry.referenced = false;
+            continue;
+        }
+
+        remove_entry(shard, shard.hand - 1);
+        return;
+    }
+}
+
+
+void CachedStore::remove_entry(Shard& shard, size_t i)
+{
+    Entry& entry = shard.entries[i];
+
+    shard.index.erase(entry.key);
+    shard.used -= entry.cost;
+    shard.free_entries.push_back(i);
+
+    // Release the memory of the strings
+    std::string().swap(entry.key);
+    std::string().swap(entry.value);
+    entry.live = false;
+}
+
+} // namespace
+
+
+PartitionStore* create_cached_store(PartitionStore* store, size_t cache_size)
+{
+    return new CachedStore(store, cache_size);
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,543 @@
+/* HmSearch hash lookup library - partition key filter
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <kcthread.h>
+#include <kcutil.h>
+
+#include "store.h"
+
+/* A lookup probes the exact and all 1-variant keys of every
+ * partition, e.g. 264 keys for 256-bit hashes with max error 10, and
+ * in a sparse database nearly all of them are missing.  The filter
+ * store keeps a blocked Bloom filter of all partition keys in memory
+ * and answers most of those probes without reaching the store.
+ *
+ * Each key sets probes_per_key bits within one 512-bit block, so a
+ * test touches a single cache line.  At bits_per_key bits per key
+ * this gives roughly a 1-2% false positive rate.
+ *
+ * Since a Bloom filter can't be resized, inserts that fill it up add
+ * a new layer with twice the capacity, and keys are tested against
+ * all layers.  Layers are only ever added, and the bits only ever
+ * set, so get() reads the filter without any locks.  append() adds
+ * the key to the filter before updating the store, so a key is never
+ * filtered out once its record exists.
+ *
+ * Sidecar file format, all integers little-endian:
+ *
+ *   0  "HMSFLT01"
+ *   8  u64 records      stamp() of the store when saved
+ *  16  u64 bytes
+ *  24  u32 layers
+ *  28  u32 reserved
+ *  32  layers, each: u64 capacity, u64 entries, u64 words, words * u64
+ */
+
+static const char filter_magic[8] = { 'H', 'M', 'S', 'F', 'L', 'T', '0', '1' };
+
+static const size_t block_bits = 512;
+static const size_t block_words = block_bits / 64;
+static const int probes_per_key = 7;
+static const size_t bits_per_key = 10;
+
+// Smallest layer capacity, in keys
+static const size_t min_capacity = 65536;
+
+// Capacity doubles with each layer, so this is never reached in practice
+static const size_t max_layers = 32;
+
+static inline uint64_t get_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void put_le64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8) {
+        p[i] = v;
+    }
+}
+
+namespace {
+
+class FilterLayer
+{
+public:
+    FilterLayer(size_t capacity)
+        : _capacity(capacity)
+        , _entries(0)
+        , _blocks(block_count(capacity))
+        , _words(_blocks * block_words)
+        { }
+
+    bool test(uint64_t hash) const {
+        const uint64_t* block = &_words[block_index(hash)];
+        uint64_t bits = probe_bits(hash);
+
+        for (int i = 0; i < probes_per_key; i++, bits >>= 9) {
+            size_t bit = bits & (block_bits - 1);
+            uint64_t word = __atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED);
+            if (!(word & (uint64_t(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void set(uint64_t hash) {
+        uint64_t* block = &_words[block_index(hash)];
+        uint64_t bits = probe_bits(hash);
+
+        for (int i = 0; i < probes_per_key; i++, bits >>= 9) {
+            size_t bit = bits & (block_bits - 1);
+            __atomic_fetch_or(&block[bit / 64], uint64_t(1) << (bit % 64), __ATOMIC_RELAXED);
+        }
+
+        _entries++;
+    }
+
+    bool full() const {
+        return _entries >= _capacity;
+    }
+
+    size_t capacity() const { return _capacity; }
+
+    bool write(FILE* file) const;
+    static FilterLayer* read(FILE* file);
+
+private:
+    static size_t block_count(size_t capacity) {
+        return std::max(size_t(1), capacity * bits_per_key / block_bits);
+    }
+
+    size_t block_index(uint64_t hash) const {
+        return (((hash >> 32) * _blocks) >> 32) * block_words;
+    }
+
+    static uint64_t probe_bits(uint64_t hash) {
+        // Derive the bit positions from bits independent of the block
+        return hash * 0x9e3779b97f4a7c15ULL;
+    }
+
+    size_t _capacity;
+    size_t _entries;    // Only accessed under the store write lock
+    size_t _blocks;
+    std::vector<uint64_t> _words;
+};
+
+
+bool FilterLayer::write(FILE* file) const
+{
+    uint8_t buf[4096];
+
+    put_le64(buf, _capacity);
+    put_le64(buf + 8, _entries);
+    put_le64(buf + 16, _words.size());
+    if (fwrite(buf, 24, 1, file) != 1) {
+        return false;
+    }
+
+    for (size_t i = 0; i < _words.size(); ) {
+        size_t n = std::min(sizeof(buf) / 8, _words.size() - i);
+        for (size_t j = 0; j < n; j++) {
+            put_le64(buf + j * 8, _words[i + j]);
+        }
+        if (fwrite(buf, 8, n, file) != n) {
+            return false;
+        }
+        i += n;
+    }
+
+    return true;
+}
+
+
+FilterLayer* FilterLayer::read(FILE* file)
+{
+    uint8_t buf[4096];
+
+    if (fread(buf, 24, 1, file) != 1) {
+        return NULL;
+    }
+
+    // Check the header before allocating the layer, so that a corrupt
+    // filter file can't make it allocate more than the file holds
+    uint64_t capacity = get_le64(buf);
+    uint64_t words = get_le64(buf + 16);
+    if (capacity < min_capacity || capacity > (uint64_t(1) << 48)
+        || words != block_count(capacity) * block_words) {
+        return NULL;
+    }
+
+    struct stat st;
+    long pos = ftell(file);
+    if (fstat(fileno(file), &st) < 0 || pos < 0
+        || uint64_t(st.st_size - pos) / 8 < words) {
+        return NULL;
+    }
+
+    FilterLayer* layer = new FilterLayer(capacity);
+    layer->_entries = get_le64(buf + 8);
+
+    for (size_t i = 0; i < layer->_words.size(); ) {
+        size_t n = std::min(sizeof(buf) / 8, layer->_words.size() - i);
+        if (fread(buf, 8, n, file) != n) {
+            delete layer;
+            return NULL;
+        }
+        for (size_t j = 0; j < n; j++) {
+            layer->_words[i + j] = get_le64(buf + j * 8);
+        }
+        i += n;
+    }
+
+    return layer;
+}
+
+
+class FilteredStore : public PartitionStore
+{
+public:
+    FilteredStore(PartitionStore* store, const std::string& filter_path, bool writable)
+        : _store(store)
+        , _filter_path(filter_path)
+        , _writable(writable)
+        , _layer_count(0)
+        , _dirty(false)
+        { }
+
+    ~FilteredStore() {
+        for (size_t i = 0; i < _layer_count; i++) {
+            delete _layers[i];
+        }
+        delete _store;
+    }
+
+    /** Load the filter from the sidecar file, or build it from the store.
+     */
+    bool init(std::string* error_msg);
+
+    /** Return the wrapped store, which is no longer owned by this.
+     */
+    PartitionStore* release_store() {
+        PartitionStore* store = _store;
+        _store = NULL;
+        return store;
+    }
+
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result) {
+        // Only partition keys are in the filter
+        if (key[0] == 'P' && !may_contain(kyotocabinet::hashmurmur(key, key_length))) {
+            if (cache_result) {
+                *cache_result = FILTERED;
+            }
+            return false;
+        }
+
+        return _store->get(key, key_length, buffer, value, value_length, cache_result);
+    }
+
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg) {
+        if (key[0] == 'P') {
+            add_key(key, key_length);
+        }
+        else {
+            _dirty = true;
+        }
+        return _store->append(key, key_length, value, value_length, error_msg);
+    }
+
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg) {
+        // Keys of deleted records stay in the filter, they just cost
+        // a fetch like any false positive.  The sidecar must still be
+        // saved with the new stamp.
+        _dirty = true;
+        return _store->remove(key, key_length, value, value_length,
+                              item_length, removed, error_msg);
+    }
+
+    bool flush(std::string* error_msg) {
+        return _store->flush(error_msg);
+    }
+
+    bool increment(const uint8_t* key, size_t key_length,
+                   int64_t num, int64_t* result,
+                   std::string* error_msg) {
+        _dirty = true;
+        return _store->increment(key, key_length, num, result, error_msg);
+    }
+
+    void advise(Advice advice) {
+        _store->advise(advice);
+    }
+
+    void prefetch(const uint8_t* keys, size_t key_length, size_t count) {
+        // Pass on only the keys that may have records
+        std::vector<uint8_t> maybe;
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t* key = keys + i * key_length;
+            if (key[0] != 'P' || may_contain(kyotocabinet::hashmurmur(key, key_length))) {
+                maybe.insert(maybe.end(), key, key + key_length);
+            }
+        }
+        if (!maybe.empty()) {
+            _store->prefetch(maybe.data(), key_length, maybe.size() / key_length);
+        }
+    }
+
+    bool sorted_postings() const {
+        return _store->sorted_postings();
+    }
+
+    bool stamp(uint64_t* records, uint64_t* bytes) {
+        return _store->stamp(records, bytes);
+    }
+
+    bool iterate(Visitor& visitor, std::string* error_msg) {
+        return _store->iterate(visitor, error_msg);
+    }
+
+    bool close(std::string* error_msg);
+
+private:
+    /** Adds all partition keys to the filter when building it.
+     */
+    class BuildVisitor : public Visitor
+    {
+    public:
+        BuildVisitor(FilteredStore* store) : _store(store) {}
+
+        bool visit(const uint8_t* key, size_t key_length,
+                   const uint8_t* value, size_t value_length) {
+            if (key[0] == 'P') {
+                _store->add_key(key, key_length);
+            }
+            return true;
+        }
+
+    private:
+        FilteredStore* _store;
+    };
+
+    bool may_contain(uint64_t hash) const {
+        size_t layers = _layer_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < layers; i++) {
+            if (_layers[i]->test(hash)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void add_key(const uint8_t* key, size_t key_length);
+    void add_layer(size_t capacity);
+    bool load();
+    bool save();
+
+    PartitionStore* _store;
+    std::string _filter_path;
+    bool _writable;
+
+    FilterLayer* _layers[max_layers];
+    std::atomic<size_t> _layer_count;
+
+    // Protects adding keys and layers
+    kyotocabinet::Mutex _lock;
+
+    // True if the sidecar needs to be saved, set by concurrent writers
+    std::atomic<bool> _dirty;
+};
+
+
+bool FilteredStore::init(std::string* error_msg)
+{
+    if (load()) {
+        if (_writable) {
+            unlink(_filter_path.c_str());
+        }
+        return true;
+    }
+
+    for (size_t i = 0; i < _layer_count; i++) {
+        delete _layers[i];
+    }
+    _layer_count = 0;
+
+    // Size the first layer for the present records and some growth
+    uint64_t records = 0, bytes;
+    _store->stamp(&records, &bytes);
+    add_layer(std::max(min_capacity, size_t(records) * 2));
+
+    BuildVisitor visitor(this);
+    if (!_store->iterate(visitor, error_msg)) {
+        return false;
+    }
+
+    _dirty = true;
+    return true;
+}
+
+
+bool FilteredStore::close(std::string* error_msg)
+{
+    // The filter is just an optimisation and is rebuilt when the
+    // sidecar is missing, so errors saving it are ignored
+    if (_dirty && _store->flush(error_msg)) {
+        save();
+    }
+
+    return _store->close(error_msg);
+}
+
+
+void FilteredStore::add_key(const uint8_t* key, size_t key_length)
+{
+    uint64_t hash = kyotocabinet::hashmurmur(key, key_length);
+    kyotocabinet::ScopedMutex lock(&_lock);
+
+    if (may_contain(hash)) {
+        return;
+    }
+
+    FilterLayer* layer = _layers[_layer_count - 1];
+    layer->set(hash);
+    _dirty = true;
+
+    if (layer->full() && _layer_count < max_layers) {
+        add_layer(layer->capacity() * 2);
+    }
+}
+
+
+void FilteredStore::add_layer(size_t capacity)
+{
+    size_t n = _layer_count.load(std::memory_order_relaxed);
+    _layers[n] = new FilterLayer(capacity);
+    _layer_count.store(n + 1, std::memory_order_release);
+}
+
+
+bool FilteredStore::load()
+{
+    uint64_t records, bytes;
+    if (!_store->stamp(&records, &bytes)) {
+        return false;
+    }
+
+    FILE* file = fopen(_filter_path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[32];
+    bool ok = (fread(header, sizeof(header), 1, file) == 1
+               && memcmp(header, filter_magic, sizeof(filter_magic)) == 0
+               && get_le64(header + 8) == records
+               && get_le64(header + 16) == bytes);
+
+    size_t layers = ok ? get_le64(header + 24) & 0xffffffff : 0;
+    ok = ok && layers > 0 && layers <= max_layers;
+
+    for (size_t i = 0; ok && i < layers; i++) {
+        FilterLayer* layer = FilterLayer::read(file);
+        if (layer) {
+            _layers[i] = layer;
+            _layer_count = i + 1;
+        }
+        else {
+            ok = false;
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+
+bool FilteredStore::save()
+{
+    uint64_t records, bytes;
+    if (!_store->stamp(&records, &bytes)) {
+        return false;
+    }
+
+    std::string tmp_path = _filter_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t header[32];
+    memset(header, 0, sizeof(header));
+    memcpy(header, filter_magic, sizeof(filter_magic));
+    put_le64(header + 8, records);
+    put_le64(header + 16, bytes);
+    put_le64(header + 24, _layer_count);
+
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < _layer_count; i++) {
+        ok = _layers[i]->write(file);
+    }
+
+    if (fclose(file) != 0 || !ok || rename(tmp_path.c_str(), _filter_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    _dirty = false;
+    return true;
+}
+
+} // namespace
+
+
+PartitionStore* create_filtered_store(PartitionStore* store,
+                                      const std::string& filter_path,
+                                      bool writable,
+                                      std::string* error_msg)
+{
+    FilteredStore* filtered = new FilteredStore(store, filter_path, writable);
+
+    if (!filtered->init(error_msg)) {
+        // Hand store back to the caller
+        filtered->release_store();
+        delete filtered;
+        return NULL;
+    }
+
+    return filtered;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
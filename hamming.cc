@@ -0,0 +1,429 @@
+/* HmSearch hash lookup library - hamming distance kernels
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAMMING_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAMMING_NEON 1
+#endif
+
+#include "hamming.h"
+
+typedef int (*DistanceFunc)(const uint8_t* a, const uint8_t* b, size_t length);
+
+typedef size_t (*BlockFunc)(const uint8_t* query, const uint8_t* hashes,
+                            size_t length, size_t stride, size_t count,
+                            int max_distance, uint32_t* matches, int* distances);
+
+struct Kernel {
+    const char* name;
+    DistanceFunc distance;
+    BlockFunc block;
+};
+
+
+static const uint8_t one_bits[256] = {
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
+};
+
+
+static inline uint64_t load_word(const uint8_t* p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+
+/* Portable kernel: one table lookup per byte.
+ */
+static int distance_table(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    int distance = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        distance += one_bits[a[i] ^ b[i]];
+    }
+
+    return distance;
+}
+
+
+/* Word-wide kernel body.  This is inlined into functions compiled for
+ * different targets, so that __builtin_popcountll becomes a POPCNT
+ * instruction where that is available.
+ */
+static inline __attribute__((always_inline))
+int distance_words(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    int distance = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        distance += __builtin_popcountll(load_word(a + i) ^ load_word(b + i));
+    }
+
+    for (; i < length; i++) {
+        distance += one_bits[a[i] ^ b[i]];
+    }
+
+    return distance;
+}
+
+
+static inline __attribute__((always_inline))
+size_t distance_block(DistanceFunc distance,
+                      const uint8_t* query, const uint8_t* hashes,
+                      size_t length, size_t stride, size_t count,
+                      int max_distance, uint32_t* matches, int* distances)
+{
+    size_t found = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int d = distance(query, hashes + i * stride, length);
+        if (d <= max_distance) {
+            matches[found] = i;
+            distances[found] = d;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+
+static size_t block_table(const uint8_t* query, const uint8_t* hashes,
+                          size_t length, size_t stride, size_t count,
+                          int max_distance, uint32_t* matches, int* distances)
+{
+    return distance_block(distance_table, query, hashes, length, stride, count,
+                          max_distance, matches, distances);
+}
+
+
+#ifdef HAMMING_X86
+
+__attribute__((target("popcnt")))
+static int distance_popcnt(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    return distance_words(a, b, length);
+}
+
+
+__attribute__((target("popcnt")))
+static size_t block_popcnt(const uint8_t* query, const uint8_t* hashes,
+                           size_t length, size_t stride, size_t count,
+                           int max_distance, uint32_t* matches, int* distances)
+{
+    if (length == 8) {
+        // Keep the query in a register for the common 64-bit hash
+        uint64_t q = load_word(query);
+        size_t found = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            int d = __builtin_popcountll(q ^ load_word(hashes + i * stride));
+            if (d <= max_distance) {
+                matches[found] = i;
+                distances[found] = d;
+                found++;
+            }
+        }
+
+        return found;
+    }
+
+    return distance_block(distance_popcnt, query, hashes, length, stride, count,
+                          max_distance, matches, distances);
+}
+
+
+/* AVX2 kernel, counting bits with a nibble lookup table in PSHUFB and
+ * summing the byte counts with PSADBW.
+ */
+__attribute__((target("avx2,popcnt")))
+static int distance_avx2(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i acc = zero;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i)),
+                                     _mm256_loadu_si256((const __m256i*) (b + i)));
+        __m256i lo = _mm256_and_si256(x, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                        _mm256_shuffle_epi8(lut, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, zero));
+    }
+
+    int distance = (_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1)
+                    + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+
+    return distance + distance_words(a + i, b + i, length - i);
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static size_t block_avx2(const uint8_t* query, const uint8_t* hashes,
+                         size_t length, size_t stride, size_t count,
+                         int max_distance, uint32_t* matches, int* distances)
+{
+    if (length < 32) {
+        // Nothing to vectorise within a hash
+        return block_popcnt(query, hashes, length, stride, count,
+                            max_distance, matches, distances);
+    }
+
+    return distance_block(distance_avx2, query, hashes, length, stride, count,
+                          max_distance, matches, distances);
+}
+
+
+/* AVX-512 kernel using VPOPCNTQ.  Masked loads handle the words
+ * beyond the last full 64-byte chunk, so a 256-bit hash is a single
+ * pass.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static int distance_avx512(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for (; i + 64 <= length; i += 64) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+
+    size_t words = (length - i) / 8;
+    if (words) {
+        __mmask8 mask = (1 << words) - 1;
+        __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, a + i),
+                                     _mm512_maskz_loadu_epi64(mask, b + i));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        i += words * 8;
+    }
+
+    int64_t lanes[8];
+    _mm512_storeu_si512(lanes, acc);
+
+    int distance = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        distance += lanes[lane];
+    }
+
+    for (; i < length; i++) {
+        distance += one_bits[a[i] ^ b[i]];
+    }
+
+    return distance;
+}
+
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t block_avx512(const uint8_t* query, const uint8_t* hashes,
+                           size_t length, size_t stride, size_t count,
+                           int max_distance, uint32_t* matches, int* distances)
+{
+    if (length != 8 || stride != 8) {
+        return distance_block(distance_avx512, query, hashes, length, stride, count,
+                              max_distance, matches, distances);
+    }
+
+    // Densely packed 64-bit hashes: eight of them per vector
+    const __m512i q = _mm512_set1_epi64(load_word(query));
+    const __m512i limit = _mm512_set1_epi64(max_distance);
+    size_t found = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(hashes + i * 8)));
+        __mmask8 hits = _mm512_cmple_epi64_mask(d, limit);
+
+        if (hits) {
+            int64_t lanes[8];
+            _mm512_storeu_si512(lanes, d);
+
+            for (int lane = 0; lane < 8; lane++) {
+                if (hits & (1 << lane)) {
+                    matches[found] = i + lane;
+                    distances[found] = lanes[lane];
+                    found++;
+                }
+            }
+        }
+    }
+
+    for (; i < count; i++) {
+        int d = __builtin_popcountll(load_word(query) ^ load_word(hashes + i * 8));
+        if (d <= max_distance) {
+            matches[found] = i;
+            distances[found] = d;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+#endif // HAMMING_X86
+
+
+#ifdef HAMMING_NEON
+
+/* NEON kernel, counting bits per byte with VCNT and widening the sums
+ * with pairwise adds.
+ */
+static int distance_neon(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t x = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vcntq_u8(x))));
+    }
+
+    int distance = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+
+    return distance + distance_words(a + i, b + i, length - i);
+}
+
+
+static size_t block_neon(const uint8_t* query, const uint8_t* hashes,
+                         size_t length, size_t stride, size_t count,
+                         int max_distance, uint32_t* matches, int* distances)
+{
+    return distance_block(distance_neon, query, hashes, length, stride, count,
+                          max_distance, matches, distances);
+}
+
+#endif // HAMMING_NEON
+
+
+static const Kernel kernels[] = {
+#ifdef HAMMING_X86
+    { "avx512", distance_avx512, block_avx512 },
+    { "avx2", distance_avx2, block_avx2 },
+    { "popcnt", distance_popcnt, block_popcnt },
+#endif
+#ifdef HAMMING_NEON
+    { "neon", distance_neon, block_neon },
+#endif
+    { "table", distance_table, block_table },
+};
+
+static const size_t num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+
+static bool kernel_supported(const Kernel& kernel)
+{
+#ifdef HAMMING_X86
+    __builtin_cpu_init();
+
+    if (kernel.distance == distance_avx512) {
+        return (__builtin_cpu_supports("avx512f")
+                && __builtin_cpu_supports("avx512vpopcntdq")
+                && __builtin_cpu_supports("popcnt"));
+    }
+    if (kernel.distance == distance_avx2) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+    if (kernel.distance == distance_popcnt) {
+        return __builtin_cpu_supports("popcnt");
+    }
+#endif
+
+    return true;
+}
+
+
+static const Kernel* select_kernel()
+{
+    const char* forced = getenv("HMSEARCH_KERNEL");
+
+    if (forced) {
+        for (size_t i = 0; i < num_kernels; i++) {
+            if (strcmp(kernels[i].name, forced) == 0 && kernel_supported(kernels[i])) {
+                return &kernels[i];
+            }
+        }
+    }
+
+    // Kernels are listed in order of preference
+    for (size_t i = 0; i < num_kernels; i++) {
+        if (kernel_supported(kernels[i])) {
+            return &kernels[i];
+        }
+    }
+
+    return &kernels[num_kernels - 1];
+}
+
+
+static const Kernel& kernel()
+{
+    static const Kernel* selected = select_kernel();
+    return *selected;
+}
+
+
+int hamming_distance(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    return kernel().distance(a, b, length);
+}
+
+
+size_t hamming_distance_block(const uint8_t* query,
+                              const uint8_t* hashes,
+                              size_t length, size_t stride, size_t count,
+                              int max_distance,
+                              uint32_t* matches, int* distances)
+{
+    return kernel().block(query, hashes, length, stride, count,
+                          max_distance, matches, distances);
+}
+
+
+const char* hamming_kernel_name()
+{
+    return kernel().name;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
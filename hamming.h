@@ -0,0 +1,56 @@
+/* HmSearch hash lookup library - hamming distance kernels
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __HAMMING_H_INCLUDED__
+#define __HAMMING_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Hamming distance kernels.
+ *
+ * The kernel used is chosen the first time any of these functions are
+ * called, based on the features of the running CPU: AVX-512 VPOPCNTDQ,
+ * AVX2, the POPCNT instruction or NEON, falling back to a portable
+ * table-driven kernel.  The environment variable HMSEARCH_KERNEL can
+ * be set to "table", "popcnt", "avx2", "avx512" or "neon" to force a
+ * particular kernel, which is useful for benchmarking.  Forcing a
+ * kernel that the CPU doesn't support gives the default choice.
+ */
+
+/** Return the number of differing bits between the length bytes
+ * at a and b.
+ */
+int hamming_distance(const uint8_t* a, const uint8_t* b, size_t length);
+
+/** Compare a query against a contiguous block of count hashes of
+ * length bytes each, stored at stride bytes apart (stride >= length).
+ *
+ * For every hash within max_distance of the query, its index in the
+ * block is written to matches[] and its distance to distances[], in
+ * block order.  Both arrays must have room for count entries.
+ *
+ * Returns the number of hashes within max_distance.
+ */
+size_t hamming_distance_block(const uint8_t* query,
+                              const uint8_t* hashes,
+                              size_t length, size_t stride, size_t count,
+                              int max_distance,
+                              uint32_t* matches, int* distances);
+
+/** Return the name of the kernel in use.
+ */
+const char* hamming_kernel_name();
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __HAMMING_H_INCLUDED__
@@ -0,0 +1,487 @@
+/* HmSearch hash library - benchmark tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "hmsearch.h"
+#include "hamming.h"
+
+/* Builds a database of random hashes and times lookups of queries
+ * made by flipping a controlled number of bits in stored hashes.
+ * Everything is generated from a seeded PRNG, so runs with the same
+ * options use the same hashes and queries.
+ *
+ * Recall is checked by comparing the lookup results for a sample of
+ * the queries with a brute-force scan of all hashes.
+ */
+
+struct Options {
+    Options()
+        : hash_bits(256)
+        , max_error(10)
+        , num_hashes(100000)
+        , num_queries(10000)
+        , recall_queries(100)
+        , seed(1)
+        , bulk(false)
+        , compact(false)
+        , ordinals(false)
+        , substrings(-1)
+        {}
+
+    unsigned hash_bits;
+    unsigned max_error;
+    uint64_t num_hashes;
+    size_t num_queries;
+    size_t recall_queries;
+    unsigned long seed;
+    bool bulk;
+    bool compact;
+    bool ordinals;
+    int substrings;
+    std::vector<unsigned> distances;
+};
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static HmSearch::hash_string random_hash(std::mt19937_64& rng, size_t bytes)
+{
+    HmSearch::hash_string hash(bytes, 0);
+    for (size_t i = 0; i < bytes; i += 8) {
+        uint64_t v = rng();
+        for (size_t j = i; j < bytes && j < i + 8; j++, v >>= 8) {
+            hash[j] = v;
+        }
+    }
+    return hash;
+}
+
+/** Flip exactly distance different bits in hash.
+ */
+static HmSearch::hash_string flip_bits(std::mt19937_64& rng,
+                                       const HmSearch::hash_string& hash,
+                                       unsigned distance)
+{
+    HmSearch::hash_string query = hash;
+    std::vector<unsigned> bits(hash.length() * 8);
+    for (size_t i = 0; i < bits.size(); i++) {
+        bits[i] = i;
+    }
+
+    for (unsigned i = 0; i < distance && i < bits.size(); i++) {
+        std::swap(bits[i], bits[i + rng() % (bits.size() - i)]);
+        query[bits[i] / 8] ^= 1 << (bits[i] % 8);
+    }
+
+    return query;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = size_t(p * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+
+/** Return the hamming distance between a and b, counted a byte at a
+ * time so that it doesn't share any code with the kernels it checks.
+ */
+static int naive_distance(const uint8_t* a, const uint8_t* b, size_t length)
+{
+    int distance = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (uint8_t x = a[i] ^ b[i]; x; x &= x - 1) {
+            distance++;
+        }
+    }
+    return distance;
+}
+
+
+/** Add the number of distinct hashes within max_error of the query
+ * to *expected, and how many of them the lookup found to *found.
+ * Matches that are further away than max_error or report the wrong
+ * distance are added to *wrong.
+ */
+static void check_recall(const HmSearch::hash_string& query,
+                         const std::vector<uint8_t>& hashes, size_t hash_bytes,
+                         unsigned max_error,
+                         const HmSearch::LookupResultVector& result,
+                         size_t* expected, size_t* found, size_t* wrong)
+{
+    std::vector<HmSearch::hash_string> exp, got;
+    for (size_t i = 0; i + hash_bytes <= hashes.size(); i += hash_bytes) {
+        if (naive_distance(query.data(), &hashes[i], hash_bytes) <= (int) max_error) {
+            exp.push_back(HmSearch::hash_string(&hashes[i], hash_bytes));
+        }
+    }
+    for (size_t i = 0; i < result.size(); i++) {
+        int distance = naive_distance(query.data(), result.hash(i), hash_bytes);
+        if (distance > (int) max_error || distance != result.distance(i)) {
+            (*wrong)++;
+        }
+        got.push_back(HmSearch::hash_string(result.hash(i), hash_bytes));
+    }
+
+    // The database dedupes identical hashes within a lookup
+    std::sort(exp.begin(), exp.end());
+    exp.erase(std::unique(exp.begin(), exp.end()), exp.end());
+    std::sort(got.begin(), got.end());
+
+    std::vector<HmSearch::hash_string> both;
+    std::set_intersection(exp.begin(), exp.end(), got.begin(), got.end(),
+                          std::back_inserter(both));
+
+    *expected += exp.size();
+    *found += both.size();
+}
+
+
+static bool run_queries(const char* self, HmSearch* db, const Options& opts,
+                        const std::vector<uint8_t>& hashes)
+{
+    size_t hash_bytes = opts.hash_bits / 8;
+    size_t count = hashes.size() / hash_bytes;
+    std::string error_msg;
+
+    // Reused between lookups, so the timings don't include growing it
+    HmSearch::LookupResultVector result;
+
+    printf("%8s %8s %10s %10s %10s %10s %10s %10s %8s\n",
+           "distance", "queries", "matches", "qps",
+           "p50 us", "p95 us", "p99 us", "p999 us", "recall");
+
+    for (size_t d = 0; d < opts.distances.size(); d++) {
+        unsigned distance = opts.distances[d];
+
+        // Same queries for the same options and distance
+        std::mt19937_64 rng(opts.seed * 1000003 + distance);
+
+        std::vector<double> latencies;
+        size_t matches = 0, expected = 0, found = 0, wrong = 0;
+        double start = now();
+
+        for (size_t q = 0; q < opts.num_queries; q++) {
+            size_t i = rng() % count;
+            HmSearch::hash_string query = flip_bits(
+                rng, HmSearch::hash_string(&hashes[i * hash_bytes], hash_bytes), distance);
+
+            result.clear();
+            double t = now();
+            if (!db->lookup(query, result, -1, &error_msg)) {
+                fprintf(stderr, "%s: cannot lookup hash: %s\n", self, error_msg.c_str());
+                return false;
+            }
+            latencies.push_back((now() - t) * 1e6);
+            matches += result.size();
+
+            if (q < opts.recall_queries) {
+                check_recall(query, hashes, hash_bytes, opts.max_error, result,
+                             &expected, &found, &wrong);
+            }
+        }
+
+        double elapsed = now() - start;
+        std::sort(latencies.begin(), latencies.end());
+
+        printf("%8u %8zu %10.2f %10.0f %10.1f %10.1f %10.1f %10.1f ",
+               distance, opts.num_queries,
+               double(matches) / opts.num_queries,
+               opts.num_queries / elapsed,
+               percentile(latencies, 0.50), percentile(latencies, 0.95),
+               percentile(latencies, 0.99), percentile(latencies, 0.999));
+
+        if (expected) {
+            printf("%8.4f\n", double(found) / expected);
+        }
+        else {
+            printf("%8s\n", "-");
+        }
+
+        if (wrong) {
+            fprintf(stderr, "%s: %zu matches of queries with %u flipped bits have a wrong distance "
+                    "or are beyond max error\n", self, wrong, distance);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool parse_distances(const char* arg, std::vector<unsigned>& distances)
+{
+    distances.clear();
+
+    while (*arg) {
+        char* end;
+        unsigned d = strtoul(arg, &end, 10);
+        if (end == arg) {
+            return false;
+        }
+        distances.push_back(d);
+
+        arg = end;
+        if (*arg == ',') {
+            arg++;
+        }
+        else if (*arg) {
+            return false;
+        }
+    }
+
+    return !distances.empty();
+}
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] path\n"
+            "\n"
+            "Create a new database at path, fill it with random hashes and\n"
+            "benchmark lookups.\n"
+            "\n"
+            "Options:\n"
+            "  -b, --hash-bits N      bits per hash (default 256)\n"
+            "  -e, --max-error N      maximum hamming distance (default 10)\n"
+            "  -n, --hashes N         number of hashes to insert (default 100000)\n"
+            "  -q, --queries N        queries per distance (default 10000)\n"
+            "  -d, --distances LIST   comma-separated number of bits to flip in\n"
+            "                         the queries (default 0,max_error/2,max_error,\n"
+            "                         max_error+2)\n"
+            "  -r, --recall N         check recall and match distances of the first\n"
+            "                         N queries per distance against brute force\n"
+            "                         (default 100)\n"
+            "  -s, --seed N           random seed (default 1)\n"
+            "  -B, --bulk             insert with a bulk load\n"
+            "  -c, --compact          also benchmark a compacted copy in path.hmm\n"
+            "  -o, --ordinals         store ordinal postings, see hm_initdb -o\n"
+            "  -i, --multi-index N    use multi-index hashing with N substrings,\n"
+            "                         see hm_initdb -i\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "hash-bits", required_argument, NULL, 'b' },
+        { "max-error", required_argument, NULL, 'e' },
+        { "hashes", required_argument, NULL, 'n' },
+        { "queries", required_argument, NULL, 'q' },
+        { "distances", required_argument, NULL, 'd' },
+        { "recall", required_argument, NULL, 'r' },
+        { "seed", required_argument, NULL, 's' },
+        { "bulk", no_argument, NULL, 'B' },
+        { "compact", no_argument, NULL, 'c' },
+        { "ordinals", no_argument, NULL, 'o' },
+        { "multi-index", required_argument, NULL, 'i' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options opts;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "b:e:n:q:d:r:s:Bcoi:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            opts.hash_bits = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'e':
+            opts.max_error = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'n':
+            opts.num_hashes = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'q':
+            opts.num_queries = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'd':
+            if (!parse_distances(optarg, opts.distances)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'r':
+            opts.recall_queries = strtoul(optarg, NULL, 10);
+            break;
+
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'B':
+            opts.bulk = true;
+            break;
+
+        case 'c':
+            opts.compact = true;
+            break;
+
+        case 'o':
+            opts.ordinals = true;
+            break;
+
+        case 'i':
+            opts.substrings = atoi(optarg);
+            if (opts.substrings < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc || opts.num_hashes == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.distances.empty()) {
+        opts.distances.push_back(0);
+        opts.distances.push_back(opts.max_error / 2);
+        opts.distances.push_back(opts.max_error);
+        opts.distances.push_back(opts.max_error + 2);
+    }
+
+    const char* path = argv[optind];
+    std::string error_msg;
+
+    HmSearch::InitOptions init_options;
+    init_options.ordinal_postings = opts.ordinals;
+    init_options.multi_index = opts.substrings >= 0;
+    init_options.substrings = std::max(opts.substrings, 0);
+
+    if (!HmSearch::init(path, opts.hash_bits, opts.max_error, opts.num_hashes,
+                        init_options, &error_msg)) {
+        fprintf(stderr, "%s: error initalising %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    // Generate all hashes up front, so the insert timing only
+    // includes the database
+    size_t hash_bytes = opts.hash_bits / 8;
+    std::vector<uint8_t> hashes;
+    hashes.reserve(opts.num_hashes * hash_bytes);
+
+    std::mt19937_64 rng(opts.seed);
+    for (uint64_t i = 0; i < opts.num_hashes; i++) {
+        HmSearch::hash_string hash = random_hash(rng, hash_bytes);
+        hashes.insert(hashes.end(), hash.begin(), hash.end());
+    }
+
+    printf("hash_bits %u, max_error %u, %llu hashes, kernel %s\n",
+           opts.hash_bits, opts.max_error, (unsigned long long) opts.num_hashes,
+           hamming_kernel_name());
+
+    std::auto_ptr<HmSearch::BulkLoader> loader;
+    if (opts.bulk) {
+        loader.reset(db->bulk_load("", 0, 0, &error_msg));
+        if (!loader.get()) {
+            fprintf(stderr, "%s: cannot start bulk load: %s\n", argv[0], error_msg.c_str());
+            return 1;
+        }
+    }
+
+    double start = now();
+    for (uint64_t i = 0; i < opts.num_hashes; i++) {
+        HmSearch::hash_string hash(&hashes[i * hash_bytes], hash_bytes);
+        bool ok = (loader.get() ?
+                   loader->add(hash, &error_msg) :
+                   db->insert(hash, &error_msg));
+        if (!ok) {
+            fprintf(stderr, "%s: cannot insert hash: %s\n", argv[0], error_msg.c_str());
+            return 1;
+        }
+    }
+
+    if ((loader.get() && !loader->commit(&error_msg)) || !db->flush(&error_msg)) {
+        fprintf(stderr, "%s: error writing hashes: %s\n", argv[0], error_msg.c_str());
+        return 1;
+    }
+    loader.reset();
+
+    double elapsed = now() - start;
+    printf("insert: %.2f s, %.0f hashes/s%s\n\n",
+           elapsed, opts.num_hashes / elapsed, opts.bulk ? " (bulk)" : "");
+
+    printf("%s:\n", path);
+    if (!run_queries(argv[0], db.get(), opts, hashes)) {
+        return 1;
+    }
+
+    if (opts.compact) {
+        std::string mapped_path = std::string(path) + ".hmm";
+
+        start = now();
+        if (!db->compact(mapped_path, &error_msg)) {
+            fprintf(stderr, "%s: error compacting to %s: %s\n",
+                    argv[0], mapped_path.c_str(), error_msg.c_str());
+            return 1;
+        }
+
+        std::auto_ptr<HmSearch> mapped(HmSearch::open(mapped_path, HmSearch::READONLY, &error_msg));
+        if (!mapped.get()) {
+            fprintf(stderr, "%s: error opening %s: %s\n",
+                    argv[0], mapped_path.c_str(), error_msg.c_str());
+            return 1;
+        }
+
+        printf("\n%s (compacted in %.2f s):\n", mapped_path.c_str(), now() - start);
+        if (!run_queries(argv[0], mapped.get(), opts, hashes)) {
+            return 1;
+        }
+    }
+
+    if (!db->close(&error_msg)) {
+        fprintf(stderr, "%s: error closing database: %s\n",
+                argv[0], error_msg.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,53 @@
+/* HmSearch hash library - compaction tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+
+#include "hmsearch.h"
+
+int main(int argc, char **argv)
+{
+    int arg = 1;
+    bool snapshot = false;
+    if (argc > 1 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "--snapshot") == 0)) {
+        snapshot = true;
+        arg++;
+    }
+
+    if (argc - arg != 2) {
+        fprintf(stderr, "Usage: %s [-s|--snapshot] path mapped_path\n", argv[0]);
+        return 1;
+    }
+
+    const char* path = argv[arg];
+    const char* mapped_path = argv[arg + 1];
+    std::string error_msg;
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READONLY, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    if (!(snapshot ? db->save_snapshot(mapped_path, &error_msg)
+          : db->compact(mapped_path, &error_msg))) {
+        fprintf(stderr, "%s: error writing %s: %s\n", argv[0], mapped_path, error_msg.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
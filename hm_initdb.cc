@@ -7,28 +7,103 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "hmsearch.h"
 
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-s shards] [-p bytes] [-o] [-b buckets] [-m] [-i substrings] [-x] [-a] [-l] path hash_bits max_error num_hashes\n"
+            "\n"
+            "Options:\n"
+            "  -s N   create N shards, with path as the manifest listing them\n"
+            "  -p N   store a payload of N bytes with each hash, e.g. 8 for a 64-bit ID\n"
+            "  -o     store each hash once and only ordinals in the partition records\n"
+            "  -b N   use N hash buckets instead of twice the expected records\n"
+            "  -m     create an empty snapshot for the in-memory backend\n"
+            "  -i N   use multi-index hashing with N substrings (0: chosen from\n"
+            "         num_hashes) instead of HmSearch partitions\n"
+            "  -x     keep an exact index of the hashes for quick duplicate checks\n"
+            "  -a     reserve disk space for the expected data size up front\n"
+            "  -l     append all changes to an insert log at path.log for replicas\n",
+            prog);
+}
+
 int main(int argc, char **argv)
 {
     const char *path;
     unsigned hash_bits;
     unsigned max_error;
     uint64_t num_hashes;
-    
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s path hash_bits max_error num_hashes\n", argv[0]);
+    unsigned shards = 0;
+    HmSearch::InitOptions options;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:ob:mi:xal")) != -1) {
+        switch (opt) {
+        case 's':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'p':
+            options.payload_bytes = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'o':
+            options.ordinal_postings = true;
+            break;
+
+        case 'b':
+            options.buckets = strtoll(optarg, NULL, 10);
+            break;
+
+        case 'm':
+            options.snapshot = true;
+            break;
+
+        case 'i':
+            options.multi_index = true;
+            options.substrings = strtoul(optarg, NULL, 10);
+            break;
+
+        case 'x':
+            options.exact_index = true;
+            break;
+
+        case 'a':
+            options.preallocate = true;
+            break;
+
+        case 'l':
+            options.insert_log = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 4) {
+        usage(argv[0]);
         return 1;
     }
 
-    path = argv[1];
-    hash_bits = strtoul(argv[2], NULL, 10);
-    max_error = strtoul(argv[3], NULL, 10);
-    num_hashes = strtoull(argv[4], NULL, 10);
+    path = argv[optind];
+    hash_bits = strtoul(argv[optind + 1], NULL, 10);
+    max_error = strtoul(argv[optind + 2], NULL, 10);
+    num_hashes = strtoull(argv[optind + 3], NULL, 10);
 
     std::string error_msg;
-    if (!HmSearch::init(path, hash_bits, max_error, num_hashes, &error_msg)) {
+    if (shards > 0) {
+        if (!HmSearch::init_sharded(path, hash_bits, max_error, num_hashes, shards,
+                                    options, &error_msg)) {
+            fprintf(stderr, "%s: error initalising %s: %s\n", argv[0], path, error_msg.c_str());
+            return 1;
+        }
+    }
+    else if (!HmSearch::init(path, hash_bits, max_error, num_hashes, options, &error_msg)) {
         fprintf(stderr, "%s: error initalising %s: %s\n", argv[0], path, error_msg.c_str());
         return 1;
     }
@@ -0,0 +1,188 @@
+/* HmSearch hash library - reading hashes in the tools
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __HM_INPUT_H_INCLUDED__
+#define __HM_INPUT_H_INCLUDED__
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "hmsearch.h"
+
+/** Reads whitespace-separated hexadecimal hashes from a file
+ * descriptor, or in binary mode a stream of raw hashes of a fixed
+ * width.
+ *
+ * The input is read in large blocks and parsed in place, so that
+ * reading a big hash list is limited by I/O rather than by the
+ * iostream machinery.
+ */
+class HashReader
+{
+public:
+    HashReader(int fd = 0, size_t buffer_size = 1 << 20)
+        : _fd(fd)
+        , _buffer(buffer_size)
+        , _start(0)
+        , _end(0)
+        , _word(NULL)
+        , _word_length(0)
+        , _hash_bytes(0)
+        , _eof(false)
+        , _truncated(false)
+        , _errno(0)
+        { }
+
+    /** Read raw hashes of hash_bytes each instead of text.
+     */
+    void set_binary(size_t hash_bytes) {
+        _hash_bytes = hash_bytes;
+    }
+
+    /** Read the next hash into hash.  If the word read isn't a valid
+     * hexadecimal hash, hash is set to an empty string, and word()
+     * returns the offending text.
+     *
+     * Returns false at the end of the input or on read errors, see
+     * error() and truncated().
+     */
+    bool next(HmSearch::hash_string& hash) {
+        if (_hash_bytes) {
+            return next_binary(hash);
+        }
+
+        if (!next_word()) {
+            return false;
+        }
+
+        hash.resize(_word_length / 2);
+        if ((_word_length & 1)
+            || !HmSearch::parse_hexhash(_word, _word_length, &hash[0])) {
+            hash.clear();
+        }
+
+        return true;
+    }
+
+    /** Return the text of the last word read.
+     */
+    std::string word() const {
+        return std::string(_word, _word_length);
+    }
+
+    /** Return the errno of a failed read, or 0 if there was none.
+     */
+    int error() const {
+        return _errno;
+    }
+
+    /** Return true if binary input ended in the middle of a hash.
+     */
+    bool truncated() const {
+        return _truncated;
+    }
+
+private:
+    static bool is_space(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    bool next_word() {
+        for (;;) {
+            while (_start < _end && is_space(_buffer[_start])) {
+                _start++;
+            }
+
+            size_t end = _start;
+            while (end < _end && !is_space(_buffer[end])) {
+                end++;
+            }
+
+            // A word ending at the end of the buffer may continue in
+            // the next block
+            if (end > _start && (end < _end || _eof)) {
+                _word = &_buffer[_start];
+                _word_length = end - _start;
+                _start = end;
+                return true;
+            }
+
+            if (_eof || !fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool next_binary(HmSearch::hash_string& hash) {
+        while (_end - _start < _hash_bytes) {
+            if (_eof) {
+                _truncated = _end > _start;
+                return false;
+            }
+            if (!fill()) {
+                return false;
+            }
+        }
+
+        _word = &_buffer[_start];
+        _word_length = _hash_bytes;
+        hash.assign((const uint8_t*) _word, _hash_bytes);
+        _start += _hash_bytes;
+        return true;
+    }
+
+    bool fill() {
+        // Keep any partial word at the start of the buffer
+        memmove(&_buffer[0], &_buffer[_start], _end - _start);
+        _end -= _start;
+        _start = 0;
+
+        if (_end == _buffer.size()) {
+            _buffer.resize(_buffer.size() * 2);
+        }
+
+        for (;;) {
+            ssize_t n = read(_fd, &_buffer[_end], _buffer.size() - _end);
+            if (n > 0) {
+                _end += n;
+                return true;
+            }
+            if (n == 0) {
+                _eof = true;
+                return true;
+            }
+            if (errno != EINTR) {
+                _errno = errno;
+                return false;
+            }
+        }
+    }
+
+    int _fd;
+    std::vector<char> _buffer;
+    size_t _start;
+    size_t _end;
+    const char* _word;
+    size_t _word_length;
+    size_t _hash_bytes;     // 0 for text input
+    bool _eof;
+    bool _truncated;
+    int _errno;
+};
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __HM_INPUT_H_INCLUDED__
@@ -4,35 +4,167 @@
  * Distributed under an MIT license, please see LICENSE in the top dir.
  */
 
-
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 
-#include <iostream>
 #include <memory>
 
 #include "hmsearch.h"
+#include "hm_input.h"
+
+// Set by --unique
+static bool unique = false;
+
+static bool insert(HmSearch* db, HmSearch::BulkLoader* loader,
+                   const HmSearch::hash_string& hash, const HmSearch::hash_string& payload,
+                   std::string* error_msg)
+{
+    if (loader) {
+        return loader->add(hash, payload, error_msg);
+    }
+
+    if (unique) {
+        return db->insert_unique(hash, payload, NULL, error_msg);
+    }
+
+    return db->insert(hash, payload, error_msg);
+}
+
+// Long-only option, outside the range of the short ones
+static const int binary_option = 256;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] path [hexhash [hexpayload]...]\n"
+            "\n"
+            "If the database stores payloads, each hash is followed by its payload.\n"
+            "\n"
+            "Options:\n"
+            "  -b, --bulk         build the partition records with a sorted bulk load\n"
+            "  -T, --tmpdir DIR   directory for bulk load run files (default $TMPDIR or /tmp)\n"
+            "  -M, --memory MB    memory to use for bulk load runs (default 256)\n"
+            "  -j, --threads N    sort and write the bulk load partitions on N threads\n"
+            "                     (default 1, 0: one per CPU)\n"
+            "  -B, --buffer MB    buffer inserts in memory, writing them in group commits\n"
+            "  -u, --unique       skip hashes that are already in the database\n"
+            "  -f, --filter       keep the partition key filter of the database up to date\n"
+            "      --binary       read raw hashes of the database width from stdin,\n"
+            "                     each directly followed by its raw payload\n",
+            prog);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s path [hexhash...]\n", argv[0]);
+    static const struct option long_options[] = {
+        { "bulk", no_argument, NULL, 'b' },
+        { "tmpdir", required_argument, NULL, 'T' },
+        { "memory", required_argument, NULL, 'M' },
+        { "threads", required_argument, NULL, 'j' },
+        { "buffer", required_argument, NULL, 'B' },
+        { "filter", no_argument, NULL, 'f' },
+        { "unique", no_argument, NULL, 'u' },
+        { "binary", no_argument, NULL, binary_option },
+        { NULL, 0, NULL, 0 }
+    };
+
+    bool bulk = false;
+    bool binary = false;
+    std::string tmp_dir;
+    size_t memory_limit = 0;
+    int threads = 1;
+    HmSearch::OpenOptions options;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "bT:M:j:B:fu", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            bulk = true;
+            break;
+
+        case 'T':
+            tmp_dir = optarg;
+            break;
+
+        case 'M':
+            memory_limit = size_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'B':
+            options.insert_buffer = size_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case 'f':
+            options.key_filter = true;
+            break;
+
+        case 'u':
+            unique = true;
+            break;
+
+        case binary_option:
+            binary = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || (bulk && unique)) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *path = argv[1];
+    const char *path = argv[optind];
     std::string error_msg;
     
-    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, &error_msg));
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, options, &error_msg));
     if (!db.get()) {
         fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
         return 1;
     }
 
-    if (argc > 2) {
+    std::auto_ptr<HmSearch::BulkLoader> loader;
+    if (bulk) {
+        loader.reset(db->bulk_load(tmp_dir, memory_limit, threads, &error_msg));
+        if (!loader.get()) {
+            fprintf(stderr, "%s: cannot start bulk load: %s\n", argv[0], error_msg.c_str());
+            return 1;
+        }
+    }
+
+    const size_t hash_bytes = db->hash_bits() / 8;
+    const bool payloads = db->payload_bytes() > 0;
+
+    if (optind + 1 < argc) {
         // Insert hashes from command line
-        for (int i = 2; i < argc; i++) {
+        int step = payloads ? 2 : 1;
+        if ((argc - optind - 1) % step) {
+            fprintf(stderr, "%s: missing payload of the last hash\n", argv[0]);
+            return 1;
+        }
+
+        for (int i = optind + 1; i < argc; i += step) {
             const char *hexhash = argv[i];
-            if (!db->insert(HmSearch::parse_hexhash(hexhash), &error_msg)) {
+            HmSearch::hash_string payload;
+            if (payloads) {
+                payload = HmSearch::parse_hexhash(argv[i + 1]);
+            }
+
+            if (!insert(db.get(), loader.get(), HmSearch::parse_hexhash(hexhash), payload,
+                        &error_msg)) {
                 fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
                         argv[0], error_msg.c_str(), hexhash);
             }
@@ -40,13 +172,57 @@ int main(int argc, char **argv)
     }
     else {
         // Read hashes from stdin
-        std::string hexhash;
-        while (std::cin >> hexhash) {
-            if (!db->insert(HmSearch::parse_hexhash(hexhash), &error_msg)) {
+        HashReader reader;
+        HmSearch::hash_string hash, payload;
+
+        if (binary) {
+            reader.set_binary(hash_bytes + db->payload_bytes());
+        }
+
+        while (reader.next(hash)) {
+            bool valid = !hash.empty();
+            if (!valid) {
+                fprintf(stderr, "%s: invalid hash: %s\n", argv[0], reader.word().c_str());
+            }
+
+            if (binary && payloads) {
+                payload = hash.substr(hash_bytes);
+                hash.erase(hash_bytes);
+            }
+            else if (payloads && !reader.next(payload)) {
+                fprintf(stderr, "%s: missing payload of the last hash\n", argv[0]);
+                return 1;
+            }
+
+            if (!valid) {
+                continue;
+            }
+
+            if (payloads && payload.empty()) {
+                fprintf(stderr, "%s: invalid payload: %s\n", argv[0], reader.word().c_str());
+            }
+            else if (!insert(db.get(), loader.get(), hash, payload, &error_msg)) {
                 fprintf(stderr, "%s: cannot insert hash: %s (%s)\n",
-                        argv[0], error_msg.c_str(), hexhash.c_str());
+                        argv[0], error_msg.c_str(), HmSearch::format_hexhash(hash).c_str());
             }
         }
+
+        if (reader.error()) {
+            fprintf(stderr, "%s: error reading hashes: %s\n",
+                    argv[0], strerror(reader.error()));
+            return 1;
+        }
+
+        if (reader.truncated()) {
+            fprintf(stderr, "%s: input ends with a partial hash\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (loader.get() && !loader->commit(&error_msg)) {
+        fprintf(stderr, "%s: error writing bulk load: %s\n",
+                argv[0], error_msg.c_str());
+        return 1;
     }
 
     if (!db->close(&error_msg)) {
@@ -5,63 +5,493 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
 
-#include <iostream>
 #include <memory>
+#include <vector>
 
 #include "hmsearch.h"
+#include "hm_input.h"
+
+// Number of stdin hashes passed to each HmSearch::lookup_batch() call
+static const size_t batch_size = 1024;
+
+// Number of stdin hashes passed to each HmSearch::parallel_lookup() call
+static const size_t parallel_batch_size = 65536;
+
+// Long-only options, outside the range of the short ones
+static const int binary_option = 256;
+static const int map_option = 257;
+static const int memory_option = 258;
+static const int advise_option = 259;
+static const int prefetch_option = 260;
+
+// Set by --binary
+static bool binary_io = false;
+
+/** Print a match of the query with the given input index.
+ *
+ * In binary mode each match is written as a record of the query
+ * index as a little-endian 64-bit integer, the raw matching hash, its
+ * raw payload (if any) and the distance as a little-endian 16-bit
+ * integer.
+ */
+static void print_match(uint64_t query, const uint8_t* hash, size_t length,
+                        const uint8_t* payload, size_t payload_length, int distance)
+{
+    static std::vector<char> line;
+    if (line.size() < (length + payload_length) * 2 + 16) {
+        line.resize((length + payload_length) * 2 + 16);
+    }
+
+    if (binary_io) {
+        for (int i = 0; i < 8; i++, query >>= 8) {
+            line[i] = query;
+        }
+        memcpy(&line[8], hash, length);
+        memcpy(&line[8 + length], payload, payload_length);
+
+        size_t n = 8 + length + payload_length;
+        line[n] = distance;
+        line[n + 1] = distance >> 8;
+
+        fwrite_unlocked(line.data(), 1, n + 2, stdout);
+        return;
+    }
+
+    HmSearch::format_hexhash(hash, length, line.data());
+    size_t n = length * 2;
+    line[n++] = ' ';
+
+    if (payload_length) {
+        HmSearch::format_hexhash(payload, payload_length, &line[n]);
+        n += payload_length * 2;
+        line[n++] = ' ';
+    }
+
+    char digits[12];
+    int d = 0;
+    do {
+        digits[d++] = '0' + distance % 10;
+        distance /= 10;
+    } while (distance > 0);
+    while (d > 0) {
+        line[n++] = digits[--d];
+    }
+    line[n++] = '\n';
+
+    fwrite_unlocked(line.data(), 1, n, stdout);
+}
+
+/** Read up to count hashes from reader into queries, setting *more to
+ * false at the end of the input.  Returns false after reporting
+ * invalid hashes or read errors.
+ */
+static bool read_queries(const char *self, HashReader& reader, size_t count,
+                         std::vector<HmSearch::hash_string>& queries, bool* more)
+{
+    HmSearch::hash_string hash;
+    queries.clear();
+
+    while (queries.size() < count) {
+        if (!reader.next(hash)) {
+            *more = false;
+            if (reader.error()) {
+                fprintf(stderr, "%s: error reading hashes: %s\n", self, strerror(reader.error()));
+                return false;
+            }
+            if (reader.truncated()) {
+                fprintf(stderr, "%s: input ends with a partial hash\n", self);
+                return false;
+            }
+            return true;
+        }
+
+        if (hash.empty()) {
+            fprintf(stderr, "%s: invalid hash: %s\n", self, reader.word().c_str());
+            return false;
+        }
+
+        queries.push_back(hash);
+    }
+
+    return true;
+}
+
+static void print_matches(uint64_t query, const HmSearch::LookupResultList& matches)
+{
+    for (HmSearch::LookupResultList::const_iterator i = matches.begin();
+         i != matches.end();
+         ++i) {
+        print_match(query, i->hash.data(), i->hash.length(),
+                    i->payload.data(), i->payload.length(), i->distance);
+    }
+}
+
+/** Prints matches straight from the lookup buffers. */
+class PrintVisitor : public HmSearch::ResultVisitor
+{
+public:
+    PrintVisitor(size_t hash_bytes, size_t payload_bytes)
+        : query(0), _hash_bytes(hash_bytes), _payload_bytes(payload_bytes)
+        {}
+
+    bool visit(const uint8_t* hash, int distance) {
+        print_match(query, hash, _hash_bytes, hash + _hash_bytes, _payload_bytes, distance);
+        return true;
+    }
+
+    uint64_t query;
+
+private:
+    size_t _hash_bytes;
+    size_t _payload_bytes;
+};
+
+class PrintSink : public HmSearch::LookupSink
+{
+public:
+    PrintSink() : base(0) {}
+
+    bool results(size_t first, std::vector<HmSearch::LookupResultList>& results) {
+        for (size_t i = 0; i < results.size(); i++) {
+            print_matches(base + first + i, results[i]);
+        }
+        return true;
+    }
+
+    // Index of the first query passed to parallel_lookup()
+    uint64_t base;
+};
+
+static void usage(const char *self)
+{
+    fprintf(stderr,
+            "Usage: %s [-j threads [-u] | -k K | -1 | -x] [-c MB] [-f] [--binary]\n"
+            "          [--map MB] [--memory cache|stash] [--advise random|willneed]\n"
+            "          [--prefetch]\n"
+            "          path [hexhash...]\n"
+            "\n"
+            "  -j, --threads N    lookup stdin hashes on N threads (0: one per CPU)\n"
+            "  -u, --unordered    print matches as soon as they are found,\n"
+            "                     instead of in input order\n"
+            "  -k, --nearest K    only print the K nearest matches of each hash\n"
+            "  -1, --first        only print the first match found for each hash\n"
+            "  -x, --exact-first  only print the exact copies of hashes that are in\n"
+            "                     the database, and all matches of the others\n"
+            "  -c, --cache MB     cache partition records in memory\n"
+            "  -f, --filter       skip missing partition keys with an in-memory filter\n"
+            "      --binary       read raw hashes from stdin and write binary match\n"
+            "                     records: u64 query index, hash, payload, u16 distance\n"
+            "      --map MB       memory map this much of the database file\n"
+            "      --memory TYPE  copy the database into a Kyoto CacheDB or StashDB\n"
+            "      --advise HINT  tell the OS the database is read randomly, or\n"
+            "                     will be needed in full\n"
+            "      --prefetch     start reading all records of a lookup before\n"
+            "                     probing them\n",
+            self);
+}
+
+/** Read hashes from stdin and look them up with parallel_lookup(). */
+static int parallel_lookup(const char *self, HmSearch& db, HashReader& reader,
+                           unsigned threads, bool ordered)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::string error_msg;
+    PrintSink sink;
+    bool more = true;
+
+    while (more) {
+        if (!read_queries(self, reader, parallel_batch_size, queries, &more)) {
+            return 1;
+        }
+
+        if (!db.parallel_lookup(queries, sink, threads, ordered, -1, &error_msg)) {
+            fprintf(stderr, "%s: cannot lookup hashes: %s\n", self, error_msg.c_str());
+            return 1;
+        }
+
+        sink.base += queries.size();
+    }
+
+    return 0;
+}
+
+/** Lookup hashes from the command line or stdin one at a time with
+ * lookup_topk() or lookup_first(). */
+static int nearest_lookup(const char *self, HmSearch& db, HashReader& reader,
+                          int argc, char **argv, size_t nearest)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::string error_msg;
+    uint64_t base = 0;
+    bool more = true;
+
+    for (int i = 0; i < argc; i++) {
+        queries.push_back(HmSearch::parse_hexhash(argv[i]));
+    }
+
+    while (more) {
+        if (argc > 0) {
+            more = false;
+        }
+        else if (!read_queries(self, reader, batch_size, queries, &more)) {
+            return 1;
+        }
+
+        for (size_t i = 0; i < queries.size(); i++) {
+            HmSearch::LookupResultList matches;
+            bool ok = (nearest > 0 ?
+                       db.lookup_topk(queries[i], nearest, matches, -1, &error_msg) :
+                       db.lookup_first(queries[i], matches, -1, &error_msg));
+            if (!ok) {
+                fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
+                        self, error_msg.c_str(), HmSearch::format_hexhash(queries[i]).c_str());
+                return 1;
+            }
+
+            print_matches(base + i, matches);
+        }
+
+        base += queries.size();
+    }
+
+    return 0;
+}
+
+/** Lookup hashes from the command line or stdin one at a time with
+ * lookup_exact(), and with lookup() only if they have no exact copies. */
+static int exact_first_lookup(const char *self, HmSearch& db, HashReader& reader,
+                              int argc, char **argv)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::string error_msg;
+    uint64_t base = 0;
+    bool more = true;
+
+    for (int i = 0; i < argc; i++) {
+        queries.push_back(HmSearch::parse_hexhash(argv[i]));
+    }
+
+    while (more) {
+        if (argc > 0) {
+            more = false;
+        }
+        else if (!read_queries(self, reader, batch_size, queries, &more)) {
+            return 1;
+        }
+
+        for (size_t i = 0; i < queries.size(); i++) {
+            HmSearch::LookupResultList matches;
+            bool ok = db.lookup_exact(queries[i], matches, &error_msg);
+            if (ok && matches.empty()) {
+                ok = db.lookup(queries[i], matches, -1, &error_msg);
+            }
+            if (!ok) {
+                fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
+                        self, error_msg.c_str(), HmSearch::format_hexhash(queries[i]).c_str());
+                return 1;
+            }
+
+            print_matches(base + i, matches);
+        }
+
+        base += queries.size();
+    }
+
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s path [hexhash...]\n", argv[0]);
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 'j' },
+        { "unordered", no_argument, NULL, 'u' },
+        { "cache", required_argument, NULL, 'c' },
+        { "filter", no_argument, NULL, 'f' },
+        { "nearest", required_argument, NULL, 'k' },
+        { "first", no_argument, NULL, '1' },
+        { "exact-first", no_argument, NULL, 'x' },
+        { "binary", no_argument, NULL, binary_option },
+        { "map", required_argument, NULL, map_option },
+        { "memory", required_argument, NULL, memory_option },
+        { "advise", required_argument, NULL, advise_option },
+        { "prefetch", no_argument, NULL, prefetch_option },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int threads = -1;
+    bool ordered = true;
+    int nearest = -1;
+    bool exact_first = false;
+    HmSearch::OpenOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "j:uc:fk:1x", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'u':
+            ordered = false;
+            break;
+
+        case 'c':
+            options.cache_size = size_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case 'f':
+            options.key_filter = true;
+            break;
+
+        case 'k':
+            nearest = atoi(optarg);
+            if (nearest <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case '1':
+            nearest = 0;
+            break;
+
+        case 'x':
+            exact_first = true;
+            break;
+
+        case binary_option:
+            binary_io = true;
+            break;
+
+        case map_option:
+            options.map_size = int64_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case memory_option:
+            if (strcmp(optarg, "cache") == 0) {
+                options.backend = HmSearch::CACHE_BACKEND;
+            }
+            else if (strcmp(optarg, "stash") == 0) {
+                options.backend = HmSearch::STASH_BACKEND;
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case advise_option:
+            if (strcmp(optarg, "random") == 0) {
+                options.advice = HmSearch::ADVISE_RANDOM;
+            }
+            else if (strcmp(optarg, "willneed") == 0) {
+                options.advice = HmSearch::ADVISE_WILLNEED;
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case prefetch_option:
+            options.prefetch = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    const char *path = argv[1];
+    const char *path = argv[optind];
     std::string error_msg;
     
-    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READONLY, &error_msg));
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READONLY, options, &error_msg));
     if (!db.get()) {
         fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
         return 1;
     }
 
-    if (argc > 2) {
+    if (!isatty(1)) {
+        // Write the matches in large blocks too
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+    }
+
+    HashReader reader;
+    if (binary_io) {
+        reader.set_binary(db->hash_bits() / 8);
+    }
+
+    if (nearest >= 0) {
+        return nearest_lookup(argv[0], *db, reader, argc - optind - 1, argv + optind + 1, nearest);
+    }
+    else if (exact_first) {
+        return exact_first_lookup(argv[0], *db, reader, argc - optind - 1, argv + optind + 1);
+    }
+    else if (optind + 1 < argc) {
         // Lookup hashes from command line
-        for (int i = 2; i < argc; i++) {
+        PrintVisitor visitor(db->hash_bits() / 8, db->payload_bytes());
+
+        for (int i = optind + 1; i < argc; i++) {
             const char *hexhash = argv[i];
 
-            HmSearch::LookupResultList matches;
-            if (!db->lookup(HmSearch::parse_hexhash(hexhash), matches, -1, &error_msg)) {
+            visitor.query = i - optind - 1;
+            if (!db->lookup(HmSearch::parse_hexhash(hexhash), visitor, -1, &error_msg)) {
                 fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
                         argv[0], error_msg.c_str(), hexhash);
                 return 1;
             }
-
-            for (HmSearch::LookupResultList::const_iterator i = matches.begin();
-                 i != matches.end();
-                 ++i) {
-                std::cout << HmSearch::format_hexhash(i->hash) << " " << i->distance << std::endl;
-            }
         }
     }
+    else if (threads >= 0) {
+        return parallel_lookup(argv[0], *db, reader, threads, ordered);
+    }
     else {
-        // Read hashes from stdin
-        std::string hexhash;
-        while (std::cin >> hexhash) {
-            HmSearch::LookupResultList matches;
-            if (!db->lookup(HmSearch::parse_hexhash(hexhash), matches, -1, &error_msg)) {
-                fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
-                        argv[0], error_msg.c_str(), hexhash.c_str());
+        // Read hashes from stdin, looking them up in batches
+        std::vector<HmSearch::hash_string> queries;
+        uint64_t base = 0;
+        bool more = true;
+
+        while (more) {
+            if (!read_queries(argv[0], reader, batch_size, queries, &more)) {
                 return 1;
             }
 
-            for (HmSearch::LookupResultList::const_iterator i = matches.begin();
-                 i != matches.end();
-                 ++i) {
-                std::cout << HmSearch::format_hexhash(i->hash) << " " << i->distance << std::endl;
+            std::vector<HmSearch::LookupResultList> matches;
+            if (!db->lookup_batch(queries, matches, -1, &error_msg)) {
+                // Redo the lookups one by one to report the failing hash
+                for (size_t i = 0; i < queries.size(); i++) {
+                    HmSearch::LookupResultList single;
+                    if (!db->lookup(queries[i], single, -1, &error_msg)) {
+                        fprintf(stderr, "%s: cannot lookup hash: %s (%s)\n",
+                                argv[0], error_msg.c_str(),
+                                HmSearch::format_hexhash(queries[i]).c_str());
+                        return 1;
+                    }
+                    print_matches(base + i, single);
+                }
             }
+            else {
+                for (size_t i = 0; i < matches.size(); i++) {
+                    print_matches(base + i, matches[i]);
+                }
+            }
+
+            base += queries.size();
         }
     }
 
@@ -0,0 +1,70 @@
+/* HmSearch hash library - merge tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <memory>
+
+#include "hmsearch.h"
+
+int main(int argc, char **argv)
+{
+    int arg = 1;
+    bool logs = false;
+    if (argc > 1 && (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "--log") == 0)) {
+        logs = true;
+        arg++;
+    }
+
+    if (argc - arg < 2) {
+        fprintf(stderr, "Usage: %s [-l|--log] path source...\n", argv[0]);
+        return 1;
+    }
+
+    const char* path = argv[arg++];
+    std::string error_msg;
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    // Insert logs are applied in order, and the sequence number the
+    // database has reached is printed so that the next run can tell
+    // which logs it still needs
+    uint64_t sequence = 0;
+    for (; arg < argc; arg++) {
+        const char* source = argv[arg];
+
+        if (!(logs ? db->apply_log(source, &sequence, &error_msg)
+              : db->merge(source, &error_msg))) {
+            fprintf(stderr, "%s: error merging %s: %s\n", argv[0], source, error_msg.c_str());
+            return 1;
+        }
+    }
+
+    if (!db->close(&error_msg)) {
+        fprintf(stderr, "%s: error closing %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    if (logs) {
+        printf("%" PRIu64 "\n", sequence);
+    }
+
+    return 0;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,141 @@
+/* HmSearch hash library - remove tool
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <memory>
+
+#include "hmsearch.h"
+#include "hm_input.h"
+
+// Long-only option, outside the range of the short ones
+static const int binary_option = 256;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] path [hexhash...]\n"
+            "\n"
+            "Remove all copies of the hashes from the database.\n"
+            "\n"
+            "Options:\n"
+            "  -f, --filter       keep the partition key filter of the database up to date\n"
+            "      --binary       read raw hashes of the database width from stdin\n",
+            prog);
+}
+
+static bool remove_hash(const char* prog, HmSearch* db, const HmSearch::hash_string& hash)
+{
+    std::string error_msg;
+
+    if (!db->remove(hash, NULL, &error_msg)) {
+        fprintf(stderr, "%s: cannot remove hash: %s (%s)\n",
+                prog, error_msg.c_str(), HmSearch::format_hexhash(hash).c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "filter", no_argument, NULL, 'f' },
+        { "binary", no_argument, NULL, binary_option },
+        { NULL, 0, NULL, 0 }
+    };
+
+    bool binary = false;
+    HmSearch::OpenOptions options;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            options.key_filter = true;
+            break;
+
+        case binary_option:
+            binary = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    std::string error_msg;
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, HmSearch::READWRITE, options, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    bool ok = true;
+
+    if (optind + 1 < argc) {
+        // Remove hashes from command line
+        for (int i = optind + 1; i < argc; i++) {
+            ok = remove_hash(argv[0], db.get(), HmSearch::parse_hexhash(argv[i])) && ok;
+        }
+    }
+    else {
+        // Read hashes from stdin
+        HashReader reader;
+        HmSearch::hash_string hash;
+
+        if (binary) {
+            reader.set_binary(db->hash_bits() / 8);
+        }
+
+        while (reader.next(hash)) {
+            if (hash.empty()) {
+                fprintf(stderr, "%s: invalid hash: %s\n", argv[0], reader.word().c_str());
+                ok = false;
+            }
+            else {
+                ok = remove_hash(argv[0], db.get(), hash) && ok;
+            }
+        }
+
+        if (reader.error()) {
+            fprintf(stderr, "%s: error reading hashes: %s\n",
+                    argv[0], strerror(reader.error()));
+            return 1;
+        }
+
+        if (reader.truncated()) {
+            fprintf(stderr, "%s: input ends with a partial hash\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!db->close(&error_msg)) {
+        fprintf(stderr, "%s: error closing database: %s\n",
+                argv[0], error_msg.c_str());
+        return 1;
+    }
+
+    return ok ? 0 : 1;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,1193 @@
+/* HmSearch hash library - lookup server
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <kcthread.h>
+
+#include "hmsearch.h"
+
+/* The protocol is a stream of binary frames in both directions, with
+ * all integers little-endian.  A request is a 12-byte header followed
+ * by length bytes of body:
+ *
+ *   u32 length, u32 id, u8 op, u8 reserved, i16 max_error
+ *
+ * id is chosen by the client and copied into the response.  max_error
+ * reduces the maximum accepted error of lookups if >= 0, and is -1 for
+ * the database default.  The ops and their bodies are:
+ *
+ *   1 LOOKUP        one hash
+ *   2 LOOKUP_BATCH  up to 4096 hashes back to back
+ *   3 INSERT        any number of hashes, each followed by its payload
+ *
+ * A response is a 12-byte header followed by length bytes of body:
+ *
+ *   u32 length, u32 id, u8 status, u8 op, u16 reserved
+ *
+ * On errors status is 1 and the body is the error message.  Otherwise
+ * status is 0 and the body of a LOOKUP holds u32 count followed by
+ * count matches of hash, payload and u16 distance.  LOOKUP_BATCH has
+ * one such list per query, in query order, and INSERT the u32 number
+ * of hashes inserted.
+ *
+ * Clients may send any number of requests without waiting for the
+ * responses, which come back in the order they complete rather than
+ * the order they were sent.
+ *
+ * The main thread runs an epoll loop that accepts connections, reads
+ * and parses requests and writes responses.  Complete requests are
+ * queued for a pool of worker threads, which take consecutive LOOKUP
+ * requests with the same max_error (from any connection) in one
+ * lookup_batch() call, like HmSearch::LookupQueue.  Finished
+ * responses are passed back to the main thread through a queue and
+ * an eventfd.
+ *
+ * A connection isn't read from while it has max_pending requests or
+ * max_queued bytes of requests in the workers, or more than
+ * max_unsent bytes of responses the client hasn't read, so a client
+ * can't queue unbounded work or make the server buffer unbounded
+ * output.  Complete requests already read are held back until it is
+ * below the limits again.
+ *
+ * On SIGINT or SIGTERM the server stops accepting connections and
+ * reading requests, drops the requests it has read but not queued,
+ * and closes each connection once the responses to its queued
+ * requests are written.  When that takes longer than
+ * shutdown_timeout, or a second signal arrives, the requests not yet
+ * started are dropped and the responses not yet written are lost.
+ */
+
+enum Op {
+    OP_LOOKUP = 1,
+    OP_LOOKUP_BATCH = 2,
+    OP_INSERT = 3
+};
+
+static const size_t header_size = 12;
+
+// Larger requests are answered with an error and the connection closed
+static const size_t max_frame = 64 << 20;
+
+// Requests of one connection that can be queued or running at a time
+static const size_t max_pending = 1024;
+
+// Bytes of requests of one connection that can be queued or running
+// at a time.  A single larger request is still taken when the
+// connection has nothing else queued.
+static const size_t max_queued = 16 << 20;
+
+// Bytes of responses waiting for a client to read them before no
+// more of its requests are taken
+static const size_t max_unsent = 16 << 20;
+
+// Seconds to spend writing the last responses when stopping
+static const double shutdown_timeout = 10;
+
+// The most LOOKUP requests a worker takes in one lookup_batch()
+static const size_t batch_size = 64;
+
+// The most hashes in a LOOKUP_BATCH request, which bounds the results
+// a worker collects for one response
+static const size_t max_batch_queries = 4096;
+
+// Bytes read from a connection at a time
+static const size_t read_size = 256 << 10;
+
+// epoll tokens below first_connection are the eventfd, the
+// signalfd and the listening sockets
+static const uint64_t wakeup_token = 0;
+static const uint64_t signal_token = 1;
+static const uint64_t first_listener = 2;
+static const uint64_t first_connection = 1 << 16;
+
+// Long-only options, outside the range of the short ones
+static const int map_option = 256;
+static const int prefetch_option = 257;
+
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put_u16(std::string& s, unsigned v)
+{
+    s.push_back(char(v));
+    s.push_back(char(v >> 8));
+}
+
+static void put_u32(std::string& s, uint32_t v)
+{
+    for (int i = 0; i < 32; i += 8) {
+        s.push_back(char(v >> i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static void set_u32(std::string& s, size_t pos, uint32_t v)
+{
+    for (int i = 0; i < 4; i++, v >>= 8) {
+        s[pos + i] = char(v);
+    }
+}
+
+/** Start a response frame in out, to be completed by end_response(). */
+static size_t begin_response(std::string& out, uint32_t id, unsigned op, bool ok)
+{
+    size_t start = out.size();
+    put_u32(out, 0);
+    put_u32(out, id);
+    out.push_back(ok ? 0 : 1);
+    out.push_back(char(op));
+    put_u16(out, 0);
+    return start;
+}
+
+static void end_response(std::string& out, size_t start)
+{
+    set_u32(out, start, out.size() - start - header_size);
+}
+
+static void error_response(std::string& out, uint32_t id, unsigned op,
+                           const std::string& error_msg)
+{
+    size_t start = begin_response(out, id, op, false);
+    out += error_msg;
+    end_response(out, start);
+}
+
+static void put_matches(std::string& out, const HmSearch::LookupResultList& matches)
+{
+    put_u32(out, matches.size());
+    for (HmSearch::LookupResultList::const_iterator i = matches.begin();
+         i != matches.end();
+         ++i) {
+        out.append((const char*) i->hash.data(), i->hash.length());
+        out.append((const char*) i->payload.data(), i->payload.length());
+        put_u16(out, i->distance);
+    }
+}
+
+
+class Server
+{
+public:
+    Server(HmSearch& db, bool writable)
+        : _db(db)
+        , _hash_bytes(db.hash_bits() / 8)
+        , _payload_bytes(db.payload_bytes())
+        , _writable(writable)
+        , _epoll(-1)
+        , _wakeup(-1)
+        , _signals(-1)
+        , _next_connection(first_connection)
+        , _stop(false)
+        {}
+
+    ~Server();
+
+    /** Listen on a TCP address given as [host:]port. */
+    bool listen_tcp(const std::string& address, std::string* error_msg);
+
+    /** Listen on a Unix domain socket, replacing any socket at path. */
+    bool listen_unix(const std::string& path, std::string* error_msg);
+
+    /** Serve requests on threads workers until SIGINT or SIGTERM.
+     * Returns false on errors in the event loop.
+     */
+    bool run(unsigned threads, std::string* error_msg);
+
+private:
+    struct Connection {
+        Connection(int fd)
+            : fd(fd), out_pos(0), pending(0), queued(0), events(EPOLLIN)
+            , closing(false), dirty(false), held(false)
+            {}
+
+        int fd;
+        std::string in;
+        std::string out;
+        size_t out_pos;
+        size_t pending;     // Requests in the workers
+        size_t queued;      // Bytes of the requests in the workers
+        uint32_t events;    // Registered with epoll
+        bool closing;       // Close once all responses are written
+        bool dirty;         // Has new responses to write
+        bool held;          // Has complete requests held back by the limits
+    };
+
+    struct Request {
+        /** Move req into this request without copying the body. */
+        void take(Request& req) {
+            connection = req.connection;
+            id = req.id;
+            op = req.op;
+            max_error = req.max_error;
+            body.swap(req.body);
+        }
+
+        uint64_t connection;
+        uint32_t id;
+        unsigned op;
+        int max_error;
+        std::string body;
+    };
+
+    struct Response {
+        uint64_t connection;
+        size_t request_bytes;
+        std::string frame;
+    };
+
+    class Worker : public kyotocabinet::Thread
+    {
+    public:
+        Worker(Server* server) : _server(server) {}
+        void run() { _server->work(); }
+
+    private:
+        Server* _server;
+    };
+
+    bool add_listener(int fd, std::string* error_msg);
+    bool watch(int fd, uint64_t token, uint32_t events, std::string* error_msg);
+
+    void stop_reading();
+    void accept_connections(int listener);
+    void read_connection(uint64_t token, Connection* conn);
+    void parse_requests(uint64_t token, Connection* conn);
+    void write_connection(Connection* conn);
+    void deliver_responses();
+    void update_connection(uint64_t token, Connection* conn);
+    void close_connection(uint64_t token, Connection* conn);
+
+    void work();
+    void lookup(const std::vector<Request>& batch, std::vector<Response>& responses);
+    void lookup_batch(const Request& req, std::string& out);
+    void insert(const Request& req, std::string& out);
+
+    HmSearch& _db;
+    size_t _hash_bytes;
+    size_t _payload_bytes;
+    bool _writable;
+
+    int _epoll;
+    int _wakeup;
+    int _signals;
+    std::vector<int> _listeners;
+    std::vector<std::string> _unix_paths;
+    std::map<uint64_t, Connection*> _connections;
+    uint64_t _next_connection;
+    std::vector<Worker*> _workers;
+
+    // Protects _requests and _stop
+    kyotocabinet::Mutex _request_lock;
+    kyotocabinet::CondVar _queued;
+    std::deque<Request> _requests;
+    bool _stop;
+
+    // Protects _responses
+    kyotocabinet::Mutex _response_lock;
+    std::vector<Response> _responses;
+};
+
+
+Server::~Server()
+{
+    for (std::map<uint64_t, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i) {
+        close(i->second->fd);
+        delete i->second;
+    }
+
+    for (size_t i = 0; i < _listeners.size(); i++) {
+        if (_listeners[i] >= 0) close(_listeners[i]);
+    }
+    for (size_t i = 0; i < _unix_paths.size(); i++) {
+        unlink(_unix_paths[i].c_str());
+    }
+
+    if (_epoll >= 0) close(_epoll);
+    if (_wakeup >= 0) close(_wakeup);
+    if (_signals >= 0) close(_signals);
+}
+
+
+bool Server::add_listener(int fd, std::string* error_msg)
+{
+    if (listen(fd, SOMAXCONN) < 0) {
+        *error_msg = strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    _listeners.push_back(fd);
+    return true;
+}
+
+
+bool Server::listen_tcp(const std::string& address, std::string* error_msg)
+{
+    std::string host, port = address;
+    size_t colon = address.rfind(':');
+    if (colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* addrs;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addrs);
+    if (err) {
+        *error_msg = gai_strerror(err);
+        return false;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* a = addrs; a; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            *error_msg = strerror(errno);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (bind(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            break;
+        }
+
+        *error_msg = strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+
+    return fd >= 0 && add_listener(fd, error_msg);
+}
+
+
+bool Server::listen_unix(const std::string& path, std::string* error_msg)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        *error_msg = "socket path too long";
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // Replace a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        *error_msg = strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    if (!add_listener(fd, error_msg)) {
+        unlink(path.c_str());
+        return false;
+    }
+
+    _unix_paths.push_back(path);
+    return true;
+}
+
+
+bool Server::watch(int fd, uint64_t token, uint32_t events, std::string* error_msg)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = token;
+
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+
+bool Server::run(unsigned threads, std::string* error_msg)
+{
+    // Blocked before starting the workers, so that they inherit the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (_epoll < 0 || _wakeup < 0 || _signals < 0) {
+        *error_msg = strerror(errno);
+        return false;
+    }
+
+    if (!watch(_wakeup, wakeup_token, EPOLLIN, error_msg)
+        || !watch(_signals, signal_token, EPOLLIN, error_msg)) {
+        return false;
+    }
+    for (size_t i = 0; i < _listeners.size(); i++) {
+        if (!watch(_listeners[i], first_listener + i, EPOLLIN, error_msg)) {
+            return false;
+        }
+    }
+
+    for (unsigned i = 0; i < threads; i++) {
+        _workers.push_back(new Worker(this));
+        _workers.back()->start();
+    }
+
+    bool ok = true;
+    bool stopping = false;
+    double deadline = 0;
+    struct epoll_event events[64];
+
+    for (bool running = true; running; ) {
+        int timeout = -1;
+        if (stopping) {
+            double left = deadline - now();
+            if (_connections.empty() || left <= 0) {
+                break;
+            }
+            timeout = int(left * 1000) + 1;
+        }
+
+        int n = epoll_wait(_epoll, events, 64, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *error_msg = strerror(errno);
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t token = events[i].data.u64;
+
+            if (token == wakeup_token) {
+                uint64_t count;
+                if (read(_wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    *error_msg = strerror(errno);
+                    ok = running = false;
+                }
+                deliver_responses();
+            }
+            else if (token == signal_token) {
+                struct signalfd_siginfo info;
+                while (read(_signals, &info, sizeof(info)) == sizeof(info)) {
+                }
+
+                // A second signal stops without waiting for the responses
+                if (stopping) {
+                    running = false;
+                }
+                else {
+                    stopping = true;
+                    deadline = now() + shutdown_timeout;
+                    stop_reading();
+                }
+            }
+            else if (token < first_connection) {
+                int listener = _listeners[token - first_listener];
+                if (listener >= 0) {
+                    accept_connections(listener);
+                }
+            }
+            else {
+                std::map<uint64_t, Connection*>::iterator c = _connections.find(token);
+                if (c == _connections.end()) {
+                    continue;
+                }
+
+                Connection* conn = c->second;
+                uint32_t ready = events[i].events;
+
+                // Nothing can be sent any more, and the responses of
+                // any pending requests will be dropped
+                if ((ready & EPOLLERR) || (ready & (EPOLLHUP | EPOLLIN)) == EPOLLHUP) {
+                    close_connection(token, conn);
+                    continue;
+                }
+
+                if (ready & EPOLLOUT) {
+                    write_connection(conn);
+
+                    // Parse requests held back by max_unsent
+                    if (conn->held) {
+                        parse_requests(token, conn);
+                    }
+                }
+                if (ready & EPOLLIN) {
+                    read_connection(token, conn);
+                }
+                else {
+                    update_connection(token, conn);
+                }
+            }
+        }
+    }
+
+    // Nothing more can be written, so the workers only finish the
+    // requests they are running
+    {
+        kyotocabinet::ScopedMutex lock(&_request_lock);
+        _requests.clear();
+        _stop = true;
+        _queued.broadcast();
+    }
+
+    for (size_t i = 0; i < _workers.size(); i++) {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+    _workers.clear();
+
+    return ok;
+}
+
+
+/** Stop accepting connections and reading requests, and close each
+ * connection once the responses to its queued requests are written.
+ */
+void Server::stop_reading()
+{
+    for (size_t i = 0; i < _listeners.size(); i++) {
+        close(_listeners[i]);
+        _listeners[i] = -1;
+    }
+
+    std::vector<uint64_t> tokens;
+    for (std::map<uint64_t, Connection*>::iterator i = _connections.begin();
+         i != _connections.end();
+         ++i) {
+        tokens.push_back(i->first);
+    }
+
+    for (size_t i = 0; i < tokens.size(); i++) {
+        Connection* conn = _connections[tokens[i]];
+        conn->closing = true;
+        conn->held = false;
+        conn->in.clear();
+        update_connection(tokens[i], conn);
+    }
+}
+
+
+void Server::accept_connections(int listener)
+{
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                && errno != ECONNABORTED) {
+                perror("hm_server: accept");
+            }
+            return;
+        }
+
+        // Responses are small and shouldn't wait for more to fill a
+        // segment.  This fails harmlessly on Unix sockets.
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        uint64_t token = _next_connection++;
+        std::string error_msg;
+        if (!watch(fd, token, EPOLLIN, &error_msg)) {
+            fprintf(stderr, "hm_server: cannot watch connection: %s\n", error_msg.c_str());
+            close(fd);
+            continue;
+        }
+
+        _connections[token] = new Connection(fd);
+    }
+}
+
+
+void Server::read_connection(uint64_t token, Connection* conn)
+{
+    if (!conn->closing && !conn->held) {
+        size_t used = conn->in.size();
+        conn->in.resize(used + read_size);
+
+        ssize_t n = read(conn->fd, &conn->in[used], read_size);
+        conn->in.resize(used + (n > 0 ? n : 0));
+
+        if (n == 0) {
+            // Answer what has been sent before closing
+            conn->closing = true;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_connection(token, conn);
+            return;
+        }
+
+        parse_requests(token, conn);
+    }
+
+    update_connection(token, conn);
+}
+
+
+void Server::parse_requests(uint64_t token, Connection* conn)
+{
+    size_t pos = 0;
+    std::vector<Request> requests;
+
+    conn->held = false;
+
+    while (conn->in.size() - pos >= header_size) {
+        const uint8_t* header = (const uint8_t*) conn->in.data() + pos;
+        uint32_t length = get_u32(header);
+        uint32_t id = get_u32(header + 4);
+        unsigned op = header[8];
+
+        if (length > max_frame) {
+            error_response(conn->out, id, op, "request too large");
+            conn->dirty = true;
+            conn->closing = true;
+            conn->in.clear();
+            pos = 0;
+            break;
+        }
+
+        if (conn->in.size() - pos < header_size + length) {
+            break;
+        }
+
+        if (conn->pending + requests.size() >= max_pending
+            || (conn->queued > 0 && conn->queued + header_size + length > max_queued)
+            || conn->out.size() - conn->out_pos > max_unsent) {
+            conn->held = true;
+            break;
+        }
+
+        requests.push_back(Request());
+        Request& req = requests.back();
+        req.connection = token;
+        req.id = id;
+        req.op = op;
+        req.max_error = int16_t(header[10] | (header[11] << 8));
+        req.body.assign(conn->in, pos + header_size, length);
+
+        conn->queued += header_size + length;
+        pos += header_size + length;
+    }
+
+    conn->in.erase(0, pos);
+
+    if (!requests.empty()) {
+        conn->pending += requests.size();
+
+        kyotocabinet::ScopedMutex lock(&_request_lock);
+        for (size_t i = 0; i < requests.size(); i++) {
+            _requests.push_back(Request());
+            _requests.back().take(requests[i]);
+        }
+        _queued.broadcast();
+    }
+
+    if (conn->dirty) {
+        write_connection(conn);
+    }
+}
+
+
+void Server::write_connection(Connection* conn)
+{
+    conn->dirty = false;
+
+    while (conn->out_pos < conn->out.size()) {
+        ssize_t n = send(conn->fd, conn->out.data() + conn->out_pos,
+                         conn->out.size() - conn->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The client is gone, so nothing more can be sent
+                conn->closing = true;
+                conn->in.clear();
+                conn->out.clear();
+                conn->out_pos = 0;
+            }
+            return;
+        }
+        conn->out_pos += n;
+    }
+
+    conn->out.clear();
+    conn->out_pos = 0;
+}
+
+
+void Server::deliver_responses()
+{
+    std::vector<Response> responses;
+    {
+        kyotocabinet::ScopedMutex lock(&_response_lock);
+        responses.swap(_responses);
+    }
+
+    std::vector<uint64_t> written;
+
+    for (size_t i = 0; i < responses.size(); i++) {
+        std::map<uint64_t, Connection*>::iterator c = _connections.find(responses[i].connection);
+        if (c == _connections.end()) {
+            // Closed while the request was running
+            continue;
+        }
+
+        Connection* conn = c->second;
+        conn->pending--;
+        conn->queued -= responses[i].request_bytes;
+        if (conn->out.empty()) {
+            conn->out.swap(responses[i].frame);
+        }
+        else {
+            conn->out += responses[i].frame;
+        }
+
+        if (!conn->dirty) {
+            conn->dirty = true;
+            written.push_back(c->first);
+        }
+    }
+
+    // One write per connection for all its responses
+    for (size_t i = 0; i < written.size(); i++) {
+        Connection* conn = _connections[written[i]];
+        write_connection(conn);
+
+        // Parse requests held back by the limits
+        parse_requests(written[i], conn);
+        update_connection(written[i], conn);
+    }
+}
+
+
+void Server::update_connection(uint64_t token, Connection* conn)
+{
+    bool unsent = conn->out_pos < conn->out.size();
+
+    if (conn->closing && conn->pending == 0 && !unsent) {
+        close_connection(token, conn);
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!conn->closing && !conn->held) {
+        events |= EPOLLIN;
+    }
+    if (unsent) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.u64 = token;
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+
+void Server::close_connection(uint64_t token, Connection* conn)
+{
+    close(conn->fd);
+    delete conn;
+    _connections.erase(token);
+}
+
+
+void Server::work()
+{
+    std::vector<Request> batch;
+
+    for (;;) {
+        batch.clear();
+
+        {
+            kyotocabinet::ScopedMutex lock(&_request_lock);
+            while (_requests.empty() && !_stop) {
+                _queued.wait(&_request_lock);
+            }
+            if (_requests.empty()) {
+                return;
+            }
+
+            // Consecutive lookups sharing max_error are done together
+            unsigned op = _requests.front().op;
+            int max_error = _requests.front().max_error;
+            do {
+                batch.push_back(Request());
+                batch.back().take(_requests.front());
+                _requests.pop_front();
+            } while (op == OP_LOOKUP && batch.size() < batch_size
+                     && !_requests.empty()
+                     && _requests.front().op == OP_LOOKUP
+                     && _requests.front().max_error == max_error);
+        }
+
+        std::vector<Response> responses(batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            responses[i].request_bytes = header_size + batch[i].body.size();
+        }
+
+        if (batch[0].op == OP_LOOKUP) {
+            lookup(batch, responses);
+        }
+        else {
+            responses[0].connection = batch[0].connection;
+            if (batch[0].op == OP_LOOKUP_BATCH) {
+                lookup_batch(batch[0], responses[0].frame);
+            }
+            else if (batch[0].op == OP_INSERT) {
+                insert(batch[0], responses[0].frame);
+            }
+            else {
+                error_response(responses[0].frame, batch[0].id, batch[0].op, "unknown operation");
+            }
+        }
+
+        {
+            kyotocabinet::ScopedMutex lock(&_response_lock);
+            for (size_t i = 0; i < responses.size(); i++) {
+                _responses.push_back(Response());
+                _responses.back().connection = responses[i].connection;
+                _responses.back().request_bytes = responses[i].request_bytes;
+                _responses.back().frame.swap(responses[i].frame);
+            }
+        }
+
+        uint64_t one = 1;
+        if (write(_wakeup, &one, sizeof(one)) < 0) {
+            perror("hm_server: eventfd");
+        }
+    }
+}
+
+
+void Server::lookup(const std::vector<Request>& batch, std::vector<Response>& responses)
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::vector<size_t> indices;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        responses[i].connection = batch[i].connection;
+
+        // Checked here, so that one bad query doesn't fail its whole batch
+        if (batch[i].body.size() != _hash_bytes) {
+            error_response(responses[i].frame, batch[i].id, OP_LOOKUP, "incorrect hash length");
+        }
+        else {
+            queries.push_back(HmSearch::hash_string(
+                                  (const uint8_t*) batch[i].body.data(), _hash_bytes));
+            indices.push_back(i);
+        }
+    }
+
+    if (queries.empty()) {
+        return;
+    }
+
+    std::vector<HmSearch::LookupResultList> results(queries.size());
+    std::string error_msg;
+    bool ok = _db.lookup_batch(queries, results, batch[0].max_error, &error_msg);
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        const Request& req = batch[indices[q]];
+        std::string& out = responses[indices[q]].frame;
+
+        // Redo the lookups one by one to report the failing ones,
+        // dropping any matches the batch added before it failed
+        if (!ok) {
+            results[q].clear();
+            if (!_db.lookup(queries[q], results[q], req.max_error, &error_msg)) {
+                error_response(out, req.id, OP_LOOKUP, error_msg);
+                continue;
+            }
+        }
+
+        size_t start = begin_response(out, req.id, OP_LOOKUP, true);
+        put_matches(out, results[q]);
+        end_response(out, start);
+    }
+}
+
+
+void Server::lookup_batch(const Request& req, std::string& out)
+{
+    if (req.body.size() % _hash_bytes) {
+        error_response(out, req.id, req.op, "incorrect hash length");
+        return;
+    }
+    if (req.body.size() / _hash_bytes > max_batch_queries) {
+        error_response(out, req.id, req.op, "too many hashes in batch");
+        return;
+    }
+
+    std::vector<HmSearch::hash_string> queries(req.body.size() / _hash_bytes);
+    for (size_t i = 0; i < queries.size(); i++) {
+        queries[i].assign((const uint8_t*) req.body.data() + i * _hash_bytes, _hash_bytes);
+    }
+
+    std::vector<HmSearch::LookupResultList> results(queries.size());
+    std::string error_msg;
+    if (!_db.lookup_batch(queries, results, req.max_error, &error_msg)) {
+        error_response(out, req.id, req.op, error_msg);
+        return;
+    }
+
+    size_t start = begin_response(out, req.id, req.op, true);
+    for (size_t i = 0; i < results.size(); i++) {
+        put_matches(out, results[i]);
+    }
+    end_response(out, start);
+}
+
+
+void Server::insert(const Request& req, std::string& out)
+{
+    size_t item_bytes = _hash_bytes + _payload_bytes;
+
+    if (!_writable) {
+        error_response(out, req.id, req.op, "database is opened read-only");
+        return;
+    }
+    if (req.body.size() % item_bytes) {
+        error_response(out, req.id, req.op, "incorrect hash and payload length");
+        return;
+    }
+
+    const uint8_t* items = (const uint8_t*) req.body.data();
+    size_t count = req.body.size() / item_bytes;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* item = items + i * item_bytes;
+        std::string error_msg;
+
+        if (!_db.insert(HmSearch::hash_string(item, _hash_bytes),
+                        HmSearch::hash_string(item + _hash_bytes, _payload_bytes),
+                        &error_msg)) {
+            // The hashes before this one stay inserted
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "inserted %zu of %zu hashes: ", i, count);
+            error_response(out, req.id, req.op, prefix + error_msg);
+            return;
+        }
+    }
+
+    size_t start = begin_response(out, req.id, req.op, true);
+    put_u32(out, count);
+    end_response(out, start);
+}
+
+
+static void usage(const char *self)
+{
+    fprintf(stderr,
+            "Usage: %s [-t [host:]port] [-U path] [-j threads] [-w] [-c MB] [-f]\n"
+            "          [--map MB] [--prefetch] path\n"
+            "\n"
+            "  -t, --tcp ADDRESS  listen for TCP connections on [host:]port\n"
+            "  -U, --unix PATH    listen for connections on a Unix domain socket\n"
+            "  -j, --threads N    serve requests on N threads (default 0: one per CPU)\n"
+            "  -w, --writable     open the database for writing, to allow inserts\n"
+            "  -c, --cache MB     cache partition records in memory\n"
+            "  -f, --filter       skip missing partition keys with an in-memory filter\n"
+            "      --map MB       memory map this much of the database file\n"
+            "      --prefetch     start reading all records of a lookup before\n"
+            "                     probing them\n"
+            "\n"
+            "At least one of -t and -U must be given.  The server runs until it\n"
+            "gets SIGINT or SIGTERM, stops reading requests, writes the responses\n"
+            "to those already queued for up to 10 seconds, and then closes the\n"
+            "database.  A second signal stops it without waiting for them.\n",
+            self);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "tcp", required_argument, NULL, 't' },
+        { "unix", required_argument, NULL, 'U' },
+        { "threads", required_argument, NULL, 'j' },
+        { "writable", no_argument, NULL, 'w' },
+        { "cache", required_argument, NULL, 'c' },
+        { "filter", no_argument, NULL, 'f' },
+        { "map", required_argument, NULL, map_option },
+        { "prefetch", no_argument, NULL, prefetch_option },
+        { NULL, 0, NULL, 0 }
+    };
+
+    std::vector<std::string> tcp_addresses;
+    std::vector<std::string> unix_paths;
+    int threads = 0;
+    bool writable = false;
+    HmSearch::OpenOptions options;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:U:j:wc:f", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            tcp_addresses.push_back(optarg);
+            break;
+
+        case 'U':
+            unix_paths.push_back(optarg);
+            break;
+
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'w':
+            writable = true;
+            break;
+
+        case 'c':
+            options.cache_size = size_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case 'f':
+            options.key_filter = true;
+            break;
+
+        case map_option:
+            options.map_size = int64_t(strtoul(optarg, NULL, 10)) << 20;
+            break;
+
+        case prefetch_option:
+            options.prefetch = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc || (tcp_addresses.empty() && unix_paths.empty())) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    const char *path = argv[optind];
+    std::string error_msg;
+
+    std::auto_ptr<HmSearch> db(HmSearch::open(path, writable ? HmSearch::READWRITE : HmSearch::READONLY,
+                                              options, &error_msg));
+    if (!db.get()) {
+        fprintf(stderr, "%s: error opening %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    int status = 0;
+    {
+        Server server(*db, writable);
+
+        for (size_t i = 0; i < tcp_addresses.size(); i++) {
+            if (!server.listen_tcp(tcp_addresses[i], &error_msg)) {
+                fprintf(stderr, "%s: cannot listen on %s: %s\n",
+                        argv[0], tcp_addresses[i].c_str(), error_msg.c_str());
+                return 1;
+            }
+        }
+        for (size_t i = 0; i < unix_paths.size(); i++) {
+            if (!server.listen_unix(unix_paths[i], &error_msg)) {
+                fprintf(stderr, "%s: cannot listen on %s: %s\n",
+                        argv[0], unix_paths[i].c_str(), error_msg.c_str());
+                return 1;
+            }
+        }
+
+        if (!server.run(threads, &error_msg)) {
+            fprintf(stderr, "%s: %s\n", argv[0], error_msg.c_str());
+            status = 1;
+        }
+    }
+
+    if (!db->close(&error_msg)) {
+        fprintf(stderr, "%s: error closing %s: %s\n", argv[0], path, error_msg.c_str());
+        return 1;
+    }
+
+    return status;
+}
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -8,260 +8,4229 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <memory>
 #include <algorithm>
+#include <queue>
+#include <vector>
 
 #include <kcdbext.h>
+#include <kcthread.h>
 
 #include "hmsearch.h"
+#include "hamming.h"
+#include "store.h"
+#include "sharded.h"
+#include "stats.h"
+#include "insertlog.h"
 
-/** The actual implementation of the HmSearch database.
- *
- * A difference between this implementation and the HmSearch algorithm
- * in the paper is that only exact-matches are stored in the database,
- * not the 1-matches.  The 1-var partitions are instead generated
- * during lookup.  This drastically reduces database size, which with
- * Kyoto Cabinet speeds up insertion and probably lookups too.
- *
- * The database contains some setting records controlling the
- * operation:
+/** Flat open-addressing hash table holding the lookup candidates.
  *
- * _hb: hash bits
- * _me: max errors
+ * The candidate hashes are copied into a contiguous key arena and
+ * the slot array only holds indices into it, so each candidate costs
+ * a few cache lines instead of an allocated tree node.  clear() keeps
+ * all storage, so a table that is reused between lookups does no heap
+ * allocation once it has grown to the working set size.
+ */
+class CandidateTable
+{
+public:
+    struct Candidate {
+        Candidate(uint32_t h) : hash(h), matches(0), first_match(0), second_match(0) {}
+        uint32_t hash;
+        int matches;
+        int first_match;
+        int second_match;
+    };
+
+    CandidateTable() : _key_length(0), _mask(0) {}
+
+    /** Empty the table and prepare it for keys of key_length bytes.
+     */
+    void clear(size_t key_length);
+
+    /** Return the candidate for key, adding it if necessary.
+     */
+    Candidate& get(const uint8_t* key);
+
+    /** Return the candidate for key, or NULL if it isn't in the table.
+     */
+    Candidate* find(const uint8_t* key);
+
+    size_t size() const { return _candidates.size(); }
+    size_t key_length() const { return _key_length; }
+    const uint8_t* keys() const { return _keys.data(); }
+    const uint8_t* key(size_t i) const { return &_keys[i * _key_length]; }
+    const Candidate& candidate(size_t i) const { return _candidates[i]; }
+    Candidate& candidate(size_t i) { return _candidates[i]; }
+
+private:
+    void grow();
+
+    size_t _key_length;
+    size_t _mask;
+
+    // Index + 1 into _candidates, or 0 for an empty slot
+    std::vector<uint32_t> _slots;
+
+    std::vector<uint8_t> _keys;
+    std::vector<Candidate> _candidates;
+
+    static const size_t initial_slots = 1024;
+};
+
+
+/** A partition record of sorted postings, kept aside during a lookup
+ * so that it can be searched for the candidates instead of adding
+ * every posting to the CandidateTable.
+ */
+struct SortedRun {
+    SortedRun(const uint8_t* p, size_t c, int m) : postings(p), count(c), match(m) {}
+    const uint8_t* postings;
+    size_t count;
+    int match;
+};
+
+// Records of sorted postings with at least this many postings are
+// searched rather than scanned
+static const size_t sorted_run_postings = 256;
+
+// Queries probed together by lookup_batch(), which bounds the
+// candidate tables each thread keeps between batches
+static const size_t max_batch_queries = 1024;
+
+
+/** Orders SortedRuns on decreasing length.
+ */
+struct SortedRunLarger {
+    bool operator()(const SortedRun& a, const SortedRun& b) const {
+        return a.count > b.count;
+    }
+};
+
+
+/** Orders positions in a list of SortedRuns, as (run, posting index)
+ * pairs, for a min-heap merging the runs.
+ */
+struct SortedRunGreater {
+    SortedRunGreater(const std::vector<SortedRun>& r, size_t l) : runs(r), length(l) {}
+
+    const uint8_t* posting(const std::pair<size_t, size_t>& pos) const {
+        return runs[pos.first].postings + pos.second * length;
+    }
+
+    bool operator()(const std::pair<size_t, size_t>& a,
+                    const std::pair<size_t, size_t>& b) const {
+        return memcmp(posting(a), posting(b), length) > 0;
+    }
+
+    const std::vector<SortedRun>& runs;
+    size_t length;
+};
+
+
+/** PartitionStore on a Kyoto Cabinet database.
  *
- * These can't be changed once the database has been initialised.
+ * Kyoto Cabinet appends by rewriting the whole value, and moves the
+ * record to a new place in the file whenever it no longer fits the
+ * old one.  In databases where many hashes share each partition key,
+ * that makes every insert relocate records of ever growing size.
  *
- * Each partition is stored as a key on the following format:
- *  Byte 0: 'P'
- *  Byte 1: Partition number (thus limiting to max error 518)
- *  Bytes 2-N: Partition bits.
+ * If record_capacity is > 0, partition records are therefore stored
+ * padded to a capacity, starting at record_capacity and growing by
+ * half when full.  Appends that fit the capacity keep the record size
+ * unchanged so Kyoto Cabinet rewrites it in place, and a record is
+ * only relocated a logarithmic number of times as it grows.  The
+ * value of a padded record is the postings, zero padding, and the
+ * number of bytes of postings as a little-endian uint32.  The padding
+ * is invisible outside this class.
  */
-class HmSearchImpl : public HmSearch
+class KyotoStore : public PartitionStore
 {
 public:
-    HmSearchImpl(kyotocabinet::PolyDB* db, int hash_bits, int max_error)
+    KyotoStore(kyotocabinet::PolyDB* db, size_t record_capacity = 0)
         : _db(db)
-        , _hash_bits(hash_bits)
-        , _max_error(max_error)
-        , _hash_bytes((hash_bits + 7) / 8)
-        , _partitions((max_error + 3) / 2)
-        , _partition_bits(ceil((double)hash_bits / _partitions))
-        , _partition_bytes((_partition_bits + 7) / 8 + 1)
-        { }
+        , _record_capacity(record_capacity)
+        , _fixed_stamp(false)
+        , _stamp_records(0)
+        , _stamp_bytes(0)
+        {}
 
-    ~HmSearchImpl() {
-        close();
+    ~KyotoStore() {
+        delete _db;
     }
-    
-    bool insert(const hash_string& hash,
-                std::string* error_msg = NULL);
-    
-    bool lookup(const hash_string& query,
-                LookupResultList& result,
-                int max_error = -1,
-                std::string* error_msg = NULL);
 
-    bool close(std::string* error_msg = NULL);
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result);
 
-    void dump();
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg);
 
-private:
-    struct Candidate {
-        Candidate() : matches(0), first_match(0), second_match(0) {}
-        int matches;
-        int first_match;
-        int second_match;
-    };
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg);
 
-    typedef std::map<hash_string, Candidate> CandidateMap;
-    
-    void get_candidates(const hash_string& query, CandidateMap& candidates);
-    void add_hash_candidates(CandidateMap& candidates, int match,
-                             const uint8_t* hashes, size_t length);
-    bool valid_candidate(const Candidate& candidate);
-    int hamming_distance(const hash_string& query, const hash_string& hash);
-    
-    int get_partition_key(const hash_string& hash, int partition, uint8_t *key);
+    bool increment(const uint8_t* key, size_t key_length,
+                   int64_t num, int64_t* result,
+                   std::string* error_msg) {
+        *result = _db->increment((const char*) key, key_length, num, 0);
+        if (*result == kyotocabinet::INT64MIN) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+        return true;
+    }
 
-    kyotocabinet::PolyDB* _db;
-    int _hash_bits;
-    int _max_error;
-    int _hash_bytes;
-    int _partitions;
-    int _partition_bits;
-    int _partition_bytes;
+    /** Report a fixed stamp, for in-memory copies of a database file
+     * that should match the stamp of the file.
+     */
+    void fix_stamp(uint64_t records, uint64_t bytes) {
+        _fixed_stamp = true;
+        _stamp_records = records;
+        _stamp_bytes = bytes;
+    }
+
+    bool stamp(uint64_t* records, uint64_t* bytes) {
+        if (_fixed_stamp) {
+            *records = _stamp_records;
+            *bytes = _stamp_bytes;
+            return true;
+        }
+
+        int64_t count = _db->count(), size = _db->size();
+        if (count < 0 || size < 0) {
+            return false;
+        }
+        *records = count;
+        *bytes = size;
+        return true;
+    }
+
+    bool iterate(Visitor& visitor, std::string* error_msg);
+
+    void advise(Advice advice);
+
+    bool close(std::string* error_msg);
+
+private:
+    /** Return true if the record of key is padded.
+     */
+    bool padded(const uint8_t* key) const {
+        return _record_capacity > 0 && key[0] == 'P';
+    }
 
-    static int one_bits[256];
+    kyotocabinet::PolyDB* _db;
+    size_t _record_capacity;
+    bool _fixed_stamp;
+    uint64_t _stamp_records;
+    uint64_t _stamp_bytes;
 };
 
 
-bool HmSearch::init(const std::string& path,
-                    unsigned hash_bits, unsigned max_error,
-                    uint64_t num_hashes,
-                    std::string* error_msg)
+// Bytes of the length trailer of padded records
+static const size_t record_trailer = 4;
+
+// Limits on the preallocation of crowded databases
+static const size_t max_record_capacity = 64 << 10;
+static const int max_alignment_power = 10;
+static const int free_block_pool_power = 14;
+
+// Approximate bytes of a Kyoto Cabinet record besides key and value,
+// and of each hash bucket
+static const size_t record_overhead = 16;
+static const size_t bucket_bytes = 6;
+
+// Kyoto Cabinet defaults
+static const int64_t min_buckets = 1 << 20;
+static const int64_t min_map_size = int64_t(64) << 20;
+
+
+/** Return the physical memory of the machine in bytes.
+ */
+static uint64_t physical_memory()
 {
-    std::string dummy;
-    if (!error_msg) {
-        error_msg = &dummy;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) {
+        // Assume a small machine
+        return uint64_t(4) << 30;
     }
-    *error_msg = "";
+    return uint64_t(pages) * page_size;
+}
 
-    if (hash_bits == 0 || (hash_bits & 7)) {
-        *error_msg = "invalid hash_bits value";
+
+/** Reserve disk space for the first size bytes of the file at path,
+ * without changing its size, so that the data written later is laid
+ * out contiguously.  File systems that can't do this are not an
+ * error.
+ */
+static bool preallocate_file(const std::string& path, uint64_t size,
+                             std::string* error_msg)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *error_msg = std::string("cannot open file: ") + strerror(errno);
         return false;
     }
 
-    if (max_error == 0 || max_error >= hash_bits || max_error > 518) {
-        *error_msg = "invalid max_error value";
-        return false;
+    bool ok = true;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0
+        && errno != EOPNOTSUPP && errno != ENOSYS) {
+        *error_msg = std::string("cannot preallocate file: ") + strerror(errno);
+        ok = false;
     }
 
-    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
-    if (!db.get()) {
-        return false;
+    ::close(fd);
+    return ok;
+}
+
+
+/** Return the number of bytes of postings in a padded record, or
+ * size_t(-1) if it is corrupt.
+ */
+static inline size_t padded_length(const char* value, size_t length)
+{
+    if (length < record_trailer) {
+        return size_t(-1);
     }
 
-    int partitions = (max_error + 3) / 2;
-    int partition_bits = ceil((double)hash_bits / partitions);
+    const uint8_t* p = (const uint8_t*) value + length - record_trailer;
+    size_t used = (size_t(p[0]) | (size_t(p[1]) << 8)
+                   | (size_t(p[2]) << 16) | (size_t(p[3]) << 24));
+    return used <= length - record_trailer ? used : size_t(-1);
+}
 
-    uint64_t hashes_per_partition = std::max(uint64_t(1), num_hashes / (uint64_t(1) << partition_bits));
 
-    // TODO: handle >1 hashes_per_partition by setting suitable
-    // alignment to allow efficient append and perhaps even having a
-    // metablock structure where the partition record just contains
-    // references to blocks that actually holds the hashes.
-    
-    uint64_t keys = (num_hashes / hashes_per_partition) * partitions;
+/** Set the length trailer of a padded record of capacity bytes.
+ */
+static inline void set_padded_length(std::string& record, size_t capacity, size_t used)
+{
+    record.resize(capacity + record_trailer, '\0');
+    for (size_t i = 0; i < record_trailer; i++, used >>= 8) {
+        record[capacity + i] = used;
+    }
+}
 
-    // Limit to 0.5 GB index size, might make this configurable too
-    int bucket_size = 6;
-    int64_t buckets = std::max(int64_t(keys) / bucket_size, int64_t(512) << 20 / bucket_size);  
 
-    db->tune_buckets(buckets);
+/** Per-thread buffers reused between lookups.
+ */
+struct LookupContext {
+    LookupContext() : buffer(4096), hash_buffer(256) {}
+    CandidateTable candidates;
+    std::vector<CandidateTable> batch_candidates;
+    std::vector<SortedRun> runs;
+    std::vector<std::vector<SortedRun> > batch_runs;
+    std::vector<std::pair<size_t, size_t> > merge_heap;
+    std::vector<char> buffer;
+    std::vector<char> hash_buffer;      // Hash records of ordinal postings
+    std::vector<uint8_t> items;         // Fetched hashes of ordinal postings
+    std::vector<uint32_t> matches;
+    std::vector<int> distances;
+    std::vector<std::pair<int, uint32_t> > nearest;
+    std::vector<uint8_t> prefetch_keys;
+    std::vector<uint8_t> probe_keys;    // Variant keys of multi-index hashing
+    std::vector<int> flip_positions;
+};
 
-    // Smaller database and quicker inserts, no big effect on lookups
-    db->tune_options(kyotocabinet::HashDB::TLINEAR);
-    
-    if (!db->open(path, kyotocabinet::BasicDB::OWRITER | kyotocabinet::BasicDB::OCREATE)) {
-        *error_msg = db->error().message();
-        return false;
+static thread_local LookupContext lookup_context;
+
+
+/** Adds visited matches to a LookupResultList.
+ */
+class ListVisitor : public HmSearch::ResultVisitor
+{
+public:
+    ListVisitor(HmSearch::LookupResultList& result, size_t hash_bytes, size_t payload_bytes)
+        : _result(result), _hash_bytes(hash_bytes), _payload_bytes(payload_bytes)
+        { }
+
+    bool visit(const uint8_t* hash, int distance) {
+        _result.push_back(HmSearch::LookupResult(
+                              HmSearch::hash_string(hash, _hash_bytes), distance,
+                              HmSearch::hash_string(hash + _hash_bytes, _payload_bytes)));
+        return true;
     }
 
-    if (db->count() > 0) {
-        *error_msg = "cannot initialise non-empty database";
-        return false;
+private:
+    HmSearch::LookupResultList& _result;
+    size_t _hash_bytes;
+    size_t _payload_bytes;
+};
+
+
+/** Adds visited matches to a LookupResultVector.
+ */
+class VectorVisitor : public HmSearch::ResultVisitor
+{
+public:
+    VectorVisitor(HmSearch::LookupResultVector& result, size_t hash_bytes, size_t payload_bytes)
+        : _result(result), _hash_bytes(hash_bytes), _payload_bytes(payload_bytes)
+        { }
+
+    bool visit(const uint8_t* hash, int distance) {
+        _result.add(hash, _hash_bytes, distance, _payload_bytes);
+        return true;
     }
-    
-    char buf[20];
-    snprintf(buf, sizeof(buf), "%u", hash_bits);
-    if (!db->set("_hb", buf)) {
-        *error_msg = db->error().message();
-        return false;
+
+private:
+    HmSearch::LookupResultVector& _result;
+    size_t _hash_bytes;
+    size_t _payload_bytes;
+};
+
+
+static inline uint64_t load_big_endian(const uint8_t* p)
+{
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+
+/** Load the big-endian word at offset in data of length bytes,
+ * taking any bytes past the end as zero.
+ */
+static inline uint64_t load_big_endian_tail(const uint8_t* data, int offset, int length)
+{
+    uint64_t w = 0;
+    for (int i = offset; i < offset + 8; i++) {
+        w = (w << 8) | (i < length ? data[i] : 0);
     }
+    return w;
+}
 
-    snprintf(buf, sizeof(buf), "%u", max_error);
-    if (!db->set("_me", buf)) {
-        *error_msg = db->error().message();
+
+static inline void store_big_endian(uint8_t* p, uint64_t w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    memcpy(p, &w, sizeof(w));
+}
+
+
+// Ordinals in partition records and hash record keys, big-endian
+static const size_t ordinal_bytes = 5;
+static const int64_t max_ordinals = int64_t(1) << (ordinal_bytes * 8);
+
+// Key of the ordinal counter record
+static const uint8_t ordinal_counter_key[3] = { '_', 'o', 'n' };
+
+// Key of the insert log sequence number counter
+static const uint8_t sequence_key[3] = { '_', 's', 'q' };
+
+
+/** Return the value of a counter record in store, or 0 if it is
+ * missing.
+ */
+static uint64_t get_counter(PartitionStore* store, const uint8_t* key, size_t key_length)
+{
+    std::vector<char> buffer;
+    const uint8_t* value;
+    size_t length;
+
+    if (!store->get(key, key_length, buffer, &value, &length, NULL) || length != 8) {
+        return 0;
+    }
+
+    // Big-endian, as Kyoto Cabinet stores them
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8; i++) {
+        v = (v << 8) | value[i];
+    }
+    return v;
+}
+
+
+static inline uint64_t get_ordinal(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < ordinal_bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+
+/** Write the key of the hash record of an ordinal.
+ */
+static inline void hash_record_key(const uint8_t* ordinal, uint8_t* key)
+{
+    key[0] = 'O';
+    memcpy(key + 1, ordinal, ordinal_bytes);
+}
+
+
+/** Assign the next ordinal to a hash and its payload, writing the
+ * hash record and storing the ordinal in ordinal.
+ */
+static bool add_hash_record(PartitionStore* store, const HmSearch::hash_string& item,
+                            uint8_t* ordinal, std::string* error_msg)
+{
+    int64_t count;
+    if (!store->increment(ordinal_counter_key, sizeof(ordinal_counter_key),
+                          1, &count, error_msg)) {
         return false;
     }
 
-    if (!db->close()) {
-        *error_msg = db->error().message();
+    if (count > max_ordinals) {
+        *error_msg = "out of hash ordinals";
         return false;
     }
-    
-    return true;
+
+    uint64_t v = count - 1;
+    for (size_t i = ordinal_bytes; i > 0; i--, v >>= 8) {
+        ordinal[i - 1] = v;
+    }
+
+    // Written before the partition records, so that lookups never see
+    // an ordinal without its hash other than after a remove()
+    uint8_t key[1 + ordinal_bytes];
+    hash_record_key(ordinal, key);
+    return store->append(key, sizeof(key), item.data(), item.length(), error_msg);
 }
 
 
-HmSearch* HmSearch::open(const std::string& path,
-                         OpenMode mode,
-                         std::string* error_msg)
+/** Partition layout of hashes whose width is only known at runtime.
+ */
+class GenericLayout
 {
-    std::string dummy;
-    if (!error_msg) {
-        error_msg = &dummy;
+public:
+    GenericLayout(int hash_bits, int max_error, int substrings)
+        : _hash_bits(hash_bits)
+        , _hash_bytes((hash_bits + 7) / 8)
+        , _partitions(substrings > 0 ? substrings : (max_error + 3) / 2)
+        , _partition_bits(ceil((double)hash_bits / _partitions))
+        , _partition_bytes((_partition_bits + 7) / 8 + 1)
+        { }
+
+    /** Buffer for a partition key, kept on the stack for all but
+     * very wide hashes.
+     */
+    class KeyBuffer {
+    public:
+        KeyBuffer(const GenericLayout& layout) : _data(_inline) {
+            if (layout.key_length() > int(sizeof(_inline))) {
+                _heap.resize(layout.key_length());
+                _data = _heap.data();
+            }
+        }
+        operator uint8_t*() { return _data; }
+    private:
+        uint8_t _inline[80];
+        std::vector<uint8_t> _heap;
+        uint8_t* _data;
+    };
+
+    int hash_bits() const { return _hash_bits; }
+    int hash_bytes() const { return _hash_bytes; }
+    int partitions() const { return _partitions; }
+    int partition_bits() const { return _partition_bits; }
+    int partition_bytes() const { return _partition_bytes; }
+    int key_length() const { return _partition_bytes + 2; }
+
+    /** Write the key of a partition of hash into key, returning the
+     * number of bits in the partition.
+     */
+    int get_partition_key(const uint8_t* hash, int partition, uint8_t* key) const;
+
+private:
+    int _hash_bits;
+    int _hash_bytes;
+    int _partitions;
+    int _partition_bits;
+    int _partition_bytes;
+};
+
+
+/** Partition layout of hashes of a width known at compile time.
+ *
+ * The masks that extract each partition are precomputed as big-endian
+ * 64-bit words over a window of the hash starting at the first byte
+ * of the partition, so a partition key is a few word loads, ANDs and
+ * stores instead of a byte-by-byte loop.  The keys are identical to
+ * the ones produced by GenericLayout.
+ */
+template <int HashBits>
+class FixedLayout
+{
+public:
+    FixedLayout(int hash_bits, int max_error, int substrings);
+
+    class KeyBuffer {
+    public:
+        KeyBuffer(const FixedLayout&) {}
+        operator uint8_t*() { return _data; }
+    private:
+        uint8_t _data[2 + HashBits / 8 + 16];
+    };
+
+    int hash_bits() const { return HashBits; }
+    int hash_bytes() const { return HashBits / 8; }
+    int partitions() const { return _partitions; }
+    int partition_bits() const { return _partition_bits; }
+    int partition_bytes() const { return _partition_bytes; }
+    int key_length() const { return _partition_bytes + 2; }
+
+    int get_partition_key(const uint8_t* hash, int partition, uint8_t* key) const;
+
+private:
+    struct Partition {
+        int first_byte;
+        int bits;
+    };
+
+    int _partitions;
+    int _partition_bits;
+    int _partition_bytes;
+    int _window_words;
+
+    std::vector<Partition> _partition_info;
+
+    // _window_words masks per partition
+    std::vector<uint64_t> _masks;
+};
+
+
+/** The actual implementation of the HmSearch database.
+ *
+ * A difference between this implementation and the HmSearch algorithm
+ * in the paper is that only exact-matches are stored in the database,
+ * not the 1-matches.  The 1-var partitions are instead generated
+ * during lookup.  This drastically reduces database size, which with
+ * Kyoto Cabinet speeds up insertion and probably lookups too.
+ *
+ * The database contains some setting records controlling the
+ * operation:
+ *
+ * _hb: hash bits
+ * _me: max errors
+ * _pl: payload bytes per hash (optional, no payloads if missing)
+ * _or: "1" if the partition records hold ordinals (optional)
+ * _rc: initial capacity of padded partition records (optional, no
+ *      padding if missing), see KyotoStore
+ * _ds: data size in bytes expected at init (optional)
+ * _mi: number of multi-index substrings (optional, HmSearch
+ *      partitions if missing)
+ * _hx: "1" if the hashes have exact index records (optional)
+ * _pa: "1" if writers reserve _ds bytes of disk for the file (optional)
+ * _il: "1" if changes are appended to the insert log <path>.log (optional)
+ * _sq: counter record holding the sequence number of the last insert
+ *      log entry reflected in the database (optional)
+ *
+ * These can't be changed once the database has been initialised.
+ *
+ * Each partition is stored as a key on the following format:
+ *  Byte 0: 'P'
+ *  Byte 1: Partition number (thus limiting to max error 518)
+ *  Bytes 2-N: Partition bits.
+ *
+ * The value of a partition record is the hashes in the partition
+ * stored back to back, each immediately followed by its payload.
+ * The payload is thus fetched together with the hash by the same
+ * probes, at the cost of storing it once per partition.
+ *
+ * With ordinal postings, each inserted hash and its payload is
+ * instead stored once in a hash record:
+ *  Byte 0: 'O'
+ *  Bytes 1-5: Big-endian ordinal of the hash
+ *
+ * and the partition records hold the 5-byte ordinals.  The ordinals
+ * are assigned from the counter record _on, which holds the number of
+ * ordinals handed out so far.
+ *
+ * With _hx set, every hash also has an exact index record:
+ *  Byte 0: 'H'
+ *  Bytes 1-N: The hash
+ *
+ * holding the postings of all its copies, as in the partition
+ * records.  It is appended to after the partition records on insert,
+ * and removed from before them.
+ *
+ * With multi-index hashing the partitions are instead the _mi
+ * substrings of multi-index hashing, stored the same way.  A hash
+ * within distance r of the query has at least one substring within
+ * r / _mi of the query substring, so lookups probe all variants of
+ * each substring with up to that many bits flipped, and every hash
+ * found is a candidate.  This keeps the records selective at large
+ * max errors, where the HmSearch partitions are only a few bits wide
+ * and each of them holds a large part of the database.
+ *
+ * On stores with sorted postings, such as mapped files, records of
+ * at least sorted_run_postings postings are kept aside as runs.  The
+ * runs that are much larger than the rest of the records probed are
+ * binary searched for the candidates found elsewhere, and merged
+ * with each other to find the remaining hashes that are valid on
+ * their hits in the runs alone.  A hash in only one record can't be
+ * valid unless it's an exact match for an even max error, so a query
+ * hitting a crowded partition value no longer adds all its postings
+ * to the candidate table only to discard them.
+ *
+ * The Layout parameter computes the partition keys, allowing
+ * specialised engines for common hash widths.
+ */
+template <class Layout>
+class HmSearchImpl : public HmSearch
+{
+public:
+    HmSearchImpl(PartitionStore* store, int hash_bits, int max_error, int payload_bytes,
+                 bool ordinals, int substrings, bool exact_index, bool prefetch,
+                 InsertLog* log)
+        : _store(store)
+        , _max_error(max_error)
+        , _payload_bytes(payload_bytes)
+        , _ordinals(ordinals)
+        , _substrings(substrings)
+        , _exact_index(exact_index)
+        , _prefetch(prefetch)
+        , _sorted(store && store->sorted_postings())
+        , _layout(hash_bits, max_error, substrings)
+        , _log(log)
+        { }
+
+    ~HmSearchImpl() {
+        close();
+    }
+    
+    bool insert(const hash_string& hash,
+                const hash_string& payload,
+                std::string* error_msg = NULL);
+
+    bool insert_unique(const hash_string& hash,
+                       const hash_string& payload,
+                       bool* inserted = NULL,
+                       std::string* error_msg = NULL);
+
+    using HmSearch::insert;
+    using HmSearch::insert_unique;
+
+    bool remove(const hash_string& hash,
+                size_t* removed = NULL,
+                std::string* error_msg = NULL);
+
+    bool flush(std::string* error_msg = NULL);
+    
+    bool lookup(const hash_string& query,
+                LookupResultList& result,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup(const hash_string& query,
+                ResultVisitor& visitor,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    using HmSearch::lookup;
+
+    bool lookup_topk(const hash_string& query,
+                     size_t k,
+                     LookupResultList& result,
+                     int max_error = -1,
+                     std::string* error_msg = NULL,
+                     LookupStats* stats = NULL) {
+        return lookup_nearest(query, k, false, result, max_error, error_msg, stats);
+    }
+
+    bool lookup_first(const hash_string& query,
+                      LookupResultList& result,
+                      int max_error = -1,
+                      std::string* error_msg = NULL,
+                      LookupStats* stats = NULL) {
+        return lookup_nearest(query, 1, true, result, max_error, error_msg, stats);
+    }
+
+    bool contains(const hash_string& hash,
+                  bool* found,
+                  std::string* error_msg = NULL);
+
+    bool lookup_exact(const hash_string& query,
+                      LookupResultList& result,
+                      std::string* error_msg = NULL,
+                      LookupStats* stats = NULL);
+
+    bool lookup_batch(const std::vector<hash_string>& queries,
+                      std::vector<LookupResultList>& results,
+                      int max_error = -1,
+                      std::string* error_msg = NULL);
+
+    BulkLoader* bulk_load(const std::string& tmp_dir = "",
+                          size_t memory_limit = 0,
+                          unsigned threads = 1,
+                          std::string* error_msg = NULL);
+
+    bool compact(const std::string& path,
+                 std::string* error_msg = NULL);
+
+    bool save_snapshot(const std::string& path,
+                       std::string* error_msg = NULL);
+
+    bool apply_log(const std::string& path,
+                   uint64_t* sequence = NULL,
+                   std::string* error_msg = NULL);
+
+    bool merge(const std::string& path,
+               std::string* error_msg = NULL);
+
+    bool close(std::string* error_msg = NULL);
+
+    unsigned hash_bits() const { return _layout.hash_bits(); }
+    unsigned max_error() const { return _max_error; }
+    unsigned payload_bytes() const { return _payload_bytes; }
+
+    void dump();
+
+private:
+    typedef CandidateTable::Candidate Candidate;
+
+    /** Bytes of a hash and its payload in the partition records.
+     */
+    int item_bytes() const { return _layout.hash_bytes() + _payload_bytes; }
+
+    /** Bytes of each posting in the partition records: an ordinal or
+     * an item.
+     */
+    int posting_bytes() const { return _ordinals ? ordinal_bytes : item_bytes(); }
+
+    bool check_item(const hash_string& hash, const hash_string& payload,
+                    std::string* error_msg);
+
+    void lookup_batch_part(const hash_string* queries, size_t count,
+                           LookupResultList* results, int reduced_error,
+                           LookupStats* stats);
+
+    /** Inserts and removals that are logged with the given sequence
+     * number, or the next one if it is 0.
+     */
+    bool insert_sequenced(const hash_string& hash, const hash_string& payload,
+                          uint64_t sequence, std::string* error_msg);
+    bool remove_sequenced(const hash_string& hash, size_t* removed,
+                          uint64_t sequence, std::string* error_msg);
+
+    /** Append an entry to the insert log, unless it is replayed
+     * from another log and already in this one.
+     */
+    bool log_entry(InsertLog::Op op, const hash_string& hash, const uint8_t* payload,
+                   uint64_t sequence, std::string* error_msg) {
+        if (!_log || (sequence != 0 && sequence <= _log->sequence())) {
+            return true;
+        }
+        return _log->append(op, hash.data(), payload, sequence, error_msg);
+    }
+
+    bool contains_item(const hash_string& hash, const hash_string& payload);
+
+    bool save_sequence(uint64_t sequence, std::string* error_msg);
+
+    class MergeVisitor;
+
+    /** A partition key probed on behalf of one query in a batch.
+     */
+    struct BatchProbe {
+        BatchProbe(size_t k, size_t q, int m) : key(k), query(q), match(m) {}
+        size_t key;     // Offset of the key in the batch key buffer
+        size_t query;
+        int match;
+    };
+
+    /** Orders BatchProbes on their partition keys.
+     */
+    struct BatchProbeLess {
+        BatchProbeLess(const uint8_t* k, size_t l) : keys(k), key_length(l) {}
+        bool operator()(const BatchProbe& a, const BatchProbe& b) const {
+            return memcmp(keys + a.key, keys + b.key, key_length) < 0;
+        }
+        const uint8_t* keys;
+        size_t key_length;
+    };
+
+    /** A match kept by lookup_nearest(): the distance and the
+     * index in the candidate table.
+     */
+    typedef std::pair<int, uint32_t> NearMatch;
+
+    bool get_record(const uint8_t* key, std::vector<char>& buffer,
+                    const uint8_t** value, size_t* length,
+                    LookupStats* stats) {
+        return get_record(key, _layout.key_length(), buffer, value, length, stats);
+    }
+    bool get_record(const uint8_t* key, size_t key_length, std::vector<char>& buffer,
+                    const uint8_t** value, size_t* length,
+                    LookupStats* stats);
+    hash_string exact_key(const hash_string& hash) const {
+        return hash_string(1, 'H') + hash;
+    }
+    bool get_exact_record(const hash_string& hash, std::vector<char>& buffer,
+                          const uint8_t** value, size_t* length,
+                          LookupStats* stats);
+    size_t visit_exact(const hash_string& hash, const uint8_t* value, size_t length,
+                       ResultVisitor& visitor, LookupStats* stats);
+    bool fetch_item(const uint8_t* ordinal, const uint8_t** item,
+                    LookupStats* stats);
+    bool remove_postings(const hash_string& hash, size_t* removed,
+                         std::string* error_msg);
+    bool remove_ordinals(const hash_string& hash, size_t* removed,
+                         std::string* error_msg);
+    bool lookup_nearest(const hash_string& query, size_t k, bool first,
+                        LookupResultList& result, int reduced_error,
+                        std::string* error_msg, LookupStats* stats);
+    void lookup_multi_index_nearest(const hash_string& query, size_t k, bool first,
+                                    int max_distance, CandidateTable& candidates,
+                                    std::vector<NearMatch>& nearest,
+                                    LookupStats* stats);
+    static bool nearest_done(const std::vector<NearMatch>& nearest, size_t k, bool first,
+                             int bound, int max_distance);
+    void add_near_candidates(const hash_string& query, const uint8_t* hashes,
+                             size_t length, int max_distance, size_t k,
+                             CandidateTable& candidates,
+                             std::vector<NearMatch>& nearest,
+                             LookupStats* stats);
+    void add_near_ordinals(const hash_string& query, const uint8_t* ordinals,
+                           size_t length, int max_distance, size_t k,
+                           CandidateTable& candidates,
+                           std::vector<NearMatch>& nearest,
+                           LookupStats* stats);
+    static void add_near_match(const NearMatch& match, size_t k,
+                               std::vector<NearMatch>& nearest);
+    void variant_keys(const hash_string& query, int partition, int flips,
+                      std::vector<uint8_t>& keys);
+    int multi_index_radius(int max_distance) const {
+        return max_distance / _layout.partitions();
+    }
+    void prefetch_query(const hash_string& query);
+    void prefetch_items(const CandidateTable& candidates);
+    void get_candidates(const hash_string& query, int max_distance,
+                        CandidateTable& candidates,
+                        std::vector<char>& buffer, LookupStats* stats);
+    void get_multi_index_candidates(const hash_string& query, int max_distance,
+                                    CandidateTable& candidates,
+                                    std::vector<char>& buffer, LookupStats* stats);
+    void add_results(const hash_string& query, const CandidateTable& candidates,
+                     int reduced_error, ResultVisitor& visitor,
+                     LookupStats* stats);
+    void add_hash_candidates(CandidateTable& candidates, int match,
+                             const uint8_t* hashes, size_t length);
+    void add_record_candidates(CandidateTable& candidates, std::vector<SortedRun>& runs,
+                               int match, const uint8_t* hashes, size_t length);
+    void add_sorted_runs(CandidateTable& candidates, std::vector<SortedRun>& runs);
+    bool run_contains(const SortedRun& run, const uint8_t* posting) const;
+    static void add_match(Candidate& candidate, int match);
+    bool valid_candidate(const Candidate& candidate);
+    
+    PartitionStore* _store;
+    int _max_error;
+    int _payload_bytes;
+    bool _ordinals;
+    int _substrings;
+    bool _exact_index;
+    bool _prefetch;
+    bool _sorted;
+    Layout _layout;
+    InsertLog* _log;
+};
+
+
+/** Create an unlinked temporary file in dir, buffered with
+ * buffer_size bytes.
+ *
+ * Returns the file, or NULL on errors.
+ */
+static FILE* create_temp_file(const std::string& dir, size_t buffer_size,
+                              std::string* error_msg)
+{
+    std::string path = dir + "/hmsearch-XXXXXX";
+    std::vector<char> path_buf(path.begin(), path.end());
+    path_buf.push_back('\0');
+
+    int fd = mkstemp(path_buf.data());
+    if (fd < 0) {
+        *error_msg = std::string("cannot create temporary file: ") + strerror(errno);
+        return NULL;
+    }
+
+    // The file is only reachable through the open descriptor from now on
+    unlink(path_buf.data());
+
+    FILE* f = fdopen(fd, "w+b");
+    if (!f) {
+        *error_msg = std::string("cannot open temporary file: ") + strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, buffer_size);
+    return f;
+}
+
+
+/** Append the items of a partition 0 record, in which the copies of
+ * each hash are next to each other, to the exact index records of
+ * their hashes.
+ */
+static bool append_exact_records(PartitionStore* store, const uint8_t* items, size_t length,
+                                 size_t hash_bytes, size_t item_bytes,
+                                 std::string* error_msg)
+{
+    HmSearch::hash_string exact(1 + hash_bytes, 'H');
+
+    for (size_t i = 0; i + item_bytes <= length; ) {
+        size_t end = i + item_bytes;
+        while (end + item_bytes <= length
+               && memcmp(items + end, items + i, hash_bytes) == 0) {
+            end += item_bytes;
+        }
+
+        exact.replace(1, hash_bytes, items + i, hash_bytes);
+        if (!store->append(exact.data(), exact.length(), items + i, end - i, error_msg)) {
+            return false;
+        }
+        i = end;
+    }
+
+    return true;
+}
+
+
+/** Append the items written to file to the insert log, once the
+ * records they went into are complete.  The file is closed.
+ */
+static bool write_held_items(FILE* file, InsertLog* log, size_t hash_bytes, size_t item_bytes,
+                             std::string* error_msg)
+{
+    bool ok = fflush(file) == 0 && fseek(file, 0, SEEK_SET) == 0;
+    std::vector<uint8_t> item(item_bytes);
+
+    while (ok && fread(item.data(), item.size(), 1, file) == 1) {
+        if (!log->append(InsertLog::INSERT, item.data(), item.data() + hash_bytes, 0, error_msg)) {
+            fclose(file);
+            return false;
+        }
+    }
+
+    if (!ok || ferror(file)) {
+        *error_msg = std::string("cannot read temporary file: ") + strerror(errno);
+        ok = false;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+
+/** Bulk loader for HmSearchImpl.
+ *
+ * Each hash is expanded into one fixed-size record per partition,
+ * holding the partition key followed by the hash and its payload, or
+ * with ordinal postings by its ordinal.  The records are collected
+ * in memory separately for each partition, and spilled to unlinked
+ * temporary files as runs holding each partition sorted in turn.  On
+ * commit the runs of each partition are merged so that all hashes of
+ * a partition key arrive together and can be written with a single
+ * append.
+ *
+ * The partitions have disjoint keys, so they are sorted, merged and
+ * written independently on a pool of threads, each taking the next
+ * partition when done with one.  Each thread reads its part of the
+ * runs with pread() through its own buffers.
+ *
+ * The exact index records are written along with the records of
+ * partition 0, whose hashes arrive sorted with the copies of each
+ * hash next to each other.  With ordinals they are instead appended
+ * together with the hash record.
+ */
+template <class Layout>
+class BulkLoaderImpl : public HmSearch::BulkLoader
+{
+public:
+    BulkLoaderImpl(PartitionStore* store, const Layout& layout, int payload_bytes,
+                   bool ordinals, bool exact_index,
+                   const std::string& tmp_dir, size_t memory_limit,
+                   unsigned threads, InsertLog* log)
+        : _store(store)
+        , _layout(layout)
+        , _payload_bytes(payload_bytes)
+        , _ordinals(ordinals)
+        , _exact_index(exact_index)
+        , _tmp_dir(tmp_dir)
+        , _record_length(layout.key_length()
+                         + (ordinals ? ordinal_bytes : layout.hash_bytes() + payload_bytes))
+        , _max_records(std::max(size_t(1), memory_limit / _record_length))
+        , _threads(threads)
+        , _records(layout.partitions())
+        , _orders(layout.partitions())
+        , _buffered(0)
+        , _log(log)
+        , _logged(NULL)
+        { }
+
+    ~BulkLoaderImpl();
+
+    bool add(const HmSearch::hash_string& hash,
+             const HmSearch::hash_string& payload,
+             std::string* error_msg = NULL);
+
+    using HmSearch::BulkLoader::add;
+
+    bool commit(std::string* error_msg = NULL);
+
+private:
+    /** Orders records by comparing them in full, i.e. on the
+     * partition key first and then on the hash and payload.
+     */
+    struct RecordLess {
+        RecordLess(const uint8_t* r, size_t l) : records(r), length(l) {}
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(records + a * length, records + b * length, length) < 0;
+        }
+        const uint8_t* records;
+        size_t length;
+    };
+
+    /** A spilled run, with the byte offset of each partition in it
+     * followed by the end of the file.
+     */
+    struct SpillFile {
+        SpillFile(FILE* f) : file(f) {}
+        FILE* file;
+        std::vector<uint64_t> offsets;
+    };
+
+    /** Reads back the records of one partition of a spilled run.
+     */
+    struct Run {
+        Run(int fd, uint64_t start, uint64_t end, size_t length)
+            : record(NULL), error(false), _fd(fd), _pos(start), _end(end)
+            , _length(length), _offset(0), _filled(0)
+            , _buffer(std::max(size_t(1), run_read_size / length) * length)
+            {}
+
+        /** Point record at the next record, returning false at the
+         * end of the partition or on read errors.
+         */
+        bool next();
+
+        const uint8_t* record;
+        bool error;
+
+    private:
+        int _fd;
+        uint64_t _pos;
+        uint64_t _end;
+        size_t _length;
+        size_t _offset;
+        size_t _filled;
+        std::vector<uint8_t> _buffer;
+    };
+
+    /** Orders runs for the merge heap, putting the smallest record on top.
+     */
+    struct RunGreater {
+        RunGreater(size_t l) : length(l) {}
+        bool operator()(const Run* a, const Run* b) const {
+            return memcmp(a->record, b->record, length) > 0;
+        }
+        size_t length;
+    };
+
+    typedef bool (BulkLoaderImpl::*PartitionTask)(int partition, std::string* error_msg);
+
+    class TaskThread : public kyotocabinet::Thread
+    {
+    public:
+        TaskThread(BulkLoaderImpl* loader, PartitionTask task)
+            : _loader(loader), _task(task) {}
+        void run() { _loader->run_tasks(_task); }
+
+    private:
+        BulkLoaderImpl* _loader;
+        PartitionTask _task;
+    };
+
+    bool for_each_partition(PartitionTask task, std::string* error_msg);
+    void run_tasks(PartitionTask task);
+
+    bool sort_partition(int partition, std::string* error_msg);
+    bool write_buffered_partition(int partition, std::string* error_msg);
+    bool merge_partition(int partition, std::string* error_msg);
+
+    bool spill(std::string* error_msg);
+    bool write_partition(const uint8_t* key, const std::string& hashes,
+                         std::string* error_msg);
+    bool write_log(std::string* error_msg);
+
+    PartitionStore* _store;
+    Layout _layout;
+    int _payload_bytes;
+    bool _ordinals;
+    bool _exact_index;
+    std::string _tmp_dir;
+    size_t _record_length;
+    size_t _max_records;
+    unsigned _threads;
+
+    // The buffered records of each partition, and their sort order
+    std::vector<std::vector<uint8_t> > _records;
+    std::vector<std::vector<size_t> > _orders;
+    size_t _buffered;
+
+    std::vector<SpillFile> _runs;
+
+    // The hashes and payloads added, which are only written to the
+    // insert log once they are in the database
+    InsertLog* _log;
+    FILE* _logged;
+
+    // Protects the partition tasks below
+    kyotocabinet::Mutex _task_lock;
+    int _next_partition;
+    bool _task_failed;
+    std::string _task_error;
+
+    static const size_t run_buffer_size = 1 << 20;
+    static const size_t run_read_size = 64 << 10;
+};
+
+
+/** Return the settings records of a database.
+ */
+static std::map<std::string, std::string> settings_records(unsigned hash_bits,
+                                                           unsigned max_error,
+                                                           unsigned payload_bytes,
+                                                           bool ordinals,
+                                                           unsigned substrings,
+                                                           bool exact_index)
+{
+    std::map<std::string, std::string> settings;
+    char buf[20];
+
+    snprintf(buf, sizeof(buf), "%u", hash_bits);
+    settings["_hb"] = buf;
+
+    snprintf(buf, sizeof(buf), "%u", max_error);
+    settings["_me"] = buf;
+
+    if (payload_bytes > 0) {
+        snprintf(buf, sizeof(buf), "%u", payload_bytes);
+        settings["_pl"] = buf;
+    }
+
+    if (ordinals) {
+        settings["_or"] = "1";
+    }
+
+    if (substrings > 0) {
+        snprintf(buf, sizeof(buf), "%u", substrings);
+        settings["_mi"] = buf;
+    }
+
+    if (exact_index) {
+        settings["_hx"] = "1";
+    }
+
+    return settings;
+}
+
+
+/** Create an empty snapshot for the in-memory backend.
+ */
+static bool init_snapshot(const std::string& path,
+                          unsigned hash_bits, unsigned max_error,
+                          const HmSearch::InitOptions& options,
+                          unsigned substrings,
+                          std::string* error_msg)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_size > 0) {
+        *error_msg = "cannot initialise non-empty database";
+        return false;
+    }
+
+    std::map<std::string, std::string> settings = settings_records(
+        hash_bits, max_error, options.payload_bytes,
+        options.ordinal_postings, substrings, options.exact_index);
+    if (options.insert_log) {
+        settings["_il"] = "1";
+    }
+
+    std::auto_ptr<PartitionStore> empty(create_memory_store(path, false));
+    return write_memory_snapshot(*empty, path, settings, error_msg);
+}
+
+
+bool HmSearch::init(const std::string& path,
+                    unsigned hash_bits, unsigned max_error,
+                    uint64_t num_hashes,
+                    std::string* error_msg)
+{
+    return init(path, hash_bits, max_error, num_hashes, InitOptions(), error_msg);
+}
+
+
+bool HmSearch::init(const std::string& path,
+                    unsigned hash_bits, unsigned max_error,
+                    uint64_t num_hashes,
+                    const InitOptions& options,
+                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash_bits == 0 || (hash_bits & 7)) {
+        *error_msg = "invalid hash_bits value";
+        return false;
+    }
+
+    if (max_error == 0 || max_error >= hash_bits || max_error > 518) {
+        *error_msg = "invalid max_error value";
+        return false;
+    }
+
+    if (options.payload_bytes > 255) {
+        *error_msg = "invalid payload_bytes value";
+        return false;
+    }
+
+    unsigned substrings = 0;
+    if (options.multi_index) {
+        substrings = options.substrings;
+        if (substrings == 0) {
+            substrings = ceil(hash_bits / std::max(1.0, log2(double(num_hashes))));
+        }
+
+        if (substrings > std::min(hash_bits, 255u)) {
+            *error_msg = "invalid substrings value";
+            return false;
+        }
+    }
+
+    if (options.snapshot) {
+        return init_snapshot(path, hash_bits, max_error, options, substrings, error_msg);
+    }
+
+    std::auto_ptr<kyotocabinet::HashDB> db(new kyotocabinet::HashDB);
+    if (!db.get()) {
+        return false;
+    }
+
+    int partitions = substrings > 0 ? substrings : (max_error + 3) / 2;
+    int partition_bits = ceil((double)hash_bits / partitions);
+
+    uint64_t hashes_per_partition = std::max(uint64_t(1), num_hashes / (uint64_t(1) << partition_bits));
+    size_t posting_bytes = (options.ordinal_postings ? ordinal_bytes
+                            : hash_bits / 8 + options.payload_bytes);
+
+    // With several hashes per partition key, preallocate the partition
+    // records to the expected size and grow them geometrically, see
+    // KyotoStore.  Aligning the records to about that size and keeping
+    // a larger free block pool lets the outgrown records be reused.
+    uint64_t record_capacity = 0;
+    if (hashes_per_partition > 1) {
+        record_capacity = std::min(hashes_per_partition * posting_bytes,
+                                   uint64_t(max_record_capacity));
+
+        int apow = 0;
+        while (apow < max_alignment_power && (uint64_t(1) << (apow + 1)) <= record_capacity) {
+            apow++;
+        }
+
+        db->tune_alignment(apow);
+        db->tune_fbp(free_block_pool_power);
+    }
+
+    uint64_t keys = (num_hashes / hashes_per_partition) * partitions;
+    uint64_t records = (keys + (options.ordinal_postings ? num_hashes : 0)
+                        + (options.exact_index ? num_hashes : 0));
+
+    // Recorded for open() to size the memory mapping
+    uint64_t data_size = (keys * (hash_bits / 8 + record_overhead)
+                          + num_hashes * partitions * posting_bytes);
+    if (options.ordinal_postings) {
+        data_size += num_hashes * (1 + ordinal_bytes + hash_bits / 8 + options.payload_bytes
+                                   + record_overhead);
+    }
+    if (options.exact_index) {
+        data_size += num_hashes * (1 + hash_bits / 8 + posting_bytes + record_overhead);
+    }
+
+    int64_t buckets = options.buckets;
+    if (buckets <= 0) {
+        // Kyoto Cabinet recommends about twice as many buckets as
+        // records, but keep the bucket array to a part of the memory
+        buckets = std::max(int64_t(records * 2), min_buckets);
+        buckets = std::min(buckets, int64_t(physical_memory() / 4 / bucket_bytes));
+    }
+
+    db->tune_buckets(buckets);
+
+    // Smaller database and quicker inserts, no big effect on lookups
+    db->tune_options(kyotocabinet::HashDB::TLINEAR);
+    
+    if (!db->open(path, kyotocabinet::BasicDB::OWRITER | kyotocabinet::BasicDB::OCREATE)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (db->count() > 0) {
+        *error_msg = "cannot initialise non-empty database";
+        return false;
+    }
+    
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%u", hash_bits);
+    if (!db->set("_hb", buf)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    snprintf(buf, sizeof(buf), "%u", max_error);
+    if (!db->set("_me", buf)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    // Left out without payloads, so that older versions of the
+    // library can still open the database
+    if (options.payload_bytes > 0) {
+        snprintf(buf, sizeof(buf), "%u", options.payload_bytes);
+        if (!db->set("_pl", buf)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
+    if (options.ordinal_postings && !db->set("_or", "1")) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (substrings > 0) {
+        snprintf(buf, sizeof(buf), "%u", substrings);
+        if (!db->set("_mi", buf)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
+    if (options.exact_index && !db->set("_hx", "1")) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long) data_size);
+    if (!db->set("_ds", buf)) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (options.preallocate && !db->set("_pa", "1")) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (options.insert_log && !db->set("_il", "1")) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (record_capacity > 0) {
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long) record_capacity);
+        if (!db->set("_rc", buf)) {
+            *error_msg = db->error().message();
+            return false;
+        }
+    }
+
+    if (!db->close()) {
+        *error_msg = db->error().message();
+        return false;
+    }
+
+    if (options.preallocate) {
+        return preallocate_file(path, data_size, error_msg);
+    }
+
+    return true;
+}
+
+
+/** Create the engine for the store, using a specialised one for the
+ * common hash sizes.
+ */
+static HmSearch* create_engine(PartitionStore* store,
+                               unsigned hash_bits, unsigned max_error,
+                               unsigned payload_bytes, bool ordinals,
+                               unsigned substrings, bool exact_index, bool prefetch,
+                               InsertLog* log)
+{
+    switch (hash_bits) {
+    case 64:
+        return new HmSearchImpl<FixedLayout<64> >(store, hash_bits, max_error,
+                                                  payload_bytes, ordinals, substrings,
+                                                  exact_index, prefetch, log);
+
+    case 128:
+        return new HmSearchImpl<FixedLayout<128> >(store, hash_bits, max_error,
+                                                   payload_bytes, ordinals, substrings,
+                                                   exact_index, prefetch, log);
+
+    case 256:
+        return new HmSearchImpl<FixedLayout<256> >(store, hash_bits, max_error,
+                                                   payload_bytes, ordinals, substrings,
+                                                   exact_index, prefetch, log);
+
+    default:
+        return new HmSearchImpl<GenericLayout>(store, hash_bits, max_error,
+                                               payload_bytes, ordinals, substrings,
+                                               exact_index, prefetch, log);
+    }
+}
+
+
+static std::string format_number(int64_t n)
+{
+    char buf[24];
+    snprintf(buf, sizeof(buf), "%lld", (long long) n);
+    return buf;
+}
+
+
+/** Return the number of bytes of the database at path to memory map.
+ */
+static int64_t map_size(const std::string& path, HmSearch::OpenMode mode,
+                        const HmSearch::OpenOptions& options)
+{
+    if (options.map_size > 0) {
+        return options.map_size;
+    }
+
+    struct stat st;
+    int64_t size = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+
+    if (mode != HmSearch::READONLY) {
+        // The expected size is only known after opening, so peek at
+        // it with a separate reader
+        kyotocabinet::HashDB db;
+        std::string v;
+        if (db.open(path, kyotocabinet::BasicDB::OREADER | kyotocabinet::BasicDB::ONOLOCK)) {
+            if (db.get("_ds", &v)) {
+                size = std::max(size, int64_t(strtoull(v.c_str(), NULL, 10)));
+            }
+            db.close();
+        }
+        size += size / 4;
+    }
+
+    size = std::min(size, int64_t(physical_memory() / 4 * 3));
+    return std::max(size, min_map_size);
+}
+
+
+/** Copy all records of db into a new in-memory database.
+ */
+static kyotocabinet::PolyDB* copy_to_memory(kyotocabinet::PolyDB* db,
+                                            HmSearch::Backend backend,
+                                            std::string* error_msg)
+{
+    std::string name = (backend == HmSearch::STASH_BACKEND ? ":" : "*");
+    name += "#bnum=" + format_number(std::max(db->count() * 2, min_buckets));
+
+    std::auto_ptr<kyotocabinet::PolyDB> memory(new kyotocabinet::PolyDB);
+    if (!memory->open(name, kyotocabinet::BasicDB::OWRITER | kyotocabinet::BasicDB::OCREATE)) {
+        *error_msg = memory->error().message();
+        return NULL;
+    }
+
+    kyotocabinet::BasicDB::Cursor* c = db->cursor();
+    std::string key, value;
+    bool ok = true;
+
+    c->jump();
+    while (ok && c->get(&key, &value, true)) {
+        if (!memory->set(key, value)) {
+            *error_msg = memory->error().message();
+            ok = false;
+        }
+    }
+
+    kyotocabinet::BasicDB::Error::Code code = db->error().code();
+    if (ok && code != kyotocabinet::BasicDB::Error::SUCCESS
+        && code != kyotocabinet::BasicDB::Error::NOREC) {
+        *error_msg = db->error().message();
+        ok = false;
+    }
+
+    delete c;
+    return ok ? memory.release() : NULL;
+}
+
+
+/** Return the numeric value of a settings record in store, or 0 if
+ * it is missing.
+ */
+static unsigned long get_setting(PartitionStore* store, const char* key)
+{
+    std::vector<char> buffer;
+    const uint8_t* value;
+    size_t length;
+
+    if (!store->get((const uint8_t*) key, strlen(key), buffer, &value, &length, NULL)) {
+        return 0;
+    }
+    return strtoul(std::string((const char*) value, length).c_str(), NULL, 10);
+}
+
+
+/** Load a snapshot into the in-memory backend.  The engine uses the
+ * store directly, since it has nothing to gain from the cache, key
+ * filter or insert buffer.
+ */
+static HmSearch* open_snapshot(const std::string& path,
+                               HmSearch::OpenMode mode,
+                               std::string* error_msg)
+{
+    PartitionStore* store = load_memory_snapshot(path, mode != HmSearch::READONLY, error_msg);
+    if (!store) {
+        return NULL;
+    }
+
+    unsigned long hash_bits = get_setting(store, "_hb");
+    unsigned long max_error = get_setting(store, "_me");
+    if (!hash_bits || !max_error) {
+        *error_msg = "missing settings in snapshot";
+        delete store;
+        return NULL;
+    }
+
+    InsertLog* log = NULL;
+    if (mode != HmSearch::READONLY && get_setting(store, "_il") == 1) {
+        log = InsertLog::open(path + ".log", hash_bits, get_setting(store, "_pl"),
+                              get_counter(store, sequence_key, sizeof(sequence_key)),
+                              error_msg);
+        if (!log) {
+            delete store;
+            return NULL;
+        }
+    }
+
+    HmSearch* hm = create_engine(store, hash_bits, max_error,
+                                 get_setting(store, "_pl"), get_setting(store, "_or") == 1,
+                                 get_setting(store, "_mi"), get_setting(store, "_hx") == 1,
+                                 false, log);
+    if (!hm) {
+        *error_msg = "out of memory";
+        delete log;
+        delete store;
+        return NULL;
+    }
+
+    return hm;
+}
+
+
+HmSearch* HmSearch::open(const std::string& path,
+                         OpenMode mode,
+                         std::string* error_msg)
+{
+    return open(path, mode, OpenOptions(), error_msg);
+}
+
+
+HmSearch* HmSearch::open(const std::string& path,
+                         OpenMode mode,
+                         const OpenOptions& options,
+                         std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (is_shard_manifest(path)) {
+        return open_sharded(path, mode, options, error_msg);
+    }
+
+    if (is_mapped_store(path)) {
+        if (mode != READONLY) {
+            *error_msg = "mapped databases can only be opened read-only";
+            return NULL;
+        }
+
+        unsigned hash_bits, max_error, payload_bytes, substrings;
+        bool ordinals;
+        PartitionStore* store = open_mapped_store(path, &hash_bits, &max_error,
+                                                  &payload_bytes, &ordinals, &substrings,
+                                                  error_msg);
+        if (!store) {
+            return NULL;
+        }
+
+        if (options.advice != ADVISE_NORMAL) {
+            store->advise(PartitionStore::Advice(options.advice));
+        }
+
+        return create_engine(store, hash_bits, max_error, payload_bytes, ordinals,
+                             substrings, false, options.prefetch, NULL);
+    }
+
+    if (is_memory_snapshot(path)) {
+        return open_snapshot(path, mode, error_msg);
+    }
+
+    if (options.backend != FILE_BACKEND && mode != READONLY) {
+        *error_msg = "in-memory backends can only be opened read-only";
+        return NULL;
+    }
+
+    std::auto_ptr<kyotocabinet::PolyDB> db(new kyotocabinet::PolyDB);
+    if (!db.get()) {
+        return NULL;
+    }
+
+    if (!db->open(path + "#msiz=" + format_number(map_size(path, mode, options)),
+                  (mode == READONLY ?
+                   kyotocabinet::BasicDB::OREADER :
+                   kyotocabinet::BasicDB::OWRITER))) {
+        *error_msg = db->error().message();
+        return NULL;
+    }
+    
+    std::string v;
+    unsigned long hash_bits, max_error;
+    if (!db->get("_hb", &v) || !(hash_bits = strtoul(v.c_str(), NULL, 10))) {
+        *error_msg = db->error().message();
+        return NULL;
+    }
+        
+    if (!db->get("_me", &v) || !(max_error = strtoul(v.c_str(), NULL, 10))) {
+        *error_msg = db->error().message();
+        return NULL;
+    }
+
+    unsigned long payload_bytes = 0;
+    if (db->get("_pl", &v)) {
+        payload_bytes = strtoul(v.c_str(), NULL, 10);
+    }
+
+    bool ordinals = db->get("_or", &v) && v == "1";
+
+    unsigned long substrings = 0;
+    if (db->get("_mi", &v)) {
+        substrings = strtoul(v.c_str(), NULL, 10);
+    }
+
+    bool exact_index = db->get("_hx", &v) && v == "1";
+    bool insert_log = mode != READONLY && db->get("_il", &v) && v == "1";
+    if (insert_log && options.insert_buffer > 0) {
+        // Entries would be logged before their hashes are written
+        *error_msg = "databases with an insert log can't be opened with an insert buffer";
+        return NULL;
+    }
+
+    unsigned long record_capacity = 0;
+    if (db->get("_rc", &v)) {
+        record_capacity = strtoul(v.c_str(), NULL, 10);
+    }
+
+    if (mode != READONLY && db->get("_pa", &v) && v == "1" && db->get("_ds", &v)) {
+        // Only a layout hint, so a failure doesn't stop the open
+        std::string ignored;
+        preallocate_file(path, strtoull(v.c_str(), NULL, 10), &ignored);
+    }
+
+    int64_t file_records = db->count(), file_bytes = db->size();
+    if (options.backend != FILE_BACKEND) {
+        kyotocabinet::PolyDB* memory = copy_to_memory(db.get(), options.backend, error_msg);
+        if (!memory) {
+            return NULL;
+        }
+        db.reset(memory);
+    }
+
+    std::string filter_path = path + ".filter";
+    if (mode != READONLY && !options.key_filter) {
+        // Inserts without the filter would leave the sidecar stale
+        unlink(filter_path.c_str());
+    }
+
+    KyotoStore* kyoto = new KyotoStore(db.release(), record_capacity);
+    if (options.backend != FILE_BACKEND) {
+        kyoto->fix_stamp(file_records, file_bytes);
+    }
+
+    PartitionStore* store = kyoto;
+    if (options.advice != ADVISE_NORMAL) {
+        store->advise(PartitionStore::Advice(options.advice));
+    }
+    if (options.cache_size > 0) {
+        store = create_cached_store(store, options.cache_size);
+    }
+    if (options.key_filter) {
+        PartitionStore* filtered = create_filtered_store(
+            store, filter_path, mode != READONLY, error_msg);
+        if (!filtered) {
+            delete store;
+            return NULL;
+        }
+        store = filtered;
+    }
+    if (mode != READONLY && options.insert_buffer > 0) {
+        store = create_buffered_store(store, options.insert_buffer, options.flush_interval);
+    }
+
+    InsertLog* log = NULL;
+    if (insert_log) {
+        log = InsertLog::open(path + ".log", hash_bits, payload_bytes,
+                              get_counter(store, sequence_key, sizeof(sequence_key)),
+                              error_msg);
+        if (!log) {
+            delete store;
+            return NULL;
+        }
+    }
+
+    HmSearch* hm = create_engine(store, hash_bits, max_error, payload_bytes, ordinals,
+                                 substrings, exact_index, options.prefetch, log);
+    if (!hm) {
+        *error_msg = "out of memory";
+        delete log;
+        delete store;
+        return NULL;
+    }
+
+    return hm;
+}
+
+
+/** Tables for parsing and formatting hexadecimal hashes a byte at a time.
+ */
+static struct HexTables {
+    HexTables() {
+        static const char digits[] = "0123456789abcdef";
+
+        // Invalid characters get the high bits set
+        memset(values, 0xf0, sizeof(values));
+        for (int i = 0; i < 10; i++) {
+            values['0' + i] = i;
+        }
+        for (int i = 0; i < 6; i++) {
+            values['a' + i] = values['A' + i] = 10 + i;
+        }
+
+        for (int i = 0; i < 256; i++) {
+            pairs[i * 2] = digits[i >> 4];
+            pairs[i * 2 + 1] = digits[i & 0xf];
+        }
+    }
+
+    uint8_t values[256];
+    char pairs[512];
+} hex_tables;
+
+
+HmSearch::hash_string HmSearch::parse_hexhash(const std::string& hexhash)
+{
+    // An odd trailing digit is ignored
+    hash_string hash(hexhash.length() / 2, 0);
+
+    if (!parse_hexhash(hexhash.data(), hash.length() * 2, &hash[0])) {
+        return hash_string();
+    }
+
+    return hash;
+}
+
+
+bool HmSearch::parse_hexhash(const char* hex, size_t length, uint8_t* hash)
+{
+    if (length & 1) {
+        return false;
+    }
+
+    // Check the high bits once at the end instead of branching on
+    // every digit
+    uint8_t invalid = 0;
+
+    for (size_t i = 0; i < length / 2; i++) {
+        uint8_t high = hex_tables.values[(uint8_t) hex[i * 2]];
+        uint8_t low = hex_tables.values[(uint8_t) hex[i * 2 + 1]];
+        invalid |= high | low;
+        hash[i] = (high << 4) | low;
+    }
+
+    return !(invalid & 0xf0);
+}
+
+
+std::string HmSearch::format_hexhash(const HmSearch::hash_string& hash)
+{
+    std::string hex(hash.length() * 2, 0);
+    format_hexhash(hash.data(), hash.length(), &hex[0]);
+    return hex;
+}
+
+
+void HmSearch::format_hexhash(const uint8_t* hash, size_t length, char* hex)
+{
+    for (size_t i = 0; i < length; i++) {
+        memcpy(hex + i * 2, hex_tables.pairs + hash[i] * 2, 2);
+    }
+}
+
+
+bool HmSearch::lookup(const hash_string& query,
+                      LookupResultVector& result,
+                      int max_error,
+                      std::string* error_msg,
+                      LookupStats* stats)
+{
+    VectorVisitor visitor(result, query.length(), payload_bytes());
+    return lookup(query, visitor, max_error, error_msg, stats);
+}
+
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::check_item(const hash_string& hash,
+                                      const hash_string& payload,
+                                      std::string* error_msg)
+{
+    if (hash.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (payload.length() != (size_t) _payload_bytes) {
+        *error_msg = "incorrect payload length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return true;
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::insert(const hash_string& hash,
+                          const hash_string& payload,
+                          std::string* error_msg)
+{
+    return insert_sequenced(hash, payload, 0, error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::insert_sequenced(const hash_string& hash,
+                                            const hash_string& payload,
+                                            uint64_t sequence,
+                                            std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!check_item(hash, payload, error_msg)) {
+        return false;
+    }
+
+    hash_string item = hash + payload;
+    const uint8_t* posting = item.data();
+    uint8_t ordinal[ordinal_bytes];
+
+    if (_ordinals) {
+        if (!add_hash_record(_store, item, ordinal, error_msg)) {
+            return false;
+        }
+        posting = ordinal;
+    }
+
+    for (int i = 0; i < _layout.partitions(); i++) {
+        typename Layout::KeyBuffer key_buffer(_layout);
+        uint8_t* key = key_buffer;
+
+        _layout.get_partition_key(hash.data(), i, key);
+
+        if (!_store->append(key, _layout.key_length(),
+                            posting, posting_bytes(), error_msg)) {
+            return false;
+        }
+    }
+
+    if (_exact_index) {
+        hash_string key = exact_key(hash);
+        if (!_store->append(key.data(), key.length(), posting, posting_bytes(), error_msg)) {
+            return false;
+        }
+    }
+
+    // Logged once the hash has been written to the store, which is
+    // never buffered with a log, so that a replica never gets an
+    // entry the database may not have
+    return log_entry(InsertLog::INSERT, hash, payload.data(), sequence, error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::insert_unique(const hash_string& hash,
+                                         const hash_string& payload,
+                                         bool* inserted,
+                                         std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!check_item(hash, payload, error_msg)) {
+        return false;
+    }
+
+    if (contains_item(hash, payload)) {
+        if (inserted) {
+            *inserted = false;
+        }
+        return true;
+    }
+
+    if (!insert(hash, payload, error_msg)) {
+        return false;
+    }
+
+    if (inserted) {
+        *inserted = true;
+    }
+    return true;
+}
+
+
+/** Return true if the database has a copy of the hash with this
+ * payload.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::contains_item(const hash_string& hash,
+                                         const hash_string& payload)
+{
+    // Every copy of the hash is in the exact-match record of each
+    // of its partitions, so checking one of them is enough
+    const uint8_t* value;
+    size_t length;
+    hash_string item = hash + payload;
+
+    if (get_exact_record(hash, lookup_context.buffer, &value, &length, NULL)) {
+        for (size_t n = 0; n + posting_bytes() <= length; n += posting_bytes()) {
+            const uint8_t* existing = value + n;
+            if (_ordinals && !fetch_item(value + n, &existing, NULL)) {
+                continue;
+            }
+            if (memcmp(existing, item.data(), item.length()) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::remove(const hash_string& hash,
+                                  size_t* removed,
+                                  std::string* error_msg)
+{
+    return remove_sequenced(hash, removed, 0, error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::remove_sequenced(const hash_string& hash,
+                                            size_t* removed,
+                                            uint64_t sequence,
+                                            std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    size_t count = 0;
+
+    if (_ordinals) {
+        if (!remove_ordinals(hash, &count, error_msg)) {
+            return false;
+        }
+    }
+    else if (!remove_postings(hash, &count, error_msg)) {
+        return false;
+    }
+
+    if (removed) {
+        *removed = count;
+    }
+
+    // Removing nothing changes nothing, unless it's replayed from
+    // a log whose sequence numbers must be kept
+    if (count == 0 && sequence == 0) {
+        return true;
+    }
+
+    return log_entry(InsertLog::REMOVE, hash, NULL, sequence, error_msg);
+}
+
+
+/** Remove the copies of a hash from a database with full postings.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::remove_postings(const hash_string& hash,
+                                           size_t* removed,
+                                           std::string* error_msg)
+{
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+
+    if (_exact_index) {
+        hash_string exact = exact_key(hash);
+        size_t n;
+        if (!_store->remove(exact.data(), exact.length(),
+                            hash.data(), hash.length(), item_bytes(), &n, error_msg)) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < _layout.partitions(); i++) {
+        size_t n;
+
+        _layout.get_partition_key(hash.data(), i, key);
+
+        if (!_store->remove(key, _layout.key_length(),
+                            hash.data(), hash.length(), item_bytes(), &n, error_msg)) {
+            return false;
+        }
+
+        // Each copy is in every partition
+        if (i == 0) {
+            *removed = n;
+        }
+    }
+
+    return true;
+}
+
+
+/** Remove the copies of a hash from a database with ordinal postings.
+ *
+ * The ordinals of the copies are found through the exact index or the
+ * exact-match record of partition 0, and then removed from there and
+ * the records of every partition before their hash records.  Any
+ * buffered inserts are flushed first, since their ordinals wouldn't be
+ * found otherwise.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::remove_ordinals(const hash_string& hash,
+                                           size_t* removed,
+                                           std::string* error_msg)
+{
+    if (!_store->flush(error_msg)) {
+        return false;
+    }
+
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    const uint8_t* value;
+    size_t length;
+
+    // Collect the ordinals of the copies first, as removing them
+    // changes the record
+    std::vector<uint8_t> ordinals;
+
+    if (get_exact_record(hash, lookup_context.buffer, &value, &length, NULL)) {
+        for (size_t n = 0; n + ordinal_bytes <= length; n += ordinal_bytes) {
+            const uint8_t* item;
+            if (fetch_item(value + n, &item, NULL)
+                && memcmp(item, hash.data(), hash.length()) == 0) {
+                ordinals.insert(ordinals.end(), value + n, value + n + ordinal_bytes);
+            }
+        }
+    }
+
+    hash_string exact = exact_key(hash);
+
+    for (size_t n = 0; n < ordinals.size(); n += ordinal_bytes) {
+        size_t count;
+
+        if (_exact_index
+            && !_store->remove(exact.data(), exact.length(),
+                               &ordinals[n], ordinal_bytes, ordinal_bytes,
+                               &count, error_msg)) {
+            return false;
+        }
+
+        for (int i = 0; i < _layout.partitions(); i++) {
+            _layout.get_partition_key(hash.data(), i, key);
+
+            if (!_store->remove(key, _layout.key_length(),
+                                &ordinals[n], ordinal_bytes, ordinal_bytes,
+                                &count, error_msg)) {
+                return false;
+            }
+        }
+
+        uint8_t hash_key[1 + ordinal_bytes];
+        hash_record_key(&ordinals[n], hash_key);
+
+        if (!_store->remove(hash_key, sizeof(hash_key),
+                            hash.data(), hash.length(), item_bytes(),
+                            &count, error_msg)) {
+            return false;
+        }
+    }
+
+    *removed = ordinals.size() / ordinal_bytes;
+    return true;
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::flush(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (!_store->flush(error_msg)) {
+        return false;
+    }
+
+    return !_log || save_sequence(_log->sequence(), error_msg);
+}
+
+
+/** Save the sequence number of the last insert log entry reflected
+ * in the database.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::save_sequence(uint64_t sequence, std::string* error_msg)
+{
+    uint64_t saved = get_counter(_store, sequence_key, sizeof(sequence_key));
+    if (saved == sequence) {
+        return true;
+    }
+
+    int64_t result;
+    return _store->increment(sequence_key, sizeof(sequence_key),
+                             (int64_t) (sequence - saved), &result, error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::lookup(const hash_string& query,
+                          LookupResultList& result,
+                          int reduced_error,
+                          std::string* error_msg,
+                          LookupStats* stats)
+{
+    ListVisitor visitor(result, _layout.hash_bytes(), _payload_bytes);
+    return lookup(query, visitor, reduced_error, error_msg, stats);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::lookup(const hash_string& query,
+                          ResultVisitor& visitor,
+                          int reduced_error,
+                          std::string* error_msg,
+                          LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    CandidateTable& candidates = lookup_context.candidates;
+    candidates.clear(posting_bytes());
+
+    LookupStats local;
+    LookupStats* s = select_stats(stats, &local);
+    uint64_t start = s ? stats_clock() : 0;
+
+    int max_distance = _max_error;
+    if (reduced_error >= 0 && reduced_error < max_distance) {
+        max_distance = reduced_error;
+    }
+
+    get_candidates(query, max_distance, candidates, lookup_context.buffer, s);
+
+    if (s) {
+        uint64_t now = stats_clock();
+        s->probe_ns += now - start;
+        start = now;
+    }
+
+    add_results(query, candidates, reduced_error, visitor, s);
+
+    if (s) {
+        s->verify_ns += stats_clock() - start;
+        s->lookups++;
+        add_stats(local, stats);
+    }
+
+    return true;
+}
+
+
+/** Notes whether any match was visited, stopping at the first.
+ */
+class FoundVisitor : public HmSearch::ResultVisitor
+{
+public:
+    FoundVisitor() : found(false) {}
+
+    bool visit(const uint8_t* hash, int distance) {
+        found = true;
+        return false;
+    }
+
+    bool found;
+};
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::contains(const hash_string& hash,
+                                    bool* found,
+                                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    const uint8_t* value;
+    size_t length;
+    *found = false;
+
+    if (get_exact_record(hash, lookup_context.buffer, &value, &length, NULL)) {
+        if (_exact_index && _ordinals) {
+            // Every ordinal in the index is a copy, no need to fetch it
+            *found = length >= ordinal_bytes;
+        }
+        else {
+            FoundVisitor visitor;
+            visit_exact(hash, value, length, visitor, NULL);
+            *found = visitor.found;
+        }
+    }
+
+    return true;
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::lookup_exact(const hash_string& query,
+                                        LookupResultList& result,
+                                        std::string* error_msg,
+                                        LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    LookupStats local;
+    LookupStats* s = select_stats(stats, &local);
+    uint64_t start = s ? stats_clock() : 0;
+
+    const uint8_t* value;
+    size_t length;
+    size_t found = 0;
+
+    if (get_exact_record(query, lookup_context.buffer, &value, &length, s)) {
+        ListVisitor visitor(result, _layout.hash_bytes(), _payload_bytes);
+        found = visit_exact(query, value, length, visitor, s);
+    }
+
+    if (s) {
+        s->probe_ns += stats_clock() - start;
+        s->within_distance += found;
+        s->results += found;
+        s->lookups++;
+        add_stats(local, stats);
+    }
+
+    return true;
+}
+
+
+/** Lookup the k nearest matches, or with first set any k matches.
+ *
+ * The matches are kept in a max-heap on the distance.  bound is the
+ * least distance of any hash not yet seen: a hash that isn't in any
+ * of the records probed so far differs in at least one bit in each
+ * partition whose exact key has been probed, and in at least two bits
+ * in each partition whose 1-variant keys have also been probed.
+ * Probing stops when the heap is full and no unseen hash can be
+ * nearer than its top, or no unseen hash can be within max_distance.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::lookup_nearest(const hash_string& query,
+                                          size_t k, bool first,
+                                          LookupResultList& result,
+                                          int reduced_error,
+                                          std::string* error_msg,
+                                          LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != (size_t) _layout.hash_bytes()) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (k == 0) {
+        return true;
+    }
+
+    int max_distance = _max_error;
+    if (reduced_error >= 0 && reduced_error < max_distance) {
+        max_distance = reduced_error;
+    }
+
+    CandidateTable& candidates = lookup_context.candidates;
+    candidates.clear(posting_bytes());
+
+    std::vector<NearMatch>& nearest = lookup_context.nearest;
+    nearest.clear();
+
+    // The hashes of ordinal candidates, by candidate index
+    lookup_context.items.clear();
+
+    LookupStats local;
+    LookupStats* s = select_stats(stats, &local);
+    uint64_t start = s ? stats_clock() : 0;
+
+    std::vector<char>& buffer = lookup_context.buffer;
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    const uint8_t* value;
+    size_t length;
+    int bound = 0;
+
+    // Nothing is nearer than the exact copies, so if the index has k
+    // of them they are the answer
+    if (_exact_index && get_exact_record(query, buffer, &value, &length, s)) {
+        LookupResultList exact;
+        ListVisitor visitor(exact, _layout.hash_bytes(), _payload_bytes);
+        if (visit_exact(query, value, length, visitor, s) >= k) {
+            LookupResultList::iterator end = exact.begin();
+            std::advance(end, k);
+            result.splice(result.end(), exact, exact.begin(), end);
+
+            if (s) {
+                s->probe_ns += stats_clock() - start;
+                s->within_distance += k;
+                s->results += k;
+                s->lookups++;
+                add_stats(local, stats);
+            }
+            return true;
+        }
+    }
+
+    if (_substrings) {
+        lookup_multi_index_nearest(query, k, first, max_distance, candidates, nearest, s);
+    }
+
+    // Exact keys of all partitions first
+    for (int i = 0; !_substrings && i < _layout.partitions(); i++, bound++) {
+        if (nearest_done(nearest, k, first, bound, max_distance)) {
+            break;
+        }
+
+        _layout.get_partition_key(query.data(), i, key);
+        if (get_record(key, buffer, &value, &length, s)) {
+            add_near_candidates(query, value, length, max_distance, k, candidates, nearest, s);
+        }
+    }
+
+    // Then the 1-variant keys, one partition at a time
+    for (int i = 0; !_substrings && i < _layout.partitions(); i++, bound++) {
+        if (nearest_done(nearest, k, first, bound, max_distance)) {
+            break;
+        }
+
+        int bits = _layout.get_partition_key(query.data(), i, key);
+
+        int pbyte = (i * _layout.partition_bits()) / 8;
+        for (int pbit = i * _layout.partition_bits(); bits > 0; pbit++, bits--) {
+            if (nearest_done(nearest, k, first, bound, max_distance)) {
+                break;
+            }
+
+            uint8_t flip = 1 << (7 - (pbit % 8));
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+
+            if (get_record(key, buffer, &value, &length, s)) {
+                add_near_candidates(query, value, length, max_distance, k, candidates, nearest, s);
+            }
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+        }
+    }
+
+    std::sort_heap(nearest.begin(), nearest.end());
+    for (size_t i = 0; i < nearest.size(); i++) {
+        const uint8_t* item = (_ordinals ?
+                               &lookup_context.items[nearest[i].second * item_bytes()] :
+                               candidates.key(nearest[i].second));
+        result.push_back(LookupResult(hash_string(item, _layout.hash_bytes()),
+                                      nearest[i].first,
+                                      hash_string(item + _layout.hash_bytes(),
+                                                  _payload_bytes)));
+    }
+
+    if (s) {
+        s->probe_ns += stats_clock() - start;
+        s->candidates += candidates.size();
+        s->within_distance += candidates.size();
+        s->results += nearest.size();
+        s->lookups++;
+        add_stats(local, stats);
+    }
+
+    return true;
+}
+
+
+/** Probe the substrings for lookup_nearest() with multi-index
+ * hashing, in rounds of increasing numbers of flipped bits.
+ *
+ * A hash that isn't in any of the records probed so far differs in
+ * more than flips bits in each substring already probed with flips
+ * bits flipped in the current round, and in at least flips bits in
+ * the rest.
+ */
+template <class Layout>
+void HmSearchImpl<Layout>::lookup_multi_index_nearest(const hash_string& query,
+                                                      size_t k, bool first,
+                                                      int max_distance,
+                                                      CandidateTable& candidates,
+                                                      std::vector<NearMatch>& nearest,
+                                                      LookupStats* stats)
+{
+    const size_t key_length = _layout.key_length();
+    std::vector<uint8_t>& keys = lookup_context.probe_keys;
+    std::vector<char>& buffer = lookup_context.buffer;
+    const uint8_t* value;
+    size_t length;
+
+    for (int flips = 0; flips <= _layout.partition_bits(); flips++) {
+        for (int i = 0; i < _layout.partitions(); i++) {
+            int bound = flips * _layout.partitions() + i;
+            if (nearest_done(nearest, k, first, bound, max_distance)) {
+                return;
+            }
+
+            keys.clear();
+            variant_keys(query, i, flips, keys);
+
+            for (size_t n = 0; n < keys.size(); n += key_length) {
+                if (get_record(&keys[n], buffer, &value, &length, stats)) {
+                    add_near_candidates(query, value, length, max_distance, k,
+                                        candidates, nearest, stats);
+                    if (nearest_done(nearest, k, first, bound, max_distance)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::nearest_done(const std::vector<NearMatch>& nearest,
+                                        size_t k, bool first,
+                                        int bound, int max_distance)
+{
+    if (bound > max_distance) {
+        return true;
+    }
+
+    return nearest.size() >= k && (first || nearest.front().first <= bound);
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_near_candidates(
+    const hash_string& query, const uint8_t* hashes,
+    size_t length, int max_distance, size_t k,
+    CandidateTable& candidates,
+    std::vector<NearMatch>& nearest,
+    LookupStats* stats)
+{
+    if (_ordinals) {
+        add_near_ordinals(query, hashes, length, max_distance, k, candidates, nearest, stats);
+        return;
+    }
+
+    size_t count = length / item_bytes();
+
+    std::vector<uint32_t>& matches = lookup_context.matches;
+    std::vector<int>& distances = lookup_context.distances;
+    if (matches.size() < count) {
+        matches.resize(count);
+        distances.resize(count);
+    }
+
+    size_t found = hamming_distance_block(query.data(), hashes,
+                                          _layout.hash_bytes(), item_bytes(),
+                                          count, max_distance,
+                                          matches.data(), distances.data());
+
+    for (size_t i = 0; i < found; i++) {
+        // Only the matches are added, so the table just dedupes them
+        size_t index = candidates.size();
+        candidates.get(hashes + matches[i] * item_bytes());
+        if (candidates.size() == index) {
+            continue;
+        }
+
+        add_near_match(NearMatch(distances[i], index), k, nearest);
+    }
+}
+
+
+/** Add the ordinals of a record to the candidates of lookup_nearest(),
+ * fetching the hash of each new ordinal once.
+ */
+template <class Layout>
+void HmSearchImpl<Layout>::add_near_ordinals(
+    const hash_string& query, const uint8_t* ordinals,
+    size_t length, int max_distance, size_t k,
+    CandidateTable& candidates,
+    std::vector<NearMatch>& nearest,
+    LookupStats* stats)
+{
+    std::vector<uint8_t>& items = lookup_context.items;
+
+    for (size_t n = 0; n + ordinal_bytes <= length; n += ordinal_bytes) {
+        size_t index = candidates.size();
+        candidates.get(ordinals + n);
+        if (candidates.size() == index) {
+            continue;
+        }
+
+        // Keep the items aligned with the candidates, even for
+        // ordinals whose hash has been removed
+        items.resize((index + 1) * item_bytes());
+
+        const uint8_t* item;
+        if (!fetch_item(ordinals + n, &item, stats)) {
+            continue;
+        }
+        memcpy(&items[index * item_bytes()], item, item_bytes());
+
+        int distance = hamming_distance(query.data(), item, _layout.hash_bytes());
+        if (distance <= max_distance) {
+            add_near_match(NearMatch(distance, index), k, nearest);
+        }
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_near_match(const NearMatch& match, size_t k,
+                                          std::vector<NearMatch>& nearest)
+{
+    if (nearest.size() < k) {
+        nearest.push_back(match);
+        std::push_heap(nearest.begin(), nearest.end());
+    }
+    else if (match < nearest.front()) {
+        std::pop_heap(nearest.begin(), nearest.end());
+        nearest.back() = match;
+        std::push_heap(nearest.begin(), nearest.end());
+    }
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::lookup_batch(const std::vector<hash_string>& queries,
+                                std::vector<LookupResultList>& results,
+                                int reduced_error,
+                                std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        if (queries[q].length() != (size_t) _layout.hash_bytes()) {
+            *error_msg = "incorrect hash length";
+            return false;
+        }
+    }
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (results.size() < queries.size()) {
+        results.resize(queries.size());
+    }
+
+    LookupStats local;
+    LookupStats* s = select_stats(NULL, &local);
+
+    for (size_t q = 0; q < queries.size(); q += max_batch_queries) {
+        lookup_batch_part(&queries[q], std::min(max_batch_queries, queries.size() - q),
+                          &results[q], reduced_error, s);
+    }
+
+    if (s) {
+        add_stats(local, NULL);
+    }
+
+    return true;
+}
+
+
+/** Look up a part of a batch, adding the matches of each query to
+ * its result list.
+ */
+template <class Layout>
+void HmSearchImpl<Layout>::lookup_batch_part(const hash_string* queries, size_t count,
+                                             LookupResultList* results, int reduced_error,
+                                             LookupStats* s)
+{
+    uint64_t start = s ? stats_clock() : 0;
+
+    // Collect the exact and 1-variant keys of every query in one
+    // buffer, remembering which query each key was generated for.
+    const size_t key_length = _layout.key_length();
+    const size_t probes_per_query = _layout.partitions() * (_layout.partition_bits() + 1);
+
+    std::vector<uint8_t> keys;
+    std::vector<BatchProbe> probes;
+    keys.reserve(count * probes_per_query * key_length);
+    probes.reserve(count * probes_per_query);
+
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+
+    int max_distance = _max_error;
+    if (reduced_error >= 0 && reduced_error < max_distance) {
+        max_distance = reduced_error;
+    }
+
+    for (size_t q = 0; q < count; q++) {
+        if (_substrings) {
+            size_t first = keys.size();
+            for (int flips = 0; flips <= multi_index_radius(max_distance); flips++) {
+                for (int i = 0; i < _layout.partitions(); i++) {
+                    variant_keys(queries[q], i, flips, keys);
+                }
+            }
+            for (size_t n = first; n < keys.size(); n += key_length) {
+                probes.push_back(BatchProbe(n, q, 0));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < _layout.partitions(); i++) {
+            int bits = _layout.get_partition_key(queries[q].data(), i, key);
+
+            probes.push_back(BatchProbe(keys.size(), q, 0));
+            keys.insert(keys.end(), key, key + key_length);
+
+            int pbyte = (i * _layout.partition_bits()) / 8;
+            for (int pbit = i * _layout.partition_bits(); bits > 0; pbit++, bits--) {
+                uint8_t flip = 1 << (7 - (pbit % 8));
+
+                key[pbit / 8 - pbyte + 2] ^= flip;
+
+                probes.push_back(BatchProbe(keys.size(), q, 1));
+                keys.insert(keys.end(), key, key + key_length);
+
+                key[pbit / 8 - pbyte + 2] ^= flip;
+            }
+        }
+    }
+
+    // Sorting groups identical keys together so they are fetched only
+    // once, and gives an ordered access pattern on the database.
+    std::sort(probes.begin(), probes.end(), BatchProbeLess(keys.data(), key_length));
+
+    if (_prefetch) {
+        // Start reading every distinct record of the batch up front
+        std::vector<uint8_t>& unique = lookup_context.prefetch_keys;
+        unique.clear();
+        for (size_t p = 0; p < probes.size(); p++) {
+            const uint8_t* pkey = keys.data() + probes[p].key;
+            if (unique.empty()
+                || memcmp(&unique[unique.size() - key_length], pkey, key_length) != 0) {
+                unique.insert(unique.end(), pkey, pkey + key_length);
+            }
+        }
+        _store->prefetch(unique.data(), key_length, unique.size() / key_length);
+    }
+
+    std::vector<CandidateTable>& candidates = lookup_context.batch_candidates;
+    if (candidates.size() < count) {
+        candidates.resize(count);
+    }
+    std::vector<std::vector<SortedRun> >& runs = lookup_context.batch_runs;
+    if (runs.size() < count) {
+        runs.resize(count);
+    }
+    for (size_t q = 0; q < count; q++) {
+        candidates[q].clear(posting_bytes());
+        runs[q].clear();
+    }
+
+    std::vector<char>& buffer = lookup_context.buffer;
+    const uint8_t* value;
+    size_t length;
+
+    for (size_t p = 0; p < probes.size(); ) {
+        const uint8_t* pkey = keys.data() + probes[p].key;
+
+        size_t end = p + 1;
+        while (end < probes.size()
+               && memcmp(pkey, keys.data() + probes[end].key, key_length) == 0) {
+            ++end;
+        }
+
+        if (get_record(pkey, buffer, &value, &length, s)) {
+            for (; p < end; p++) {
+                add_record_candidates(candidates[probes[p].query], runs[probes[p].query],
+                                      probes[p].match, value, length);
+            }
+        }
+
+        p = end;
+    }
+
+    for (size_t q = 0; q < count; q++) {
+        if (!runs[q].empty()) {
+            add_sorted_runs(candidates[q], runs[q]);
+        }
+    }
+
+    if (s) {
+        uint64_t now = stats_clock();
+        s->probe_ns += now - start;
+        start = now;
+    }
+
+    for (size_t q = 0; q < count; q++) {
+        ListVisitor visitor(results[q], _layout.hash_bytes(), _payload_bytes);
+        add_results(queries[q], candidates[q], reduced_error, visitor, s);
+    }
+
+    if (s) {
+        s->verify_ns += stats_clock() - start;
+        s->lookups += count;
+    }
+}
+
+
+bool KyotoStore::get(const uint8_t* key, size_t key_length,
+                     std::vector<char>& buffer,
+                     const uint8_t** value, size_t* value_length,
+                     CacheResult* cache_result)
+{
+    // Fetch into the reused buffer, growing it if the record didn't fit
+    for (;;) {
+        int32_t size = _db->get((const char*) key, key_length,
+                                buffer.data(), buffer.size());
+        if (size < 0) {
+            return false;
+        }
+
+        if ((size_t) size <= buffer.size()) {
+            *value = (const uint8_t*) buffer.data();
+            *value_length = size;
+
+            if (padded(key)) {
+                *value_length = padded_length(buffer.data(), size);
+                if (*value_length == size_t(-1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        buffer.resize(size);
+    }
+}
+
+
+/** Appends to a padded record, growing its capacity when it is full.
+ */
+class PaddedAppendVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    PaddedAppendVisitor(const uint8_t* value, size_t value_length, size_t initial_capacity)
+        : _value((const char*) value)
+        , _value_length(value_length)
+        , _initial_capacity(initial_capacity)
+        , _corrupt(false)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        size_t used = padded_length(vbuf, vsiz);
+        if (used == size_t(-1)) {
+            _corrupt = true;
+            return NOP;
+        }
+
+        size_t capacity = vsiz - record_trailer;
+        if (used + _value_length > capacity) {
+            capacity = std::max(capacity + capacity / 2, used + _value_length);
+        }
+
+        _record.assign(vbuf, used);
+        return add(capacity, sp);
+    }
+
+    const char* visit_empty(const char* kbuf, size_t ksiz, size_t* sp) {
+        _record.clear();
+        return add(std::max(_initial_capacity, _value_length), sp);
+    }
+
+    bool corrupt() const { return _corrupt; }
+
+private:
+    const char* add(size_t capacity, size_t* sp) {
+        size_t used = _record.size() + _value_length;
+        _record.append(_value, _value_length);
+        set_padded_length(_record, capacity, used);
+
+        *sp = _record.size();
+        return _record.data();
+    }
+
+    const char* _value;
+    size_t _value_length;
+    size_t _initial_capacity;
+    std::string _record;
+    bool _corrupt;
+};
+
+
+bool KyotoStore::append(const uint8_t* key, size_t key_length,
+                        const uint8_t* value, size_t value_length,
+                        std::string* error_msg)
+{
+    if (padded(key)) {
+        PaddedAppendVisitor visitor(value, value_length, _record_capacity);
+
+        if (!_db->accept((const char*) key, key_length, &visitor, true)) {
+            *error_msg = _db->error().message();
+            return false;
+        }
+
+        if (visitor.corrupt()) {
+            *error_msg = "corrupt padded record";
+            return false;
+        }
+
+        return true;
+    }
+
+    if (!_db->append((const char*) key, key_length, (const char*) value, value_length)) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Cuts all items starting with a value out of a record, in place.
+ * Padded records keep their capacity.
+ */
+class RemoveVisitor : public kyotocabinet::BasicDB::Visitor
+{
+public:
+    RemoveVisitor(const uint8_t* value, size_t value_length, size_t item_length,
+                  bool padded)
+        : _value((const char*) value)
+        , _value_length(value_length)
+        , _item_length(item_length)
+        , _padded(padded)
+        , _removed(0)
+        { }
+
+    const char* visit_full(const char* kbuf, size_t ksiz,
+                           const char* vbuf, size_t vsiz, size_t* sp) {
+        size_t capacity = 0;
+        if (_padded) {
+            capacity = vsiz - record_trailer;
+            vsiz = padded_length(vbuf, vsiz);
+            if (vsiz == size_t(-1)) {
+                return NOP;
+            }
+        }
+
+        _record.clear();
+        size_t i;
+        for (i = 0; i + _item_length <= vsiz; i += _item_length) {
+            if (memcmp(vbuf + i, _value, _value_length) == 0) {
+                _removed++;
+            }
+            else {
+                _record.append(vbuf + i, _item_length);
+            }
+        }
+        // Keep any trailing partial item
+        _record.append(vbuf + i, vsiz - i);
+
+        if (_removed == 0) {
+            return NOP;
+        }
+        if (_record.empty()) {
+            return REMOVE;
+        }
+
+        if (_padded) {
+            set_padded_length(_record, capacity, _record.size());
+        }
+
+        *sp = _record.size();
+        return _record.data();
+    }
+
+    size_t removed() const { return _removed; }
+
+private:
+    const char* _value;
+    size_t _value_length;
+    size_t _item_length;
+    bool _padded;
+    std::string _record;
+    size_t _removed;
+};
+
+
+bool KyotoStore::remove(const uint8_t* key, size_t key_length,
+                        const uint8_t* value, size_t value_length,
+                        size_t item_length, size_t* removed,
+                        std::string* error_msg)
+{
+    RemoveVisitor visitor(value, value_length, item_length, padded(key));
+
+    if (!_db->accept((const char*) key, key_length, &visitor, true)) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    *removed = visitor.removed();
+    return true;
+}
+
+
+bool KyotoStore::iterate(Visitor& visitor, std::string* error_msg)
+{
+    kyotocabinet::BasicDB::Cursor *c = _db->cursor();
+
+    std::string key, value;
+    bool ok = true;
+
+    c->jump();
+    while (c->get(&key, &value, true)) {
+        size_t length = value.length();
+        if (padded((const uint8_t*) key.data())) {
+            length = padded_length(value.data(), value.length());
+            if (length == size_t(-1)) {
+                continue;
+            }
+        }
+
+        if (!visitor.visit((const uint8_t*) key.data(), key.length(),
+                           (const uint8_t*) value.data(), length)) {
+            break;
+        }
+    }
+
+    // The cursor stops with NOREC when reaching the end
+    kyotocabinet::BasicDB::Error::Code code = _db->error().code();
+    if (code != kyotocabinet::BasicDB::Error::SUCCESS
+        && code != kyotocabinet::BasicDB::Error::NOREC) {
+        *error_msg = _db->error().message();
+        ok = false;
+    }
+
+    delete c;
+    return ok;
+}
+
+
+void KyotoStore::advise(Advice advice)
+{
+    // Only read-ahead can be requested without access to the mapping
+    // and file descriptor of Kyoto Cabinet, and in-memory databases
+    // have no file to open
+    if (advice != ADVISE_WILLNEED) {
+        return;
+    }
+
+    std::string path = _db->path();
+    int fd = ::open(path.substr(0, path.find('#')).c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+}
+
+
+bool KyotoStore::close(std::string* error_msg)
+{
+    if (!_db->close()) {
+        *error_msg = _db->error().message();
+        return false;
+    }
+
+    return true;
+}
+
+
+template <class Layout>
+HmSearch::BulkLoader* HmSearchImpl<Layout>::bulk_load(const std::string& tmp_dir,
+                                                      size_t memory_limit,
+                                                      unsigned threads,
+                                                      std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return NULL;
+    }
+
+    std::string dir = tmp_dir;
+    if (dir.empty()) {
+        const char* env = getenv("TMPDIR");
+        dir = env && *env ? env : "/tmp";
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    return new BulkLoaderImpl<Layout>(_store, _layout, _payload_bytes, _ordinals,
+                                      _exact_index, dir,
+                                      memory_limit ? memory_limit : size_t(256) << 20,
+                                      threads, _log);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::close(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        // Already closed
+        return true;
+    }
+
+    if (_log) {
+        if (!flush(error_msg) || !_log->sync(error_msg)) {
+            return false;
+        }
+        delete _log;
+        _log = NULL;
+    }
+
+    if (!_store->close(error_msg)) {
+        return false;
+    }
+
+    delete _store;
+    _store = NULL;
+
+    return true;
+}
+
+
+/** Prints the partition records of a database on stdout.
+ */
+class DumpVisitor : public PartitionStore::Visitor
+{
+public:
+    DumpVisitor(int hash_bytes, int payload_bytes, bool ordinals)
+        : _hash_bytes(hash_bytes), _payload_bytes(payload_bytes), _ordinals(ordinals)
+        {}
+
+    bool visit(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length) {
+        if (key[0] == 'P') {
+            std::cout << "Partition "
+                      << int(key[1])
+                      << HmSearch::format_hexhash(HmSearch::hash_string(key + 2, key_length - 2))
+                      << std::endl;
+            print_postings(value, value_length);
+            std::cout << std::endl;
+        }
+        else if (key[0] == 'H' && key_length == size_t(1 + _hash_bytes)) {
+            std::cout << "Exact "
+                      << HmSearch::format_hexhash(HmSearch::hash_string(key + 1, _hash_bytes))
+                      << std::endl;
+            print_postings(value, value_length);
+            std::cout << std::endl;
+        }
+        else if (key[0] == 'O' && key_length == 1 + ordinal_bytes) {
+            std::cout << "Hash #" << get_ordinal(key + 1) << std::endl;
+            print_items(value, value_length);
+            std::cout << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+    void print_postings(const uint8_t* value, long value_length) {
+        if (_ordinals) {
+            for (long len = value_length; len >= long(ordinal_bytes);
+                 len -= ordinal_bytes, value += ordinal_bytes) {
+                std::cout << "    #" << get_ordinal(value) << std::endl;
+            }
+        }
+        else {
+            print_items(value, value_length);
+        }
+    }
+
+    void print_items(const uint8_t* value, long value_length) {
+        long item_bytes = _hash_bytes + _payload_bytes;
+        for (long len = value_length; len >= item_bytes;
+             len -= item_bytes, value += item_bytes) {
+            std::cout << "    "
+                      << HmSearch::format_hexhash(HmSearch::hash_string(value, _hash_bytes));
+            if (_payload_bytes) {
+                std::cout << " "
+                          << HmSearch::format_hexhash(
+                              HmSearch::hash_string(value + _hash_bytes, _payload_bytes));
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    long _hash_bytes;
+    long _payload_bytes;
+    bool _ordinals;
+};
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::compact(const std::string& path,
+                                   std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return write_mapped_store(*_store, path, _layout.hash_bits(), _max_error,
+                              _payload_bytes, _ordinals, _substrings,
+                              _layout.key_length(), error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::save_snapshot(const std::string& path,
+                                         std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    if (!_store->flush(error_msg)) {
+        return false;
+    }
+
+    std::map<std::string, std::string> settings = settings_records(
+        _layout.hash_bits(), _max_error, _payload_bytes, _ordinals, _substrings,
+        _exact_index);
+
+    // Carry the ordinal counter over, which mapped databases don't
+    // have as a record
+    std::vector<char> buffer;
+    const uint8_t* value;
+    size_t length;
+    if (_ordinals && _store->get(ordinal_counter_key, sizeof(ordinal_counter_key),
+                                 buffer, &value, &length, NULL)) {
+        settings["_on"] = std::string((const char*) value, length);
+    }
+
+    return write_memory_snapshot(*_store, path, settings, error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::apply_log(const std::string& path,
+                                     uint64_t* sequence,
+                                     std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    std::auto_ptr<InsertLogReader> reader(InsertLogReader::open(path, error_msg));
+    if (!reader.get()) {
+        return false;
+    }
+
+    if (reader->hash_bits() != (unsigned) _layout.hash_bits()
+        || reader->payload_bytes() != (unsigned) _payload_bytes) {
+        *error_msg = "insert log has a different hash size or payload";
+        return false;
+    }
+
+    // Only the entries up to the saved sequence number are known to
+    // be in the database.  Any later ones in this database's own log
+    // may not have reached the file before a crash, so they are
+    // applied again, without adding copies the database already has.
+    uint64_t applied = get_counter(_store, sequence_key, sizeof(sequence_key));
+    uint64_t logged = _log ? _log->sequence() : 0;
+    InsertLogReader::Entry entry;
+    bool ok = true;
+
+    while (ok && reader->next(&entry, error_msg)) {
+        if (entry.sequence <= applied) {
+            continue;
+        }
+
+        if (entry.sequence != applied + 1) {
+            *error_msg = ("insert log has no entries between sequence "
+                          + format_number(applied) + " and " + format_number(entry.sequence));
+            ok = false;
+            break;
+        }
+
+        hash_string hash(entry.hash, _layout.hash_bytes());
+        if (entry.op == InsertLog::INSERT) {
+            hash_string payload(entry.payload, _payload_bytes);
+            if (entry.sequence > logged || !contains_item(hash, payload)) {
+                ok = insert_sequenced(hash, payload, entry.sequence, error_msg);
+            }
+        }
+        else {
+            ok = remove_sequenced(hash, NULL, entry.sequence, error_msg);
+        }
+
+        if (ok) {
+            applied = entry.sequence;
+        }
+    }
+
+    // next() sets the message on read errors
+    if (!error_msg->empty()) {
+        ok = false;
+    }
+
+    // Save how far the database got even if an entry failed, so that
+    // applying the log again resumes there
+    std::string save_error;
+    if (!_store->flush(&save_error) || !save_sequence(applied, &save_error)) {
+        if (ok) {
+            *error_msg = save_error;
+        }
+        ok = false;
+    }
+
+    if (sequence) {
+        *sequence = applied;
+    }
+
+    return ok;
+}
+
+
+/** Merges the records of another database with the same layout into
+ * this one.
+ */
+template <class Layout>
+class HmSearchImpl<Layout>::MergeVisitor : public PartitionStore::Visitor
+{
+public:
+    MergeVisitor(HmSearchImpl* base, HmSearchImpl* delta, std::string* error_msg)
+        : held(NULL), _base(base), _delta(delta), _error_msg(error_msg)
+        , _direct(!base->_ordinals && !delta->_ordinals)
+        {}
+
+    bool visit(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length) {
+        // Settings and hash records are the delta's own, and exact
+        // index records are rebuilt from partition 0
+        if (key_length < 2 || key[0] != 'P') {
+            return true;
+        }
+
+        if (_direct) {
+            return append_record(key, key_length, value, value_length);
+        }
+
+        if (key[1] != 0) {
+            return true;
+        }
+
+        // Every copy of every hash is in exactly one record of
+        // partition 0, so inserting those adds the whole delta
+        const size_t hash_bytes = _base->_layout.hash_bytes();
+        const size_t posting_bytes = _delta->posting_bytes();
+
+        for (size_t n = 0; n + posting_bytes <= value_length; n += posting_bytes) {
+            const uint8_t* item = value + n;
+            if (_delta->_ordinals && !_delta->fetch_item(value + n, &item, NULL)) {
+                continue;
+            }
+
+            hash_string hash(item, hash_bytes);
+            hash_string payload(item + hash_bytes, _base->_payload_bytes);
+            if (!_base->insert(hash, payload, _error_msg)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // The hashes to log once all records are merged
+    FILE* held;
+
+private:
+    bool append_record(const uint8_t* key, size_t key_length,
+                       const uint8_t* value, size_t value_length) {
+        if (!_base->_store->append(key, key_length, value, value_length, _error_msg)) {
+            return false;
+        }
+
+        if (key[1] != 0) {
+            return true;
+        }
+
+        const size_t hash_bytes = _base->_layout.hash_bytes();
+        const size_t item_bytes = _base->item_bytes();
+
+        if (_base->_exact_index
+            && !append_exact_records(_base->_store, value, value_length,
+                                     hash_bytes, item_bytes, _error_msg)) {
+            return false;
+        }
+
+        if (_base->_log) {
+            if (!held && !(held = create_temp_file(temp_dir(), 1 << 20, _error_msg))) {
+                return false;
+            }
+            if (value_length > 0 && fwrite(value, value_length, 1, held) != 1) {
+                *_error_msg = std::string("cannot write temporary file: ") + strerror(errno);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static std::string temp_dir() {
+        const char* env = getenv("TMPDIR");
+        return env && *env ? env : "/tmp";
+    }
+
+    HmSearchImpl* _base;
+    HmSearchImpl* _delta;
+    std::string* _error_msg;
+    bool _direct;
+};
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::merge(const std::string& path,
+                                 std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (!_store) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    std::auto_ptr<HmSearch> opened(HmSearch::open(path, READONLY, error_msg));
+    if (!opened.get()) {
+        return false;
+    }
+
+    HmSearchImpl* delta = dynamic_cast<HmSearchImpl*>(opened.get());
+    if (!delta
+        || delta->_layout.hash_bits() != _layout.hash_bits()
+        || delta->_max_error != _max_error
+        || delta->_payload_bytes != _payload_bytes
+        || delta->_substrings != _substrings) {
+        *error_msg = "can only merge a database with the same settings";
+        return false;
+    }
+
+    MergeVisitor visitor(this, delta, error_msg);
+    bool ok = delta->_store->iterate(visitor, error_msg) && error_msg->empty();
+
+    if (visitor.held) {
+        if (ok) {
+            ok = write_held_items(visitor.held, _log, _layout.hash_bytes(), item_bytes(),
+                                  error_msg);
+        }
+        else {
+            fclose(visitor.held);
+        }
+    }
+
+    return ok;
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::dump()
+{
+    std::string error_msg;
+    DumpVisitor visitor(_layout.hash_bytes(), _payload_bytes, _ordinals);
+
+    _store->iterate(visitor, &error_msg);
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::get_record(const uint8_t* key, size_t key_length,
+                                      std::vector<char>& buffer,
+                                      const uint8_t** value, size_t* length,
+                                      LookupStats* stats)
+{
+    PartitionStore::CacheResult cache_result = PartitionStore::UNCACHED;
+    bool found = _store->get(key, key_length, buffer, value, length,
+                             stats ? &cache_result : NULL);
+
+    if (stats) {
+        stats->gets++;
+        if (cache_result == PartitionStore::CACHE_HIT) {
+            stats->cache_hits++;
+        }
+        else if (cache_result == PartitionStore::CACHE_MISS) {
+            stats->cache_misses++;
+        }
+        else if (cache_result == PartitionStore::FILTERED) {
+            stats->filter_skips++;
+        }
+        if (found) {
+            stats->get_hits++;
+            stats->posting_bytes += *length;
+            if (*length > stats->largest_record) {
+                stats->largest_record = *length;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+/** Get a record holding the postings of every copy of a hash: its
+ * exact index record if there is one, and otherwise the exact-match
+ * record of the first partition.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::get_exact_record(const hash_string& hash,
+                                            std::vector<char>& buffer,
+                                            const uint8_t** value, size_t* length,
+                                            LookupStats* stats)
+{
+    if (_exact_index) {
+        hash_string key = exact_key(hash);
+        return get_record(key.data(), key.length(), buffer, value, length, stats);
+    }
+
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    _layout.get_partition_key(hash.data(), 0, key);
+    return get_record(key, buffer, value, length, stats);
+}
+
+
+/** Pass the copies of hash in a record from get_exact_record() to a
+ * visitor, with distance 0.  Sorted records are binary searched for
+ * the first copy.  Like the candidate table of a full lookup, copies
+ * with the same payload are only visited once unless they have
+ * different ordinals.  Returns the number of copies visited.
+ */
+template <class Layout>
+size_t HmSearchImpl<Layout>::visit_exact(const hash_string& hash,
+                                         const uint8_t* value, size_t length,
+                                         ResultVisitor& visitor, LookupStats* stats)
+{
+    const size_t n = posting_bytes();
+    const bool sorted = _sorted && !_ordinals && !_exact_index;
+    size_t low = 0, high = length / n;
+
+    while (sorted && low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (memcmp(value + mid * n, hash.data(), hash.length()) < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    size_t visited = 0;
+    for (size_t i = low; i < length / n; i++) {
+        const uint8_t* item = value + i * n;
+        if (_ordinals && !fetch_item(item, &item, stats)) {
+            continue;
+        }
+
+        if (memcmp(item, hash.data(), hash.length()) == 0) {
+            bool seen = false;
+            for (size_t j = low; !_ordinals && !seen && j < i; j++) {
+                seen = memcmp(value + j * n, item, n) == 0;
+            }
+            if (seen) {
+                continue;
+            }
+
+            visited++;
+            if (!visitor.visit(item, 0)) {
+                break;
+            }
+        }
+        else if (sorted) {
+            break;
+        }
+    }
+
+    return visited;
+}
+
+
+/** Fetch the hash and payload of an ordinal into the hash buffer of
+ * the lookup context.  Returns false if the hash has been removed.
+ */
+template <class Layout>
+bool HmSearchImpl<Layout>::fetch_item(const uint8_t* ordinal, const uint8_t** item,
+                                      LookupStats* stats)
+{
+    uint8_t key[1 + ordinal_bytes];
+    hash_record_key(ordinal, key);
+
+    PartitionStore::CacheResult cache_result = PartitionStore::UNCACHED;
+    size_t length;
+    bool found = _store->get(key, sizeof(key), lookup_context.hash_buffer, item, &length,
+                             stats ? &cache_result : NULL);
+
+    if (stats) {
+        stats->hash_fetches++;
+        if (cache_result == PartitionStore::CACHE_HIT) {
+            stats->cache_hits++;
+        }
+        else if (cache_result == PartitionStore::CACHE_MISS) {
+            stats->cache_misses++;
+        }
+    }
+
+    return found && length == (size_t) item_bytes();
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::prefetch_query(const hash_string& query)
+{
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    const size_t key_length = _layout.key_length();
+
+    std::vector<uint8_t>& keys = lookup_context.prefetch_keys;
+    keys.clear();
+
+    for (int i = 0; i < _layout.partitions(); i++) {
+        int bits = _layout.get_partition_key(query.data(), i, key);
+        keys.insert(keys.end(), key, key + key_length);
+
+        int pbyte = (i * _layout.partition_bits()) / 8;
+        for (int pbit = i * _layout.partition_bits(); bits > 0; pbit++, bits--) {
+            uint8_t flip = 1 << (7 - (pbit % 8));
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+            keys.insert(keys.end(), key, key + key_length);
+            key[pbit / 8 - pbyte + 2] ^= flip;
+        }
+    }
+
+    _store->prefetch(keys.data(), key_length, keys.size() / key_length);
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::prefetch_items(const CandidateTable& candidates)
+{
+    std::vector<uint8_t>& keys = lookup_context.prefetch_keys;
+    keys.clear();
+
+    uint8_t key[1 + ordinal_bytes];
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (valid_candidate(candidates.candidate(i))) {
+            hash_record_key(candidates.key(i), key);
+            keys.insert(keys.end(), key, key + sizeof(key));
+        }
+    }
+
+    _store->prefetch(keys.data(), sizeof(key), keys.size() / sizeof(key));
+}
+
+
+/** Append the keys of partition of query with exactly flips of its
+ * bits flipped, in all combinations.
+ */
+template <class Layout>
+void HmSearchImpl<Layout>::variant_keys(const hash_string& query, int partition, int flips,
+                                        std::vector<uint8_t>& keys)
+{
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    const size_t key_length = _layout.key_length();
+
+    int bits = _layout.get_partition_key(query.data(), partition, key);
+    if (flips > bits) {
+        return;
+    }
+
+    const int first_bit = partition * _layout.partition_bits();
+    const int pbyte = first_bit / 8;
+
+    // The flipped bit positions, stepped through in lexicographic order
+    std::vector<int>& positions = lookup_context.flip_positions;
+    positions.resize(flips);
+    for (int i = 0; i < flips; i++) {
+        positions[i] = i;
+    }
+
+    for (;;) {
+        size_t offset = keys.size();
+        keys.insert(keys.end(), key, key + key_length);
+        for (int i = 0; i < flips; i++) {
+            int pbit = first_bit + positions[i];
+            keys[offset + pbit / 8 - pbyte + 2] ^= 1 << (7 - (pbit % 8));
+        }
+
+        int i = flips - 1;
+        while (i >= 0 && positions[i] == bits - flips + i) {
+            i--;
+        }
+        if (i < 0) {
+            break;
+        }
+
+        positions[i]++;
+        for (int j = i + 1; j < flips; j++) {
+            positions[j] = positions[j - 1] + 1;
+        }
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::get_multi_index_candidates(
+    const hash_string& query,
+    int max_distance,
+    CandidateTable& candidates,
+    std::vector<char>& buffer,
+    LookupStats* stats)
+{
+    const size_t key_length = _layout.key_length();
+    const int radius = multi_index_radius(max_distance);
+
+    std::vector<uint8_t>& keys = lookup_context.probe_keys;
+    keys.clear();
+
+    for (int flips = 0; flips <= radius; flips++) {
+        for (int i = 0; i < _layout.partitions(); i++) {
+            variant_keys(query, i, flips, keys);
+        }
+    }
+
+    if (_prefetch) {
+        _store->prefetch(keys.data(), key_length, keys.size() / key_length);
+    }
+
+    const uint8_t* value;
+    size_t length;
+
+    for (size_t n = 0; n < keys.size(); n += key_length) {
+        if (get_record(&keys[n], buffer, &value, &length, stats)) {
+            add_hash_candidates(candidates, 0, value, length);
+        }
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::get_candidates(
+    const hash_string& query,
+    int max_distance,
+    CandidateTable& candidates,
+    std::vector<char>& buffer,
+    LookupStats* stats)
+{
+    if (_substrings) {
+        get_multi_index_candidates(query, max_distance, candidates, buffer, stats);
+        return;
+    }
+
+    typename Layout::KeyBuffer key_buffer(_layout);
+    uint8_t* key = key_buffer;
+    const uint8_t* value;
+    size_t length;
+
+    if (_prefetch) {
+        prefetch_query(query);
+    }
+
+    std::vector<SortedRun>& runs = lookup_context.runs;
+    runs.clear();
+
+    for (int i = 0; i < _layout.partitions(); i++) {
+        int bits = _layout.get_partition_key(query.data(), i, key);
+
+        // Get exact matches
+        if (get_record(key, buffer, &value, &length, stats)) {
+            add_record_candidates(candidates, runs, 0, value, length);
+        }
+
+        // Get 1-variant matches
+
+        int pbyte = (i * _layout.partition_bits()) / 8;
+        for (int pbit = i * _layout.partition_bits(); bits > 0; pbit++, bits--) {
+            uint8_t flip = 1 << (7 - (pbit % 8));
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+
+            if (get_record(key, buffer, &value, &length, stats)) {
+                add_record_candidates(candidates, runs, 1, value, length);
+            }
+
+            key[pbit / 8 - pbyte + 2] ^= flip;
+        }
+    }
+
+    if (!runs.empty()) {
+        add_sorted_runs(candidates, runs);
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_results(
+    const hash_string& query,
+    const CandidateTable& candidates,
+    int reduced_error,
+    ResultVisitor& visitor,
+    LookupStats* stats)
+{
+    int max_distance = _max_error;
+    if (reduced_error >= 0 && reduced_error < max_distance) {
+        max_distance = reduced_error;
+    }
+
+    std::vector<uint32_t>& matches = lookup_context.matches;
+    std::vector<int>& distances = lookup_context.distances;
+    if (matches.size() < candidates.size()) {
+        matches.resize(candidates.size());
+        distances.resize(candidates.size());
+    }
+
+    if (_ordinals) {
+        // Weed out the invalid candidates on their ordinals, and only
+        // fetch the hashes of the rest for the distance check
+        std::vector<uint8_t>& items = lookup_context.items;
+        items.clear();
+
+        if (_prefetch) {
+            prefetch_items(candidates);
+        }
+
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const uint8_t* item;
+            if (valid_candidate(candidates.candidate(i))
+                && fetch_item(candidates.key(i), &item, stats)) {
+                items.insert(items.end(), item, item + item_bytes());
+            }
+        }
+
+        size_t found = hamming_distance_block(query.data(), items.data(),
+                                              _layout.hash_bytes(), item_bytes(),
+                                              items.size() / item_bytes(), max_distance,
+                                              matches.data(), distances.data());
+
+        bool more = true;
+        for (size_t i = 0; i < found && more; i++) {
+            more = visitor.visit(&items[matches[i] * item_bytes()], distances[i]);
+        }
+
+        if (stats) {
+            stats->candidates += candidates.size();
+            stats->within_distance += found;
+            stats->results += found;
+        }
+        return;
+    }
+
+    // Check the distance of all candidates in one pass over the arena,
+    // and then weed out the ones that aren't valid HmSearch candidates
+    size_t found = hamming_distance_block(query.data(), candidates.keys(),
+                                          _layout.hash_bytes(), candidates.key_length(),
+                                          candidates.size(), max_distance,
+                                          matches.data(), distances.data());
+
+    size_t valid = 0;
+    bool more = true;
+    for (size_t i = 0; i < found && more; i++) {
+        if (valid_candidate(candidates.candidate(matches[i]))) {
+            more = visitor.visit(candidates.key(matches[i]), distances[i]);
+            valid++;
+        }
+    }
+
+    if (stats) {
+        stats->candidates += candidates.size();
+        stats->within_distance += found;
+        stats->results += valid;
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_hash_candidates(
+    CandidateTable& candidates, int match,
+    const uint8_t* hashes, size_t length)
+{
+    for (size_t n = 0; n + posting_bytes() <= length; n += posting_bytes()) {
+        add_match(candidates.get(hashes + n), match);
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_match(Candidate& cand, int match)
+{
+    ++cand.matches;
+    if (cand.matches == 1) {
+        cand.first_match = match;
+    }
+    else if (cand.matches == 2) {
+        cand.second_match = match;
+    }
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_record_candidates(
+    CandidateTable& candidates, std::vector<SortedRun>& runs,
+    int match, const uint8_t* hashes, size_t length)
+{
+    // Multi-index hashing takes every posting as a candidate, so only
+    // HmSearch partitions gain from searching the records
+    size_t count = length / posting_bytes();
+    if (_sorted && !_substrings && count >= sorted_run_postings) {
+        runs.push_back(SortedRun(hashes, count, match));
+    }
+    else {
+        add_hash_candidates(candidates, match, hashes, length);
+    }
+}
+
+
+template <class Layout>
+bool HmSearchImpl<Layout>::run_contains(
+    const SortedRun& run, const uint8_t* posting) const
+{
+    const size_t n = posting_bytes();
+    size_t low = 0, high = run.count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int c = memcmp(run.postings + mid * n, posting, n);
+        if (c == 0) {
+            return true;
+        }
+        if (c < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return false;
+}
+
+
+template <class Layout>
+void HmSearchImpl<Layout>::add_sorted_runs(
+    CandidateTable& candidates, std::vector<SortedRun>& runs)
+{
+    const size_t n = posting_bytes();
+
+    // Only runs much larger than everything else are worth searching
+    // for every candidate, the others are scanned like any smaller
+    // record.  A table insert costs about as much as a few
+    // comparisons, so a run is searched if the candidates from the
+    // smaller records and runs take fewer binary search steps than
+    // four times its length.
+    std::sort(runs.begin(), runs.end(), SortedRunLarger());
+
+    size_t rest = candidates.size();
+    for (size_t r = 0; r < runs.size(); r++) {
+        rest += runs[r].count;
+    }
+
+    size_t kept = 0;
+    for (; kept < runs.size(); kept++) {
+        rest -= runs[kept].count;
+
+        size_t steps = 1;
+        while ((size_t(1) << steps) < runs[kept].count) {
+            steps++;
+        }
+        if (rest * steps > runs[kept].count * 4) {
+            break;
+        }
     }
-    *error_msg = "";
 
-    std::auto_ptr<kyotocabinet::PolyDB> db(new kyotocabinet::PolyDB);
-    if (!db.get()) {
-        return NULL;
+    // A lone exact run of an even max error only saves anything if
+    // there are others to merge it with, as all its hashes are valid
+    if (kept == 1 && !(_max_error & 1) && runs[0].match == 0) {
+        kept = 0;
     }
 
-    // Increase mmap from 64M to 512M
-    //db->tune_map(int64_t(512) << 20);
-
-    if (!db->open(path, (mode == READONLY ?
-                         kyotocabinet::BasicDB::OREADER :
-                         kyotocabinet::BasicDB::OWRITER))) {
-        *error_msg = db->error().message();
-        return NULL;
+    for (size_t r = kept; r < runs.size(); r++) {
+        add_hash_candidates(candidates, runs[r].match, runs[r].postings, runs[r].count * n);
     }
-    
-    std::string v;
-    unsigned long hash_bits, max_error;
-    if (!db->get("_hb", &v) || !(hash_bits = strtoul(v.c_str(), NULL, 10))) {
-        *error_msg = db->error().message();
-        return NULL;
+    runs.erase(runs.begin() + kept, runs.end());
+
+    // Count the hits in the runs of the candidates from the other
+    // records
+    for (size_t i = 0; !runs.empty() && i < candidates.size(); i++) {
+        for (size_t r = 0; r < runs.size(); r++) {
+            if (run_contains(runs[r], candidates.key(i))) {
+                add_match(candidates.candidate(i), runs[r].match);
+            }
+        }
     }
-        
-    if (!db->get("_me", &v) || !(max_error = strtoul(v.c_str(), NULL, 10))) {
-        *error_msg = db->error().message();
-        return NULL;
+
+    // A hash that is only in one record can only be valid as an exact
+    // match for an even max error
+    if (runs.empty() || (runs.size() == 1 && ((_max_error & 1) || runs[0].match))) {
+        return;
     }
 
-    HmSearch* hm = new HmSearchImpl(db.get(), hash_bits, max_error);
-    if (!hm) {
-        *error_msg = "out of memory";
-        return NULL;
+    // Merge the runs to count the remaining hashes, adding only those
+    // that are valid candidates on their hits in the runs
+    std::vector<std::pair<size_t, size_t> >& heap = lookup_context.merge_heap;
+    heap.clear();
+    for (size_t r = 0; r < runs.size(); r++) {
+        heap.push_back(std::make_pair(r, size_t(0)));
     }
 
-    db.release();
-    return hm;
-}
+    SortedRunGreater greater(runs, n);
+    std::make_heap(heap.begin(), heap.end(), greater);
 
+    while (!heap.empty()) {
+        const uint8_t* posting = greater.posting(heap.front());
+        Candidate hits(0);
 
-HmSearch::hash_string HmSearch::parse_hexhash(const std::string& hexhash)
-{
-    int len = hexhash.length() / 2;
-    uint8_t hash[len];
-    
-    for (int i = 0; i < len; i++) {
-        char buf[3];
-        char* err;
-        
-        buf[0] = hexhash[i * 2];
-        buf[1] = hexhash[i * 2 + 1];
-        buf[2] = 0;
+        do {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            std::pair<size_t, size_t>& top = heap.back();
+            add_match(hits, runs[top.first].match);
 
-        hash[i] = strtoul(buf, &err, 16);
-        
-        if (*err != '\0') {
-            return hash_string();
+            if (++top.second < runs[top.first].count) {
+                std::push_heap(heap.begin(), heap.end(), greater);
+            }
+            else {
+                heap.pop_back();
+            }
+        } while (!heap.empty() && memcmp(greater.posting(heap.front()), posting, n) == 0);
+
+        if (valid_candidate(hits) && !candidates.find(posting)) {
+            Candidate& cand = candidates.get(posting);
+            cand.matches = hits.matches;
+            cand.first_match = hits.first_match;
+            cand.second_match = hits.second_match;
         }
     }
-
-    return hash_string(hash, len);
 }
 
-std::string HmSearch::format_hexhash(const HmSearch::hash_string& hash)
+
+template <class Layout>
+bool HmSearchImpl<Layout>::valid_candidate(
+    const Candidate& candidate)
 {
-    char hex[hash.length() * 2 + 1];
+    // Any hash found by multi-index hashing may be within the distance
+    if (_substrings) {
+        return true;
+    }
 
-    for (size_t i = 0; i < hash.length(); i++) {
-        sprintf(hex + 2 * i, "%02x", hash[i]);
+    if (_max_error & 1) {
+        // Odd k
+        if (candidate.matches < 3) {
+            if (candidate.matches == 1 || (candidate.first_match && candidate.second_match)) {
+                return false;
+            }
+        }
+    }
+    else {
+        // Even k
+        if (candidate.matches < 2) {
+            if (candidate.first_match)
+                return false;
+        }
     }
 
-    return hex;
+    return true;
 }
 
 
+template <class Layout>
+BulkLoaderImpl<Layout>::~BulkLoaderImpl()
+{
+    for (size_t i = 0; i < _runs.size(); i++) {
+        fclose(_runs[i].file);
+    }
+
+    if (_logged) {
+        fclose(_logged);
+    }
+}
 
 
-bool HmSearchImpl::insert(const hash_string& hash,
-                          std::string* error_msg)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::add(const HmSearch::hash_string& hash,
+                                 const HmSearch::hash_string& payload,
+                                 std::string* error_msg)
 {
     std::string dummy;
     if (!error_msg) {
@@ -269,36 +4238,72 @@ bool HmSearchImpl::insert(const hash_string& hash,
     }
     *error_msg = "";
 
-    if (hash.length() != (size_t) _hash_bytes) {
+    if (hash.length() != (size_t) _layout.hash_bytes()) {
         *error_msg = "incorrect hash length";
         return false;
     }
 
-    if (!_db) {
-        *error_msg = "database is closed";
+    if (payload.length() != (size_t) _payload_bytes) {
+        *error_msg = "incorrect payload length";
         return false;
     }
 
-    for (int i = 0; i < _partitions; i++) {
-        uint8_t key[_partition_bytes + 2];
+    if (_buffered + _layout.partitions() > _max_records && _buffered > 0) {
+        if (!spill(error_msg)) {
+            return false;
+        }
+    }
 
-        get_partition_key(hash, i, key);
+    if (_log) {
+        if (!_logged && !(_logged = create_temp_file(_tmp_dir, run_buffer_size, error_msg))) {
+            return false;
+        }
 
-        if (!_db->append((const char*) key, _partition_bytes + 2,
-                         (const char*) hash.data(), hash.length())) {
-            *error_msg = _db->error().message();
+        HmSearch::hash_string item = hash + payload;
+        if (fwrite(item.data(), item.length(), 1, _logged) != 1) {
+            *error_msg = std::string("cannot write temporary file: ") + strerror(errno);
+            return false;
+        }
+    }
+
+    // With ordinals the hash record is written right away, and only
+    // the partition records go through the sorted runs
+    uint8_t ordinal[ordinal_bytes];
+    if (_ordinals) {
+        if (!add_hash_record(_store, hash + payload, ordinal, error_msg)) {
+            return false;
+        }
+
+        HmSearch::hash_string key = HmSearch::hash_string(1, 'H') + hash;
+        if (_exact_index
+            && !_store->append(key.data(), key.length(), ordinal, ordinal_bytes, error_msg)) {
             return false;
         }
     }
 
+    for (int i = 0; i < _layout.partitions(); i++) {
+        std::vector<uint8_t>& records = _records[i];
+        size_t offset = records.size();
+        records.resize(offset + _record_length);
+
+        uint8_t* record = &records[offset];
+        _layout.get_partition_key(hash.data(), i, record);
+        if (_ordinals) {
+            memcpy(record + _layout.key_length(), ordinal, ordinal_bytes);
+        }
+        else {
+            memcpy(record + _layout.key_length(), hash.data(), hash.length());
+            memcpy(record + _layout.key_length() + hash.length(), payload.data(), payload.length());
+        }
+    }
+    _buffered += _layout.partitions();
+
     return true;
 }
 
 
-bool HmSearchImpl::lookup(const hash_string& query,
-                          LookupResultList& result,
-                          int reduced_error,
-                          std::string* error_msg)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::commit(std::string* error_msg)
 {
     std::string dummy;
     if (!error_msg) {
@@ -306,181 +4311,308 @@ bool HmSearchImpl::lookup(const hash_string& query,
     }
     *error_msg = "";
 
-    if (query.length() != (size_t) _hash_bytes) {
-        *error_msg = "incorrect hash length";
+    if (_runs.empty()) {
+        // Everything fit in memory, no need to merge
+        if (!for_each_partition(&BulkLoaderImpl::write_buffered_partition, error_msg)) {
+            return false;
+        }
+        _buffered = 0;
+        return write_log(error_msg);
+    }
+
+    if (_buffered > 0 && !spill(error_msg)) {
         return false;
     }
 
-    if (!_db) {
-        *error_msg = "database is closed";
+    if (!for_each_partition(&BulkLoaderImpl::merge_partition, error_msg)) {
         return false;
     }
 
-    CandidateMap candidates;
-    get_candidates(query, candidates);
+    for (size_t i = 0; i < _runs.size(); i++) {
+        fclose(_runs[i].file);
+    }
+    _runs.clear();
+
+    return write_log(error_msg);
+}
 
-    for (CandidateMap::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
-        if (valid_candidate(i->second)) {
-            int distance = hamming_distance(query, i->first);
 
-            if (distance <= _max_error
-                && (reduced_error < 0 || distance <= reduced_error)) {
-                result.push_back(LookupResult(i->first, distance));
-            }
-        }
+/** Append the committed hashes to the insert log, in the order they
+ * were added.
+ */
+template <class Layout>
+bool BulkLoaderImpl<Layout>::write_log(std::string* error_msg)
+{
+    if (!_logged) {
+        return true;
     }
 
-    return true;
+    FILE* file = _logged;
+    _logged = NULL;
+    return write_held_items(file, _log, _layout.hash_bytes(),
+                            _layout.hash_bytes() + _payload_bytes, error_msg);
 }
 
 
-bool HmSearchImpl::close(std::string* error_msg)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::for_each_partition(PartitionTask task, std::string* error_msg)
 {
-    std::string dummy;
-    if (!error_msg) {
-        error_msg = &dummy;
+    _next_partition = 0;
+    _task_failed = false;
+    _task_error.clear();
+
+    // The calling thread takes partitions too
+    unsigned threads = std::min(_threads, unsigned(_layout.partitions()));
+    std::vector<TaskThread*> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.push_back(new TaskThread(this, task));
+        workers.back()->start();
     }
-    *error_msg = "";
 
-    if (!_db) {
-        // Already closed
-        return true;
+    run_tasks(task);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
     }
 
-    if (!_db->close()) {
-        *error_msg = _db->error().message();
+    if (_task_failed) {
+        *error_msg = _task_error;
         return false;
     }
+    return true;
+}
+
+
+template <class Layout>
+void BulkLoaderImpl<Layout>::run_tasks(PartitionTask task)
+{
+    for (;;) {
+        int partition;
+        {
+            kyotocabinet::ScopedMutex lock(&_task_lock);
+            if (_task_failed || _next_partition >= _layout.partitions()) {
+                return;
+            }
+            partition = _next_partition++;
+        }
+
+        std::string error_msg;
+        if (!(this->*task)(partition, &error_msg)) {
+            kyotocabinet::ScopedMutex lock(&_task_lock);
+            if (!_task_failed) {
+                _task_failed = true;
+                _task_error = error_msg;
+            }
+            return;
+        }
+    }
+}
+
+
+template <class Layout>
+bool BulkLoaderImpl<Layout>::sort_partition(int partition, std::string* error_msg)
+{
+    std::vector<size_t>& order = _orders[partition];
+    size_t count = _records[partition].size() / _record_length;
 
-    delete _db;
-    _db = NULL;
+    order.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
 
+    std::sort(order.begin(), order.end(),
+              RecordLess(_records[partition].data(), _record_length));
     return true;
 }
 
 
-void HmSearchImpl::dump()
+template <class Layout>
+bool BulkLoaderImpl<Layout>::write_buffered_partition(int partition, std::string* error_msg)
 {
-    kyotocabinet::BasicDB::Cursor *c = _db->cursor();
+    sort_partition(partition, error_msg);
 
-    std::string key_str, value_str;
+    const size_t key_length = _layout.key_length();
+    const std::vector<uint8_t>& records = _records[partition];
+    const std::vector<size_t>& order = _orders[partition];
+    std::string hashes;
 
-    c->jump();
-    while (c->get(&key_str, &value_str, true)) {
-        uint8_t* key = (uint8_t*) key_str.data();
-        uint8_t* value = (uint8_t*) value_str.data();
-        
-        if (key[0] == 'P') {
-            std::cout << "Partition "
-                      << int(key[1])
-                      << format_hexhash(hash_string(key + 2, key_str.length() - 2))
-                      << std::endl;
+    for (size_t i = 0; i < order.size(); ) {
+        const uint8_t* key = &records[order[i] * _record_length];
 
-            for (long len = value_str.length(); len >= _hash_bytes;
-                 len -= _hash_bytes, value += _hash_bytes) {
-                std::cout << "    "
-                          << format_hexhash(hash_string(value, _hash_bytes))
-                          << std::endl;
+        hashes.clear();
+        for (; i < order.size(); i++) {
+            const uint8_t* record = &records[order[i] * _record_length];
+            if (memcmp(record, key, key_length) != 0) {
+                break;
             }
-            std::cout << std::endl;
+            hashes.append((const char*) record + key_length, _record_length - key_length);
+        }
+
+        if (!write_partition(key, hashes, error_msg)) {
+            return false;
         }
     }
 
-    delete c;
+    std::vector<uint8_t>().swap(_records[partition]);
+    std::vector<size_t>().swap(_orders[partition]);
+    return true;
 }
 
 
-void HmSearchImpl::get_candidates(
-    const HmSearchImpl::hash_string& query,
-    HmSearchImpl::CandidateMap& candidates)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::Run::next()
 {
-    uint8_t key[_partition_bytes + 2];
-    
-    for (int i = 0; i < _partitions; i++) {
-        std::string hashes;
-        
-        int bits = get_partition_key(query, i, key);
-
-        // Get exact matches
-        if (_db->get(std::string((const char*) key, _partition_bytes + 2), &hashes)) {
-            add_hash_candidates(candidates, 0, (const uint8_t*)hashes.data(), hashes.length());
+    if (_offset + _length > _filled) {
+        if (_pos >= _end) {
+            return false;
         }
 
-        // Get 1-variant matches
-
-        int pbyte = (i * _partition_bits) / 8;
-        for (int pbit = i * _partition_bits; bits > 0; pbit++, bits--) {
-            uint8_t flip = 1 << (7 - (pbit % 8));
-
-            key[pbit / 8 - pbyte + 2] ^= flip;
-            
-            if (_db->get(std::string((const char*) key, _partition_bytes + 2), &hashes)) {
-                add_hash_candidates(candidates, 1, (const uint8_t*)hashes.data(), hashes.length());
+        size_t wanted = std::min(uint64_t(_buffer.size()), _end - _pos);
+        _filled = 0;
+        while (_filled < wanted) {
+            ssize_t n = pread(_fd, &_buffer[_filled], wanted - _filled, _pos + _filled);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                error = true;
+                return false;
             }
-            
-            key[pbit / 8 - pbyte + 2] ^= flip;
+            _filled += n;
         }
+
+        _pos += _filled;
+        _offset = 0;
     }
+
+    record = &_buffer[_offset];
+    _offset += _length;
+    return true;
 }
 
 
-void HmSearchImpl::add_hash_candidates(
-    HmSearchImpl::CandidateMap& candidates, int match,
-    const uint8_t* hashes, size_t length)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::merge_partition(int partition, std::string* error_msg)
 {
-    for (size_t n = 0; n < length; n += _hash_bytes) {
-        hash_string hash = hash_string(hashes + n, _hash_bytes);
-        Candidate& cand = candidates[hash];
+    const size_t key_length = _layout.key_length();
+
+    std::vector<Run> runs;
+    runs.reserve(_runs.size());
+
+    std::priority_queue<Run*, std::vector<Run*>, RunGreater> heap((RunGreater(_record_length)));
+
+    for (size_t i = 0; i < _runs.size(); i++) {
+        runs.push_back(Run(fileno(_runs[i].file),
+                           _runs[i].offsets[partition], _runs[i].offsets[partition + 1],
+                           _record_length));
+        if (runs.back().next()) {
+            heap.push(&runs.back());
+        }
+    }
 
-        ++cand.matches;
-        if (cand.matches == 1) {
-            cand.first_match = match;
+    std::vector<uint8_t> key(key_length);
+    std::string hashes;
+
+    while (!heap.empty()) {
+        memcpy(key.data(), heap.top()->record, key_length);
+
+        hashes.clear();
+        while (!heap.empty() && memcmp(heap.top()->record, key.data(), key_length) == 0) {
+            Run* run = heap.top();
+            heap.pop();
+
+            hashes.append((const char*) run->record + key_length,
+                          _record_length - key_length);
+
+            if (run->next()) {
+                heap.push(run);
+            }
+        }
+
+        if (!write_partition(key.data(), hashes, error_msg)) {
+            return false;
         }
-        else if (cand.matches == 2) {
-            cand.second_match = match;
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (runs[i].error) {
+            *error_msg = "error reading temporary file";
+            return false;
         }
     }
+
+    return true;
 }
 
 
-bool HmSearchImpl::valid_candidate(
-    const HmSearchImpl::Candidate& candidate)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::spill(std::string* error_msg)
 {
-    if (_max_error & 1) {
-        // Odd k
-        if (candidate.matches < 3) {
-            if (candidate.matches == 1 || (candidate.first_match && candidate.second_match)) {
+    FILE* f = create_temp_file(_tmp_dir, run_buffer_size, error_msg);
+    if (!f) {
+        return false;
+    }
+    _runs.push_back(SpillFile(f));
+
+    if (!for_each_partition(&BulkLoaderImpl::sort_partition, error_msg)) {
+        return false;
+    }
+
+    std::vector<uint64_t>& offsets = _runs.back().offsets;
+    uint64_t offset = 0;
+
+    for (int p = 0; p < _layout.partitions(); p++) {
+        const std::vector<uint8_t>& records = _records[p];
+        const std::vector<size_t>& order = _orders[p];
+
+        offsets.push_back(offset);
+        for (size_t i = 0; i < order.size(); i++) {
+            if (fwrite(&records[order[i] * _record_length], _record_length, 1, f) != 1) {
+                *error_msg = std::string("cannot write temporary file: ") + strerror(errno);
                 return false;
             }
         }
+        offset += order.size() * _record_length;
+
+        _records[p].clear();
+        _orders[p].clear();
     }
-    else {
-        // Even k
-        if (candidate.matches < 2) {
-            if (candidate.first_match)
-                return false;
-        }
+    offsets.push_back(offset);
+
+    if (fflush(f) != 0) {
+        *error_msg = std::string("cannot write temporary file: ") + strerror(errno);
+        return false;
     }
 
+    _buffered = 0;
     return true;
 }
 
 
-int HmSearchImpl::hamming_distance(
-    const HmSearchImpl::hash_string& query,
-    const HmSearchImpl::hash_string& hash)
+template <class Layout>
+bool BulkLoaderImpl<Layout>::write_partition(const uint8_t* key,
+                                             const std::string& hashes,
+                                             std::string* error_msg)
 {
-    int distance = 0;
+    // Normally a fresh record, but append to any existing hashes
+    if (!_store->append(key, _layout.key_length(),
+                        (const uint8_t*) hashes.data(), hashes.length(),
+                        error_msg)) {
+        return false;
+    }
 
-    for (size_t i = 0; i < query.length(); i++) {
-        distance += one_bits[query[i] ^ hash[i]];
+    if (!_exact_index || _ordinals || key[1] != 0) {
+        return true;
     }
 
-    return distance;
+    return append_exact_records(_store, (const uint8_t*) hashes.data(), hashes.length(),
+                                _layout.hash_bytes(), _layout.hash_bytes() + _payload_bytes,
+                                error_msg);
 }
 
 
-int HmSearchImpl::get_partition_key(const hash_string& hash, int partition, uint8_t *key)
+int GenericLayout::get_partition_key(const uint8_t* hash, int partition, uint8_t* key) const
 {
     int psize, hash_bit, bits_left;
 
@@ -516,24 +4648,147 @@ int HmSearchImpl::get_partition_key(const hash_string& hash, int partition, uint
 }
 
 
-int HmSearchImpl::one_bits[256] = {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
-};
+template <int HashBits>
+FixedLayout<HashBits>::FixedLayout(int hash_bits, int max_error, int substrings)
+    : _partitions(substrings > 0 ? substrings : (max_error + 3) / 2)
+    , _partition_bits(ceil((double)HashBits / _partitions))
+    , _partition_bytes((_partition_bits + 7) / 8 + 1)
+    , _window_words((_partition_bytes + 7) / 8)
+    , _partition_info(_partitions)
+    , _masks(_partitions * _window_words)
+{
+    for (int i = 0; i < _partitions; i++) {
+        int start = i * _partition_bits;
+        int bits = std::max(0, std::min(_partition_bits, HashBits - start));
+
+        _partition_info[i].first_byte = start / 8;
+        _partition_info[i].bits = bits;
+
+        // Set the partition bits in the window starting at first_byte
+        int first_bit = start % 8;
+        for (int w = 0; w < _window_words; w++) {
+            uint64_t mask = 0;
+            for (int bit = 0; bit < 64; bit++) {
+                int window_bit = w * 64 + bit;
+                if (window_bit >= first_bit && window_bit < first_bit + bits) {
+                    mask |= uint64_t(1) << (63 - bit);
+                }
+            }
+            _masks[i * _window_words + w] = mask;
+        }
+    }
+}
+
+
+template <int HashBits>
+int FixedLayout<HashBits>::get_partition_key(const uint8_t* hash, int partition, uint8_t* key) const
+{
+    const Partition& p = _partition_info[partition];
+    const uint64_t* mask = &_masks[partition * _window_words];
+
+    key[0] = 'P';
+    key[1] = partition;
+
+    for (int w = 0; w < _window_words; w++) {
+        // Only the windows of the last partitions run past the end
+        int offset = p.first_byte + w * 8;
+        uint64_t window = (offset + 8 <= HashBits / 8 ?
+                           load_big_endian(hash + offset) :
+                           load_big_endian_tail(hash, offset, HashBits / 8));
+        store_big_endian(key + 2 + w * 8, window & mask[w]);
+    }
+
+    return p.bits;
+}
+
+
+void CandidateTable::clear(size_t key_length)
+{
+    if (_candidates.size() * 8 < _slots.size()) {
+        // Sparse table, only reset the used slots
+        for (size_t i = 0; i < _candidates.size(); i++) {
+            size_t slot = _candidates[i].hash & _mask;
+            while (_slots[slot] != i + 1) {
+                slot = (slot + 1) & _mask;
+            }
+            _slots[slot] = 0;
+        }
+    }
+    else {
+        std::fill(_slots.begin(), _slots.end(), 0);
+    }
+
+    if (_slots.empty()) {
+        _slots.resize(initial_slots);
+        _mask = initial_slots - 1;
+    }
+
+    _key_length = key_length;
+    _keys.clear();
+    _candidates.clear();
+}
+
+
+CandidateTable::Candidate& CandidateTable::get(const uint8_t* key)
+{
+    uint32_t hash = kyotocabinet::hashmurmur(key, _key_length);
+    size_t slot = hash & _mask;
+
+    while (_slots[slot]) {
+        size_t i = _slots[slot] - 1;
+        if (_candidates[i].hash == hash
+            && memcmp(&_keys[i * _key_length], key, _key_length) == 0) {
+            return _candidates[i];
+        }
+        slot = (slot + 1) & _mask;
+    }
+
+    _slots[slot] = _candidates.size() + 1;
+    _keys.insert(_keys.end(), key, key + _key_length);
+    _candidates.push_back(Candidate(hash));
+
+    // Keep the load factor below 1/2
+    if (_candidates.size() * 2 > _slots.size()) {
+        grow();
+    }
+
+    return _candidates.back();
+}
+
+
+CandidateTable::Candidate* CandidateTable::find(const uint8_t* key)
+{
+    uint32_t hash = kyotocabinet::hashmurmur(key, _key_length);
+    size_t slot = hash & _mask;
+
+    while (_slots[slot]) {
+        size_t i = _slots[slot] - 1;
+        if (_candidates[i].hash == hash
+            && memcmp(&_keys[i * _key_length], key, _key_length) == 0) {
+            return &_candidates[i];
+        }
+        slot = (slot + 1) & _mask;
+    }
+
+    return NULL;
+}
+
+
+void CandidateTable::grow()
+{
+    _slots.assign(_slots.size() * 2, 0);
+    _mask = _slots.size() - 1;
+
+    for (size_t i = 0; i < _candidates.size(); i++) {
+        size_t slot = _candidates[i].hash & _mask;
+        while (_slots[slot]) {
+            slot = (slot + 1) & _mask;
+        }
+        _slots[slot] = i + 1;
+    }
+}
+
+
 
 /*
   Local Variables:
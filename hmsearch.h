@@ -9,6 +9,7 @@
 
 #include <string>
 #include <list>
+#include <vector>
 #include <stdint.h>
 
 /** Interface to a HmSearch database.
@@ -39,17 +40,128 @@ public:
      */
     typedef std::basic_string<uint8_t> hash_string;
 
-    /** A record holding a hash found by lookup() and its hamming distance
-     * from the query hash.
+    /** A record holding a hash found by lookup(), its hamming distance
+     * from the query hash and the payload stored with it.
      */
     struct LookupResult {
-        LookupResult(const hash_string& h, int d) : hash(h), distance(d) {}
+        LookupResult(const hash_string& h, int d, const hash_string& p = hash_string())
+            : hash(h), payload(p), distance(d) {}
         hash_string hash;
+        hash_string payload;    // Empty if the database has no payloads
         int distance;
     };
 
     typedef std::list<LookupResult> LookupResultList;
 
+    /** Receives the matches of a lookup() one at a time.
+     */
+    class ResultVisitor
+    {
+    public:
+        /** Called for each match.  hash points to the hash_bits() / 8
+         * bytes of the matching hash in the buffers of the lookup,
+         * followed by the payload_bytes() bytes of its payload, and is
+         * only valid until visit() returns.
+         *
+         * Return false to stop the lookup, skipping any remaining
+         * matches.  The visitor must not start another lookup on the
+         * same thread, since that reuses the buffers.
+         */
+        virtual bool visit(const uint8_t* hash, int distance) = 0;
+
+        virtual ~ResultVisitor() {}
+    };
+
+    /** Lookup matches stored back to back in flat arrays.
+     *
+     * Unlike a LookupResultList this doesn't allocate anything per
+     * match, and clear() keeps the storage for reuse, so a vector
+     * that is cleared and passed to each lookup() in turn stops
+     * allocating once it has grown to fit the largest result.
+     */
+    class LookupResultVector
+    {
+    public:
+        LookupResultVector() : _hash_bytes(0), _payload_bytes(0) {}
+
+        size_t size() const { return _distances.size(); }
+        bool empty() const { return _distances.empty(); }
+
+        /** Return the matching hash i, which is hash_bytes() long.
+         */
+        const uint8_t* hash(size_t i) const {
+            return &_items[i * (_hash_bytes + _payload_bytes)];
+        }
+
+        /** Return the payload of match i, which is payload_bytes() long.
+         */
+        const uint8_t* payload(size_t i) const { return hash(i) + _hash_bytes; }
+
+        int distance(size_t i) const { return _distances[i]; }
+        size_t hash_bytes() const { return _hash_bytes; }
+        size_t payload_bytes() const { return _payload_bytes; }
+
+        void clear() {
+            _items.clear();
+            _distances.clear();
+        }
+
+        /** Add a match, where hash is followed by payload_bytes of
+         * payload.
+         */
+        void add(const uint8_t* hash, size_t hash_bytes, int distance,
+                 size_t payload_bytes = 0) {
+            _hash_bytes = hash_bytes;
+            _payload_bytes = payload_bytes;
+            _items.insert(_items.end(), hash, hash + hash_bytes + payload_bytes);
+            _distances.push_back(distance);
+        }
+
+    private:
+        std::vector<uint8_t> _items;
+        std::vector<int> _distances;
+        size_t _hash_bytes;
+        size_t _payload_bytes;
+    };
+
+    /** Counters describing the work done by lookups.
+     *
+     * The counters are added to, so the same object can be used to
+     * sum up several lookups.  Each lookup fetches partition records
+     * for the exact and 1-variant keys of each partition, collects
+     * the distinct hashes in them as candidates, checks the distance
+     * of the candidates to the query and finally filters out the ones
+     * that don't have enough partition matches to be valid HmSearch
+     * results.
+     *
+     * Statistics are not collected at all if the library is compiled
+     * with HMSEARCH_NO_STATS defined.
+     */
+    struct LookupStats {
+        LookupStats() { clear(); }
+
+        void clear();
+
+        /** Add the counters of other to this object.
+         */
+        void add(const LookupStats& other);
+
+        uint64_t lookups;           // Number of queries looked up
+        uint64_t gets;              // Partition record fetches
+        uint64_t get_hits;          // Fetches that found a record
+        uint64_t posting_bytes;     // Bytes of hashes in the found records
+        uint64_t largest_record;    // Largest record found, in bytes
+        uint64_t candidates;        // Distinct candidate hashes
+        uint64_t within_distance;   // Candidates within the max error
+        uint64_t results;           // Valid candidates returned as results
+        uint64_t cache_hits;        // Fetches served by the record cache
+        uint64_t cache_misses;      // Fetches that went past the cache
+        uint64_t filter_skips;      // Fetches answered by the key filter
+        uint64_t hash_fetches;      // Hash records fetched for ordinal postings
+        uint64_t probe_ns;          // Time spent fetching records
+        uint64_t verify_ns;         // Time spent checking candidates
+    };
+
     /** Database open modes.
      */
     enum OpenMode {
@@ -57,6 +169,238 @@ public:
         READWRITE
     };
 
+    /** Backends for the records of an opened database.
+     */
+    enum Backend {
+        FILE_BACKEND,       // Read the Kyoto Cabinet file in place
+        CACHE_BACKEND,      // Copy all records into a Kyoto CacheDB
+        STASH_BACKEND       // Copy all records into a Kyoto StashDB
+    };
+
+    /** Hints on how the database file will be accessed.
+     */
+    enum AccessAdvice {
+        ADVISE_NORMAL,
+        ADVISE_RANDOM,      // Don't read ahead of each probe
+        ADVISE_WILLNEED     // Start reading the whole file into memory
+    };
+
+    /** Options for init() and init_sharded().
+     */
+    struct InitOptions {
+        InitOptions()
+            : payload_bytes(0)
+            , ordinal_postings(false)
+            , buckets(0)
+            , snapshot(false)
+            , multi_index(false)
+            , substrings(0)
+            , exact_index(false)
+            , preallocate(false)
+            , insert_log(false)
+            {}
+
+        /** If > 0, store a payload of this many bytes with each hash,
+         * e.g. 8 for a 64-bit document ID.  The payload is given to
+         * insert() and returned with each match by lookup(), so that
+         * finding what a match refers to doesn't take another round
+         * trip to some other database.  At most 255.
+         *
+         * The same hash can be inserted with several payloads, and
+         * each is returned as a separate match.
+         */
+        unsigned payload_bytes;
+
+        /** If true, store each hash and its payload once in a hash
+         * record under a dense 40-bit ordinal, and only the 5-byte
+         * ordinals in the partition records.  This shrinks the
+         * partition records of wide hashes or large payloads, and
+         * the candidates are counted on the ordinals.  Only the hashes
+         * of the candidates that can match are then fetched, one hash
+         * record per candidate, to check their distance.
+         *
+         * This pays off when the hashes and payloads are much larger
+         * than the ordinals, or when the partition records are large
+         * and most candidates are weeded out before the distance
+         * check.  compact() renumbers the ordinals densely.
+         */
+        bool ordinal_postings;
+
+        /** If > 0, the number of hash buckets of the database file.
+         * Otherwise it is twice the expected number of records,
+         * limited so that the bucket array takes at most a quarter
+         * of the physical memory.
+         */
+        int64_t buckets;
+
+        /** If true, create an empty snapshot of an in-memory database
+         * instead of a Kyoto Cabinet file.  See save_snapshot().
+         * buckets is ignored.
+         */
+        bool snapshot;
+
+        /** If true, use multi-index hashing instead of the HmSearch
+         * partitions.  The hashes are split into substrings, and
+         * lookups probe every variant of each query substring with up
+         * to max_error / substrings bits flipped.
+         *
+         * HmSearch splits the hashes into (max_error + 3) / 2
+         * partitions, which at large max errors are so narrow that
+         * each partition value is shared by a large part of the
+         * database, and every lookup ends up scanning most of it.
+         * Wider substrings keep the records selective, at the cost
+         * of probing more keys per lookup.
+         */
+        bool multi_index;
+
+        /** The number of multi-index substrings, at most 255 and at
+         * most hash_bits.  If 0, it is chosen from the expected number
+         * of hashes so that each substring value is shared by about
+         * one hash, i.e. hash_bits / log2(num_hashes).
+         */
+        unsigned substrings;
+
+        /** If true, also keep a record of the copies of each hash
+         * under the full hash, so that contains(), lookup_exact() and
+         * insert_unique() take a single small record fetch instead of
+         * scanning a partition record.  This pays off when many
+         * queries are exact copies of hashes in the database, at the
+         * cost of one more record and append per hash.
+         *
+         * The index is not kept by compact().  Mapped databases have
+         * their partition records sorted instead, and search the
+         * exact-match record of the first partition for the hash.
+         */
+        bool exact_index;
+
+        /** If true, reserve disk space for the data size expected
+         * from num_hashes with fallocate(), without changing the size
+         * of the file.  The records written by a large load then land
+         * in a few long extents instead of fragmenting the file as it
+         * grows.  Kyoto Cabinet gives back the space beyond its data
+         * when the database is closed, so it is reserved again each
+         * time the database is opened for writing.
+         *
+         * Ignored for snapshots, and on file systems without
+         * fallocate().
+         */
+        bool preallocate;
+
+        /** If true, also append every insert and removal, including
+         * the hashes added by bulk loads, with a sequence number to
+         * an insert log at <path>.log.  A replica copied from the
+         * database catches up by replaying the entries it hasn't
+         * seen with apply_log().
+         *
+         * The sequence number of the last entry reflected in the
+         * database is saved in it by flush() and close(), so a copy
+         * of a closed database knows where to start.  The log can be
+         * removed once all replicas have caught up, and is then
+         * restarted at the next sequence number.
+         *
+         * Entries are written when their hashes have been written to
+         * the database file, so a database with an insert log can't
+         * be opened with OpenOptions.insert_buffer.
+         */
+        bool insert_log;
+    };
+
+    /** Options for open().
+     */
+    struct OpenOptions {
+        OpenOptions()
+            : insert_buffer(0)
+            , flush_interval(0)
+            , cache_size(0)
+            , key_filter(false)
+            , map_size(0)
+            , backend(FILE_BACKEND)
+            , advice(ADVISE_NORMAL)
+            , prefetch(false)
+            {}
+
+        /** If > 0, buffer inserted hashes in memory and write them
+         * in group commits when this many bytes have been collected.
+         * All hashes buffered for the same partition key are written
+         * with a single append, and threads inserting into different
+         * buffer shards don't contend for any locks.
+         *
+         * Buffered hashes are not visible to lookups until they have
+         * been written, see flush().
+         */
+        size_t insert_buffer;
+
+        /** If > 0, also write buffered hashes when they have been in
+         * the buffer for this many seconds.
+         */
+        double flush_interval;
+
+        /** If > 0, cache partition records and missing partition keys
+         * in up to this many bytes of memory.  This helps lookups
+         * that keep probing the same keys, e.g. when the same or
+         * similar hashes are queried again and again.  Inserts
+         * invalidate the cached records they change.
+         *
+         * Memory-mapped databases are never cached, since lookups
+         * already read them without copying.
+         */
+        size_t cache_size;
+
+        /** If true, keep a Bloom filter of all partition keys in
+         * memory and check it before fetching a record.  Most of the
+         * 1-variant keys probed by a lookup have no record, and the
+         * filter rules out all but a percent or two of them without
+         * reaching the database, at a cost of about 10 bits per key.
+         *
+         * The filter is saved to the file <path>.filter when the
+         * database is closed, and loaded from there on the next open
+         * if the database hasn't changed since.  Otherwise it is
+         * rebuilt by reading all records.  Opening the database for
+         * writing without the filter removes the file.
+         *
+         * Memory-mapped databases are never filtered.
+         */
+        bool key_filter;
+
+        /** If > 0, memory map this many bytes of the database file.
+         * Otherwise the size of the file, or for writers the larger
+         * of that and the data size expected when the database was
+         * initialised, with a quarter extra room for writers.  It is
+         * limited to three quarters of the physical memory, and is at
+         * least the Kyoto Cabinet default of 64 MB.  Probes beyond
+         * the mapping need a read system call each.
+         */
+        int64_t map_size;
+
+        /** Where the records are read from.  CACHE_BACKEND and
+         * STASH_BACKEND copy all records into memory on open, which
+         * takes a while and as much memory as the data, but avoid
+         * all page faults and system calls on lookups.  They can only
+         * be used with READONLY.
+         */
+        Backend backend;
+
+        /** How the database file will be accessed.  ADVISE_RANDOM
+         * only applies to memory-mapped databases written by
+         * compact(), since Kyoto Cabinet doesn't expose its mapping.
+         */
+        AccessAdvice advice;
+
+        /** If true, lookups first tell the operating system about
+         * every partition record they are going to probe, and then
+         * fetch them.  On a cold page cache the reads then overlap
+         * instead of waiting for the device one after another.
+         * lookup_batch() does this once for the distinct records of
+         * the whole batch.  With ordinal postings, the hash records
+         * of the candidates are prefetched the same way.
+         *
+         * This only applies to memory-mapped databases written by
+         * compact().  It costs an extra directory search per probe,
+         * so it doesn't pay off when the file is already cached.
+         */
+        bool prefetch;
+    };
+
     /** Initialise a new hash database file.
      *
      * The database file should not exist, or if it does it must not
@@ -82,10 +426,70 @@ public:
                      uint64_t num_hashes,
                      std::string* error_msg = NULL);
 
+    /** Initialise a new hash database file with additional options.
+     *
+     * This is the same as the init() above, but takes an InitOptions
+     * structure to control payloads etc.
+     */
+    static bool init(const std::string& path,
+                     unsigned hash_bits, unsigned max_error,
+                     uint64_t num_hashes,
+                     const InitOptions& options,
+                     std::string* error_msg = NULL);
+
+    /** Initialise a set of database files sharing one logical index.
+     *
+     * The hashes are routed to the shards on their leading bits, so
+     * each shard is an ordinary database holding a range of the hash
+     * space.  The shards are listed in a manifest file at path, which
+     * open() accepts just like a database file.  Lookups are performed
+     * on all shards and the results merged.
+     *
+     * The shards are created next to the manifest, named after it
+     * without any extension: "hashes.hms" gets the shards
+     * "hashes-0.kch", "hashes-1.kch" etc.
+     *
+     * Parameters:
+     *
+     *  - path:       manifest file path, typically ending in ".hms"
+     *
+     *  - hash_bits:  number of bits in the hash (must be a multiple of 8)
+     *
+     *  - max_error:  maximum hamming distance, must be less than hash_bits
+     *
+     *  - num_hashes: target number of hashes in all shards
+     *
+     *  - shards:     number of shards, 1 to 256
+     *
+     *  - error_msg:  if provided, will be set to an string describing any
+     *                error, or to an empty string if no error occurred.
+     *
+     * Returns true if the shards and manifest could be initialised,
+     * false on errors.
+     */
+    static bool init_sharded(const std::string& path,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned shards,
+                             std::string* error_msg = NULL);
+
+    /** Initialise a sharded database with additional options, which
+     * apply to every shard.
+     */
+    static bool init_sharded(const std::string& path,
+                             unsigned hash_bits, unsigned max_error,
+                             uint64_t num_hashes, unsigned shards,
+                             const InitOptions& options,
+                             std::string* error_msg = NULL);
+
     /** Open a database file.
      *
      * The returned object must be deleted when not used any longer to
      * ensure that the database is synced and closed.
+     *
+     * Kyoto Cabinet databases created by init(), memory-mapped
+     * databases written by compact(), snapshots written by
+     * save_snapshot() and shard manifests created by init_sharded()
+     * can be opened.
      * 
      * Parameters:
      *
@@ -102,32 +506,259 @@ public:
                           OpenMode mode,
                           std::string* error_msg = NULL);
 
+    /** Open a database file with additional options.
+     *
+     * This is the same as the open() above, but takes an OpenOptions
+     * structure to control buffering etc.  Write options are ignored
+     * for READONLY databases.
+     */
+    static HmSearch* open(const std::string& path,
+                          OpenMode mode,
+                          const OpenOptions& options,
+                          std::string* error_msg = NULL);
+
+
+    /** Enable or disable process-wide lookup statistics.
+     *
+     * When enabled, the counters of all lookups and batch lookups in
+     * the process are summed up in a global LookupStats.  This costs
+     * a few clock readings and atomic additions per lookup.
+     *
+     * Setting the environment variable HMSEARCH_STATS enables the
+     * global statistics from the start, and prints them on stderr when
+     * the process exits: as text if it is "1" or "text", as JSON if it
+     * is "json".
+     */
+    static void enable_global_stats(bool enable);
+
+    /** Return the process-wide lookup statistics collected so far.
+     */
+    static LookupStats global_stats();
+
+    /** Clear the process-wide lookup statistics.
+     */
+    static void reset_global_stats();
+
+    /** Format lookup statistics, either as one "name value" pair per
+     * line or as a JSON object.
+     */
+    static std::string format_stats(const LookupStats& stats, bool json = false);
+
 
     /** Parse a hash in hexadecimal format, returning
-     * a string of raw bytes.
+     * a string of raw bytes, or an empty string if hexhash
+     * contains anything but hexadecimal digits.
      */
     static hash_string parse_hexhash(const std::string& hexhash);
 
+    /** Parse length hexadecimal digits at hex into length / 2 raw
+     * bytes at hash, without allocating anything.
+     *
+     * Returns false if length is odd or hex contains anything but
+     * hexadecimal digits, in which case the contents of hash are
+     * undefined.
+     */
+    static bool parse_hexhash(const char* hex, size_t length, uint8_t* hash);
+
     /** Format a hash of raw bytes into a hexadecimal string.
      */
     static std::string format_hexhash(const hash_string& hash);
 
+    /** Format length raw bytes at hash as 2 * length lowercase
+     * hexadecimal digits at hex.  No terminating NUL is written.
+     */
+    static void format_hexhash(const uint8_t* hash, size_t length, char* hex);
+
+
+    /** Loads a large number of hashes into a database.
+     *
+     * The partition records of all added hashes are collected in
+     * memory, spilling sorted runs to temporary files when the memory
+     * limit is reached.  On commit() the runs are merged in key order
+     * and each partition record is written once with all its hashes,
+     * instead of being appended to and rewritten for every hash as
+     * with HmSearch::insert().
+     *
+     * Hashes are not visible to lookups until commit() has completed.
+     * Deleting a loader without committing discards the added hashes.
+     *
+     * A loader must only be used by one thread at a time.
+     */
+    class BulkLoader
+    {
+    public:
+        /** Add a hash and its payload to the load.
+         *
+         * Parameters:
+         *  - hash:      The hash to insert, as raw bytes
+         *  - payload:   The payload of the hash, which must be
+         *               payload_bytes() long
+         *  - error_msg: if provided, will be set to an string describing any
+         *               error, or to an empty string if no error occurred.
+         *
+         * Returns true if the hash was added, false on any error.
+         */
+        virtual bool add(const hash_string& hash,
+                         const hash_string& payload,
+                         std::string* error_msg = NULL) = 0;
+
+        /** Add a hash to the load of a database without payloads.
+         */
+        bool add(const hash_string& hash,
+                 std::string* error_msg = NULL) {
+            return add(hash, hash_string(), error_msg);
+        }
+
+        /** Write all added hashes to the database.
+         *
+         * Parameter:
+         *  - error_msg: if provided, will be set to an string describing any
+         *               error, or to an empty string if no error occurred.
+         *
+         * Returns true if all went well, false on errors.
+         */
+        virtual bool commit(std::string* error_msg = NULL) = 0;
+
+        virtual ~BulkLoader() {}
+
+    protected:
+        BulkLoader() {}
+    };
+
+    /** Start a bulk load into the database.
+     *
+     * The returned object must be deleted when done.
+     *
+     * Parameters:
+     *
+     *  - tmp_dir:      directory for the temporary run files.  If empty,
+     *                  $TMPDIR or /tmp is used.
+     *
+     *  - memory_limit: maximum bytes of partition records to hold in
+     *                  memory before spilling a run, or 0 for the default
+     *                  of 256 MB
+     *
+     *  - threads:      number of threads sorting and writing the
+     *                  partitions, including the calling thread.  The
+     *                  partitions have disjoint keys, so each is
+     *                  sorted, merged and written on its own.  0 means
+     *                  one per CPU.
+     *
+     *  - error_msg:    if provided, will be set to an string describing any
+     *                  error, or to an empty string if no error occurred.
+     *
+     * Returns the loader on success, or NULL on error.
+     */
+    virtual BulkLoader* bulk_load(const std::string& tmp_dir = "",
+                                  size_t memory_limit = 0,
+                                  unsigned threads = 1,
+                                  std::string* error_msg = NULL) = 0;
 
-    /** Insert a hash into the database.
+    /** Insert a hash and its payload into the database.
      *
      * No check is made if the hash already exists in the database,
-     * so this may result in duplicate records.
+     * so this may result in duplicate records.  See insert_unique().
      *
      * Parameters:
      *  - hash:      The hash to insert, as raw bytes
+     *  - payload:   The payload of the hash, which must be
+     *               payload_bytes() long
      *  - error_msg: if provided, will be set to an string describing any
      *               error, or to an empty string if no error occurred.
      *
      * Returns true if the insert succeded, false on any error.
      */
     virtual bool insert(const hash_string& hash,
+                        const hash_string& payload,
                         std::string* error_msg = NULL) = 0;
 
+    /** Insert a hash into a database without payloads.
+     */
+    bool insert(const hash_string& hash,
+                std::string* error_msg = NULL) {
+        return insert(hash, hash_string(), error_msg);
+    }
+
+    /** Insert a hash and its payload into the database unless that
+     * pair is already there.
+     *
+     * This checks the exact-match record of one partition before
+     * inserting, or with InitOptions.exact_index the record of the
+     * hash itself, so it costs one record fetch more than insert().
+     * The check and the insert are not atomic, so two threads
+     * inserting the same hash at the same time may still both add
+     * it.  Buffered inserts that haven't been flushed are not seen
+     * by the check either.
+     *
+     * Parameters:
+     *  - hash:      The hash to insert, as raw bytes
+     *  - payload:   The payload of the hash, which must be
+     *               payload_bytes() long
+     *  - inserted:  if provided, set to true if the hash was added
+     *               and false if it already existed
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the hash is now in the database, false on any
+     * error.
+     */
+    virtual bool insert_unique(const hash_string& hash,
+                               const hash_string& payload,
+                               bool* inserted = NULL,
+                               std::string* error_msg = NULL) = 0;
+
+    /** Insert a hash into a database without payloads unless it is
+     * already there.
+     */
+    bool insert_unique(const hash_string& hash,
+                       bool* inserted = NULL,
+                       std::string* error_msg = NULL) {
+        return insert_unique(hash, hash_string(), inserted, error_msg);
+    }
+
+    /** Remove all copies of a hash from the database, whatever
+     * their payloads.
+     *
+     * The hash is cut out of the partition records in place, and
+     * records left empty are deleted, so removed hashes leave nothing
+     * behind for lookups to scan.  Each record is rewritten
+     * atomically, but a lookup running concurrently may see the hash
+     * in some partitions and not in others.
+     *
+     * Parameters:
+     *  - hash:      The hash to remove, as raw bytes
+     *  - removed:   if provided, set to the number of copies removed
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the hash is no longer in the database (even if
+     * it never was), false on any error.
+     */
+    virtual bool remove(const hash_string& hash,
+                        size_t* removed = NULL,
+                        std::string* error_msg = NULL) = 0;
+
+    /** Write any buffered inserts to the database.
+     *
+     * When the database is opened with OpenOptions.insert_buffer,
+     * this must be called to make sure that all hashes inserted so
+     * far are visible to lookups.  It is also done by close().
+     *
+     * Hashes that could not be written stay buffered, and are
+     * retried by the next flush.  An error from writing a full buffer
+     * shard or from a background flush (see
+     * OpenOptions.flush_interval) doesn't fail the insert that
+     * triggered it, which is still buffered, but is reported by every
+     * later insert() until a call to flush() or close() succeeds.
+     *
+     * Parameter:
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if all buffered hashes were written, false on errors.
+     */
+    virtual bool flush(std::string* error_msg = NULL) = 0;
+
     /** Lookup a hash in the database, returning a list of matches.
      *
      * Parameters:
@@ -142,13 +773,425 @@ public:
      *  - error_msg: if provided, will be set to an string describing any
      *               error, or to an empty string if no error occurred.
      *
+     *  - stats:     if provided, the counters for this lookup are
+     *               added to it
+     *
      * Returns true if the lookup could be performed (even if no
      * hashes were found), false if an error occurred.
      */
     virtual bool lookup(const hash_string& query,
                         LookupResultList& result,
                         int max_error = -1,
-                        std::string* error_msg = NULL) = 0;
+                        std::string* error_msg = NULL,
+                        LookupStats* stats = NULL) = 0;
+
+    /** Lookup a hash in the database, passing each match to a visitor.
+     *
+     * This avoids allocating and copying anything per match: the
+     * visitor gets pointers into the candidate buffers of the lookup.
+     * If the visitor returns false, the remaining matches are
+     * skipped, but the lookup still returns true.
+     *
+     * The parameters are otherwise the same as for the lookup()
+     * above.
+     */
+    virtual bool lookup(const hash_string& query,
+                        ResultVisitor& visitor,
+                        int max_error = -1,
+                        std::string* error_msg = NULL,
+                        LookupStats* stats = NULL) = 0;
+
+    /** Lookup a hash in the database, adding the matches to a
+     * LookupResultVector (which is not emptied).
+     *
+     * The parameters are otherwise the same as for the lookup()
+     * above.
+     */
+    bool lookup(const hash_string& query,
+                LookupResultVector& result,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    /** Lookup the k hashes nearest to the query.
+     *
+     * Unlike lookup(), this stops probing partition records as soon
+     * as no unseen hash can be nearer than the k:th match found so
+     * far.  The exact keys of all partitions are probed before the
+     * 1-variant keys, and a hash that doesn't match any of the n
+     * partitions probed so far differs in at least n bits.  Finding
+     * k exact duplicates therefore takes k partition fetches, instead
+     * of the hundreds of fetches of a full lookup.
+     *
+     * Parameters:
+     *
+     *  - query:     query hash string
+     *
+     *  - k:         maximum number of matches to return
+     *
+     *  - result:    the matches are added to this list (which is not
+     *               emptied) in order of increasing distance.  Of
+     *               equally distant matches, an arbitrary subset
+     *               may be returned.
+     *
+     *  - max_error, error_msg, stats: as for lookup()
+     *
+     * Returns true if the lookup could be performed (even if no
+     * hashes were found), false if an error occurred.
+     */
+    virtual bool lookup_topk(const hash_string& query,
+                             size_t k,
+                             LookupResultList& result,
+                             int max_error = -1,
+                             std::string* error_msg = NULL,
+                             LookupStats* stats = NULL) = 0;
+
+    /** Lookup any hash within max_error of the query.
+     *
+     * This is an existence check: probing stops at the first match
+     * found, which is not necessarily the nearest one.  Exact and
+     * close duplicates are typically found by the first few
+     * partition fetches.
+     *
+     * At most one match is added to result.  The parameters and
+     * return value are otherwise the same as for lookup().
+     */
+    virtual bool lookup_first(const hash_string& query,
+                              LookupResultList& result,
+                              int max_error = -1,
+                              std::string* error_msg = NULL,
+                              LookupStats* stats = NULL) = 0;
+
+    /** Check if a hash is in the database, with any payload.
+     *
+     * Parameters:
+     *  - hash:      The hash to look for, as raw bytes
+     *  - found:     set to true if there is at least one copy of the
+     *               hash, false otherwise
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the check could be performed, false if an error
+     * occurred.
+     */
+    virtual bool contains(const hash_string& hash,
+                          bool* found,
+                          std::string* error_msg = NULL) = 0;
+
+    /** Lookup the exact copies of a hash, adding each of them to
+     * result with distance 0.
+     *
+     * With InitOptions.exact_index this fetches a single record, and
+     * otherwise the exact-match record of one partition.  It is meant
+     * to be tried before lookup() when most queries are expected to
+     * be exact duplicates of hashes in the database, and near matches
+     * of those aren't needed.  lookup_first() and lookup_topk() use
+     * the index on their own, and answer from it alone when it holds
+     * enough copies.
+     *
+     * The parameters and return value are otherwise the same as for
+     * lookup().
+     */
+    virtual bool lookup_exact(const hash_string& query,
+                              LookupResultList& result,
+                              std::string* error_msg = NULL,
+                              LookupStats* stats = NULL) = 0;
+
+    /** Lookup a batch of hashes in the database.
+     *
+     * This gives the same matches as calling lookup() for each query,
+     * but partition records that are probed by several queries in the
+     * batch are only fetched once from the database.  Large batches
+     * are probed a thousand queries at a time, so that the memory
+     * used for the candidates stays bounded.
+     *
+     * Parameters:
+     *
+     *  - queries:   query hash strings
+     *
+     *  - results:   the matches for queries[i] are added to results[i]
+     *               (which are not emptied).  The vector is resized
+     *               if it is shorter than queries.
+     *
+     *  - max_error: if >= 0, reduce the maximum accepted error
+     *               from the database default
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the lookups could be performed, false if an
+     * error occurred, in which case no results are added.
+     */
+    virtual bool lookup_batch(const std::vector<hash_string>& queries,
+                              std::vector<LookupResultList>& results,
+                              int max_error = -1,
+                              std::string* error_msg = NULL) = 0;
+
+    /** Receives the results of parallel_lookup() as they complete.
+     */
+    class LookupSink
+    {
+    public:
+        /** Called with the matches of the queries starting at index
+         * first, i.e. results[i] holds the matches of queries[first + i].
+         * Calls are serialised, so the sink doesn't need any locking.
+         *
+         * Return false to abort the lookup.
+         */
+        virtual bool results(size_t first, std::vector<LookupResultList>& results) = 0;
+
+        virtual ~LookupSink() {}
+    };
+
+    /** Lookup hashes in parallel on a pool of threads.
+     *
+     * The queries are split into chunks that are looked up with
+     * lookup_batch().  Each thread starts with its own share of the
+     * chunks, and when it runs out it steals chunks from the other
+     * threads to balance the load.
+     *
+     * Parameters:
+     *
+     *  - queries:   query hash strings
+     *
+     *  - sink:      receives the results of each chunk
+     *
+     *  - threads:   number of threads to use, including the calling
+     *               thread.  0 means one per CPU.
+     *
+     *  - ordered:   if true, the sink is called in query order.  If
+     *               false, it is called as soon as a chunk is done,
+     *               which avoids holding back finished results.
+     *
+     *  - max_error: if >= 0, reduce the maximum accepted error
+     *               from the database default
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if all lookups could be performed, false if an
+     * error occurred or the sink aborted the lookup.
+     */
+    bool parallel_lookup(const std::vector<hash_string>& queries,
+                         LookupSink& sink,
+                         unsigned threads = 0,
+                         bool ordered = true,
+                         int max_error = -1,
+                         std::string* error_msg = NULL);
+
+    /** Lookup hashes in parallel, collecting all results.
+     *
+     * This is the same as the parallel_lookup() above, but the
+     * matches for queries[i] are added to results[i] like in
+     * lookup_batch().
+     */
+    bool parallel_lookup(const std::vector<hash_string>& queries,
+                         std::vector<LookupResultList>& results,
+                         unsigned threads = 0,
+                         int max_error = -1,
+                         std::string* error_msg = NULL);
+
+    /** Receives the result of a lookup started with
+     * LookupQueue::lookup_async().
+     */
+    class LookupCallback
+    {
+    public:
+        /** Called on one of the lookup threads when the lookup has
+         * completed.  A callback can be shared by several lookups,
+         * but must then handle concurrent calls.
+         *
+         * Parameters:
+         *
+         *  - query:     the query hash
+         *
+         *  - result:    the matches, which the callback may take over
+         *
+         *  - error_msg: empty if the lookup succeeded, otherwise a
+         *               description of the error
+         */
+        virtual void complete(const hash_string& query,
+                              LookupResultList& result,
+                              const std::string& error_msg) = 0;
+
+        virtual ~LookupCallback() {}
+    };
+
+    /** Runs lookups in the background on a pool of threads.
+     *
+     * Lookups queued while the threads are busy are taken in batches
+     * with lookup_batch(), so that their database reads overlap and
+     * records probed by several queries are only fetched once.  Open
+     * the database with OpenOptions::prefetch to also overlap the
+     * reads of each batch on a cold page cache.
+     *
+     * Deleting the queue waits for all queued lookups to complete.
+     * It must be deleted before the database.
+     */
+    class LookupQueue
+    {
+    public:
+        /** Queue a lookup.  callback is called when it completes,
+         * and must stay valid until then.
+         *
+         * Parameters:
+         *
+         *  - query:     query hash string
+         *
+         *  - callback:  receives the matches
+         *
+         *  - max_error: if >= 0, reduce the maximum accepted error
+         *               from the database default
+         *
+         *  - error_msg: if provided, will be set to an string describing any
+         *               error, or to an empty string if no error occurred.
+         *
+         * Returns true if the lookup was queued, false if the query
+         * is invalid, in which case callback is not called.
+         */
+        virtual bool lookup_async(const hash_string& query,
+                                  LookupCallback& callback,
+                                  int max_error = -1,
+                                  std::string* error_msg = NULL) = 0;
+
+        /** Wait until all queued lookups have completed.
+         */
+        virtual void wait() = 0;
+
+        virtual ~LookupQueue() {}
+
+    protected:
+        LookupQueue() {}
+    };
+
+    /** Create a queue for asynchronous lookups.
+     *
+     * Parameters:
+     *
+     *  - threads:    number of lookup threads.  0 means one per CPU.
+     *
+     *  - batch_size: the most queued lookups a thread takes at a time
+     *
+     * Returns the new queue, which must be deleted when not used any
+     * longer.
+     */
+    LookupQueue* lookup_queue(unsigned threads = 0, size_t batch_size = 64);
+
+    /** Write a compacted, read-only copy of the database.
+     *
+     * The copy is written in the memory-mapped format: a sorted table
+     * of the partition keys pointing into contiguous hash postings,
+     * which lookups read directly from the mapping without copying.
+     * open() recognises the format, but the copy can only be opened
+     * in READONLY mode.  Unlike Kyoto Cabinet files, it can be opened
+     * by several processes at once.
+     *
+     * Parameters:
+     *
+     *  - path:      file path of the copy, typically ending in ".hmm".
+     *               It is written to a temporary file which replaces
+     *               any existing file at path when complete.
+     *               For a sharded database this is a manifest
+     *               listing the compacted shards, which are named
+     *               like the shards of init_sharded() but ending in
+     *               ".hmm".
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the copy could be written, false on errors.
+     */
+    virtual bool compact(const std::string& path,
+                         std::string* error_msg = NULL) = 0;
+
+    /** Write a snapshot of the database for the in-memory backend.
+     *
+     * A snapshot is a single file with all records of the database.
+     * open() recognises it and loads it with one sequential read into
+     * hash tables keyed directly on the partition values, bypassing
+     * Kyoto Cabinet entirely.  This takes seconds even for large
+     * databases, instead of replaying all insert() calls.
+     *
+     * A snapshot opened in READONLY mode is served without any
+     * locking.  Opened in READWRITE mode it can be changed, and is
+     * written back to its file on close() if it was.
+     *
+     * Parameters:
+     *
+     *  - path:      file path of the snapshot, typically ending in
+     *               ".hmsnap".  It is written to a temporary file which
+     *               replaces any existing file at path when complete.
+     *               For a sharded database this is a manifest
+     *               listing the shard snapshots, which are named
+     *               like the shards of init_sharded() but ending in
+     *               ".hmsnap".
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the snapshot could be written, false on errors.
+     */
+    virtual bool save_snapshot(const std::string& path,
+                               std::string* error_msg = NULL) = 0;
+
+    /** Replay an insert log written by a database with
+     * InitOptions.insert_log, to bring a copy of that database up to
+     * date.
+     *
+     * The log is read in one sequential pass, skipping the entries
+     * up to the sequence number last saved by flush() or close(), and
+     * the others are inserted or removed in order.  If the database
+     * keeps an insert log itself, the entries are appended to it with
+     * their original sequence numbers, so replicas can be chained.
+     * Entries that are already in that log are applied again, since
+     * they may not have reached the database before a crash, but
+     * without adding the hashes a second time.
+     *
+     * Parameters:
+     *
+     *  - path:      file path of the log
+     *
+     *  - sequence:  if provided, set to the sequence number of the
+     *               last entry reflected in the database afterwards
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the log could be applied, false on errors,
+     * including a log that starts after the next entry the database
+     * needs.
+     */
+    virtual bool apply_log(const std::string& path,
+                           uint64_t* sequence = NULL,
+                           std::string* error_msg = NULL) = 0;
+
+    /** Add all hashes of another database to this one.
+     *
+     * The other database must have the same hash bits, max error,
+     * payload size and partitioning.  Its records are read in one
+     * sequential pass, and unless either database has ordinal
+     * postings, each partition record is appended to the record with
+     * the same key in this database as a whole.  This makes it cheap
+     * to build a small delta index of new hashes separately, e.g. as
+     * a compacted file, and fold it into a large base index.
+     *
+     * The merged hashes are added to this database's insert log, if
+     * it has one.  A sharded database merges a delta with the same
+     * number of shards shard by shard, and insert logs are kept and
+     * applied per shard.
+     *
+     * Parameters:
+     *
+     *  - path:      file path of the database to merge, which is
+     *               opened read-only
+     *
+     *  - error_msg: if provided, will be set to an string describing any
+     *               error, or to an empty string if no error occurred.
+     *
+     * Returns true if the database could be merged, false on errors.
+     */
+    virtual bool merge(const std::string& path,
+                       std::string* error_msg = NULL) = 0;
 
     /** Explicitly sync and close the database file.
      *
@@ -160,6 +1203,19 @@ public:
      */
     virtual bool close(std::string* error_msg = NULL) = 0;
 
+    /** Return the number of bits in the hashes of the database.
+     */
+    virtual unsigned hash_bits() const = 0;
+
+    /** Return the maximum hamming distance of the database.
+     */
+    virtual unsigned max_error() const = 0;
+
+    /** Return the number of payload bytes stored with each hash, or
+     * 0 if the database has no payloads.
+     */
+    virtual unsigned payload_bytes() const = 0;
+
     /** Dump the structure of the database on stdout.
      * This is only useful for debugging the library itself.
      */
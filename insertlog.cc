@@ -0,0 +1,256 @@
+/* HmSearch hash lookup library - insert log
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "insertlog.h"
+
+static const char log_magic[8] = { 'H', 'M', 'S', 'L', 'O', 'G', 0, 1 };
+static const size_t header_size = 16;
+
+static void put_le(uint8_t* p, uint64_t v, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++, v >>= 8) {
+        p[i] = v;
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, size_t bytes)
+{
+    uint64_t v = 0;
+    for (size_t i = bytes; i > 0; i--) {
+        v = (v << 8) | p[i - 1];
+    }
+    return v;
+}
+
+static bool read_fully(int fd, uint8_t* buf, size_t length, off_t offset)
+{
+    while (length > 0) {
+        ssize_t n = pread(fd, buf, length, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const uint8_t* buf, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = write(fd, buf, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        length -= n;
+    }
+    return true;
+}
+
+
+InsertLog* InsertLog::open(const std::string& path,
+                           unsigned hash_bits, unsigned payload_bytes,
+                           uint64_t sequence, std::string* error_msg)
+{
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        *error_msg = std::string("cannot open insert log: ") + strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *error_msg = std::string("cannot open insert log: ") + strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+
+    uint8_t header[header_size];
+    size_t entry_length = 8 + 1 + hash_bits / 8 + payload_bytes;
+
+    if (st.st_size < off_t(header_size)) {
+        // New, or cut short while writing the header
+        memcpy(header, log_magic, sizeof(log_magic));
+        put_le(header + 8, hash_bits, 4);
+        put_le(header + 12, payload_bytes, 4);
+
+        if (ftruncate(fd, 0) < 0 || !write_fully(fd, header, header_size)) {
+            *error_msg = std::string("cannot write insert log: ") + strerror(errno);
+            ::close(fd);
+            return NULL;
+        }
+    }
+    else {
+        if (!read_fully(fd, header, header_size, 0)) {
+            *error_msg = std::string("cannot read insert log: ") + strerror(errno);
+            ::close(fd);
+            return NULL;
+        }
+
+        if (memcmp(header, log_magic, sizeof(log_magic)) != 0) {
+            *error_msg = "not an insert log: " + path;
+            ::close(fd);
+            return NULL;
+        }
+
+        if (get_le(header + 8, 4) != hash_bits || get_le(header + 12, 4) != payload_bytes) {
+            *error_msg = "insert log doesn't match the database: " + path;
+            ::close(fd);
+            return NULL;
+        }
+
+        off_t entries = (st.st_size - header_size) / entry_length;
+        off_t end = header_size + entries * entry_length;
+        if (end != st.st_size && ftruncate(fd, end) < 0) {
+            *error_msg = std::string("cannot truncate insert log: ") + strerror(errno);
+            ::close(fd);
+            return NULL;
+        }
+
+        if (entries > 0) {
+            uint8_t last[8];
+            if (!read_fully(fd, last, sizeof(last), end - entry_length)) {
+                *error_msg = std::string("cannot read insert log: ") + strerror(errno);
+                ::close(fd);
+                return NULL;
+            }
+            sequence = std::max(sequence, get_le(last, 8));
+        }
+    }
+
+    return new InsertLog(fd, hash_bits / 8, payload_bytes, sequence);
+}
+
+
+InsertLog::~InsertLog()
+{
+    ::close(_fd);
+}
+
+
+bool InsertLog::append(Op op, const uint8_t* hash, const uint8_t* payload,
+                       uint64_t sequence, std::string* error_msg)
+{
+    kyotocabinet::ScopedMutex lock(&_lock);
+
+    if (sequence == 0) {
+        sequence = _sequence + 1;
+    }
+    else if (sequence <= _sequence) {
+        *error_msg = "insert log entries out of sequence";
+        return false;
+    }
+
+    put_le(&_entry[0], sequence, 8);
+    _entry[8] = op;
+    memcpy(&_entry[9], hash, _hash_bytes);
+    if (payload) {
+        memcpy(&_entry[9 + _hash_bytes], payload, _payload_bytes);
+    }
+    else {
+        memset(&_entry[9 + _hash_bytes], 0, _payload_bytes);
+    }
+
+    // A single write, so that a crash leaves at most a partial entry
+    // at the end for open() to cut off
+    if (!write_fully(_fd, _entry.data(), _entry.size())) {
+        *error_msg = std::string("cannot write insert log: ") + strerror(errno);
+        return false;
+    }
+
+    _sequence = sequence;
+    return true;
+}
+
+
+uint64_t InsertLog::sequence()
+{
+    kyotocabinet::ScopedMutex lock(&_lock);
+    return _sequence;
+}
+
+
+bool InsertLog::sync(std::string* error_msg)
+{
+    if (fdatasync(_fd) < 0) {
+        *error_msg = std::string("cannot sync insert log: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+
+InsertLogReader* InsertLogReader::open(const std::string& path, std::string* error_msg)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        *error_msg = std::string("cannot open insert log: ") + strerror(errno);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    uint8_t header[header_size];
+    if (fread(header, header_size, 1, f) != 1
+        || memcmp(header, log_magic, sizeof(log_magic)) != 0) {
+        *error_msg = "not an insert log: " + path;
+        fclose(f);
+        return NULL;
+    }
+
+    return new InsertLogReader(f, get_le(header + 8, 4), get_le(header + 12, 4));
+}
+
+
+InsertLogReader::~InsertLogReader()
+{
+    fclose(_file);
+}
+
+
+bool InsertLogReader::next(Entry* entry, std::string* error_msg)
+{
+    if (fread(_entry.data(), _entry.size(), 1, _file) != 1) {
+        if (ferror(_file)) {
+            *error_msg = std::string("cannot read insert log: ") + strerror(errno);
+        }
+        return false;
+    }
+
+    entry->sequence = get_le(&_entry[0], 8);
+    entry->op = InsertLog::Op(_entry[8]);
+    entry->hash = &_entry[9];
+    entry->payload = &_entry[9 + _hash_bits / 8];
+
+    if (entry->op != InsertLog::INSERT && entry->op != InsertLog::REMOVE) {
+        *error_msg = "corrupt insert log entry";
+        return false;
+    }
+    return true;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
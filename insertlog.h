@@ -0,0 +1,143 @@
+/* HmSearch hash lookup library - insert log
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __INSERTLOG_H_INCLUDED__
+#define __INSERTLOG_H_INCLUDED__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kcthread.h>
+
+/* An insert log is an append-only file of the changes made to a
+ * database, which replicas replay to catch up.  It starts with a
+ * 16-byte header:
+ *
+ *  Bytes 0-7:   "HMSLOG\0\1"
+ *  Bytes 8-11:  Little-endian hash bits
+ *  Bytes 12-15: Little-endian payload bytes
+ *
+ * followed by fixed-size entries:
+ *
+ *  Bytes 0-7: Little-endian sequence number
+ *  Byte 8:    'I' for an insert, 'R' for the removal of all copies
+ *  Bytes 9-N: The hash and its payload, which is zero for removals
+ *
+ * The sequence numbers start from 1 and increase by one per entry.
+ */
+
+/** Appends entries to an insert log.  All calls are thread-safe.
+ */
+class InsertLog
+{
+public:
+    enum Op {
+        INSERT = 'I',
+        REMOVE = 'R'
+    };
+
+    /** Open the log at path for appending, creating it if necessary.
+     * A partial entry left at the end by a crash is cut off.  The
+     * entries appended get sequence numbers after the larger of
+     * sequence and the last one in the log, so a log that has been
+     * removed is restarted where it left off.
+     *
+     * Returns the log, or NULL on errors.
+     */
+    static InsertLog* open(const std::string& path,
+                           unsigned hash_bits, unsigned payload_bytes,
+                           uint64_t sequence, std::string* error_msg);
+
+    ~InsertLog();
+
+    /** Append an entry.  payload may be NULL for removals.  If
+     * sequence is 0 the entry is numbered after the last one,
+     * otherwise it must be larger than the last one, which is how
+     * replayed entries keep the numbers of the log they came from.
+     */
+    bool append(Op op, const uint8_t* hash, const uint8_t* payload,
+                uint64_t sequence, std::string* error_msg);
+
+    /** Return the sequence number of the last entry.
+     */
+    uint64_t sequence();
+
+    /** Write the appended entries to disk.
+     */
+    bool sync(std::string* error_msg);
+
+private:
+    InsertLog(int fd, size_t hash_bytes, size_t payload_bytes, uint64_t sequence)
+        : _fd(fd), _hash_bytes(hash_bytes), _payload_bytes(payload_bytes)
+        , _sequence(sequence), _entry(8 + 1 + hash_bytes + payload_bytes)
+        {}
+
+    int _fd;
+    size_t _hash_bytes;
+    size_t _payload_bytes;
+
+    // Protects everything below
+    kyotocabinet::Mutex _lock;
+    uint64_t _sequence;
+    std::vector<uint8_t> _entry;
+};
+
+
+/** Reads the entries of an insert log in order.
+ */
+class InsertLogReader
+{
+public:
+    struct Entry {
+        uint64_t sequence;
+        InsertLog::Op op;
+        const uint8_t* hash;
+        const uint8_t* payload;
+    };
+
+    /** Open the log at path and read its header.
+     *
+     * Returns the reader, or NULL on errors.
+     */
+    static InsertLogReader* open(const std::string& path, std::string* error_msg);
+
+    ~InsertLogReader();
+
+    unsigned hash_bits() const { return _hash_bits; }
+    unsigned payload_bytes() const { return _payload_bytes; }
+
+    /** Read the next entry, which stays valid until the next call.
+     * A partial entry at the end, which the writer may still be
+     * appending, counts as the end of the log.
+     *
+     * Returns false at the end of the log, or on errors after setting
+     * error_msg.
+     */
+    bool next(Entry* entry, std::string* error_msg);
+
+private:
+    InsertLogReader(FILE* file, unsigned hash_bits, unsigned payload_bytes)
+        : _file(file), _hash_bits(hash_bits), _payload_bytes(payload_bytes)
+        , _entry(8 + 1 + hash_bits / 8 + payload_bytes)
+        {}
+
+    FILE* _file;
+    unsigned _hash_bits;
+    unsigned _payload_bytes;
+    std::vector<uint8_t> _entry;
+};
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __INSERTLOG_H_INCLUDED__
@@ -0,0 +1,894 @@
+/* HmSearch hash lookup library - memory-mapped read-only store
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "store.h"
+
+/* The mapped format is an immutable, sorted table of the partition
+ * records, laid out so that postings can be used straight from the
+ * mapping without copying.  All integers are little-endian.
+ *
+ * Header, 64 bytes:
+ *   0  magic "HMSMAP01"
+ *   8  uint32 hash bits
+ *  12  uint32 max error
+ *  16  uint32 number of partitions
+ *  20  uint32 partition key length, including the 'P' and partition bytes
+ *  24  uint64 offset of the partition table
+ *  32  uint64 total number of records
+ *  40  uint32 payload bytes per hash, 0 if there are no payloads
+ *  44  uint32 flags: bit 0 set if the postings are hash ordinals,
+ *      bit 1 set if the partitions are multi-index substrings, bit 2
+ *      set if the postings of each record are sorted and unique
+ *  48  uint64 offset of the hash table, 0 unless ordinals are used
+ *  56  uint64 number of hash table entries
+ *
+ * Hash table, only with ordinals: the hash and payload of each
+ * ordinal, back to back.  The ordinals of the database are renumbered
+ * densely when the file is written, so there are no unused entries.
+ * get() serves them under the hash record keys of the database, 'O'
+ * followed by the ordinal.
+ *
+ * Postings: the value of each record, each starting on an 8-byte
+ * boundary.  The hashes are stored back to back, each followed by
+ * its payload.  With ordinals the postings are instead 40-bit
+ * big-endian ordinals, indexing the hash table.  Files with flag bit
+ * 2 set keep the postings of each record sorted on their bytes
+ * without duplicates, so lookups can search large records instead of
+ * scanning them.  Older files may have unsorted hash postings.
+ *
+ * Partition table: for each partition an uint64 offset and uint64
+ * count of its directory entries.
+ *
+ * Directory: for each partition, its entries sorted on the key bytes
+ * following the partition number.  Each entry holds those key bytes
+ * zero-padded to a multiple of 8, the uint64 offset of the postings
+ * and the uint64 length of the postings in bytes.
+ */
+
+static const char mapped_magic[8] = { 'H', 'M', 'S', 'M', 'A', 'P', '0', '1' };
+static const size_t header_size = 64;
+
+static const uint32_t ordinals_flag = 1;
+static const uint32_t multi_index_flag = 2;
+static const uint32_t sorted_flag = 4;
+
+// Ordinals in postings and hash record keys
+static const size_t ordinal_bytes = 5;
+
+
+static inline uint32_t get_le32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) | (uint32_t(p[1]) << 8)
+            | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24));
+}
+
+static inline uint64_t get_le64(const uint8_t* p)
+{
+    return uint64_t(get_le32(p)) | (uint64_t(get_le32(p + 4)) << 32);
+}
+
+static inline void put_le32(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_le64(uint8_t* p, uint64_t v)
+{
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static inline size_t align8(size_t n)
+{
+    return (n + 7) & ~size_t(7);
+}
+
+static inline uint64_t get_ordinal(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < ordinal_bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline void put_ordinal(uint8_t* p, uint64_t v)
+{
+    for (size_t i = ordinal_bytes; i > 0; i--, v >>= 8) {
+        p[i - 1] = v;
+    }
+}
+
+
+class MappedStore : public PartitionStore
+{
+public:
+    MappedStore(int fd, const uint8_t* map, size_t size)
+        : _fd(fd)
+        , _map(map)
+        , _size(size)
+        , _partitions(get_le32(map + 16))
+        , _key_length(get_le32(map + 20))
+        , _entry_key_length(align8(_key_length - 2))
+        , _entry_length(_entry_key_length + 16)
+        , _table(map + get_le64(map + 24))
+        , _item_bytes(get_le32(map + 8) / 8 + get_le32(map + 40))
+        , _hash_table(map + get_le64(map + 48))
+        , _hash_count(get_le64(map + 56))
+        , _sorted(get_le32(map + 44) & sorted_flag)
+        { }
+
+    ~MappedStore() {
+        close(NULL);
+    }
+
+    bool validate(std::string* error_msg);
+
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result);
+
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg);
+
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg) {
+        *error_msg = "mapped databases are read-only";
+        return false;
+    }
+
+    void advise(Advice advice) {
+        int a = (advice == ADVISE_RANDOM ? MADV_RANDOM :
+                 advice == ADVISE_WILLNEED ? MADV_WILLNEED : MADV_NORMAL);
+        madvise((void*) _map, _size, a);
+    }
+
+    void prefetch(const uint8_t* keys, size_t key_length, size_t count);
+
+    bool sorted_postings() const { return _sorted; }
+
+    bool iterate(Visitor& visitor, std::string* error_msg);
+
+    bool close(std::string* error_msg);
+
+private:
+    const uint8_t* entries(size_t partition) const {
+        return _map + get_le64(_table + partition * 16);
+    }
+
+    size_t entry_count(size_t partition) const {
+        return get_le64(_table + partition * 16 + 8);
+    }
+
+    /** Get the postings of a directory entry, checking that they are
+     * within the file.
+     */
+    bool get_postings(const uint8_t* entry, const uint8_t** value, size_t* value_length) const {
+        uint64_t offset = get_le64(entry + _entry_key_length);
+        uint64_t length = get_le64(entry + _entry_key_length + 8);
+
+        if (offset > _size || length > _size - offset) {
+            return false;
+        }
+
+        *value = _map + offset;
+        *value_length = length;
+        return true;
+    }
+
+    int _fd;
+    const uint8_t* _map;
+    size_t _size;
+    size_t _partitions;
+    size_t _key_length;
+    size_t _entry_key_length;
+    size_t _entry_length;
+    const uint8_t* _table;
+    size_t _item_bytes;
+    const uint8_t* _hash_table;
+    uint64_t _hash_count;
+    bool _sorted;
+};
+
+
+bool MappedStore::validate(std::string* error_msg)
+{
+    uint64_t table_offset = get_le64(_map + 24);
+
+    if (_key_length < 3 || _partitions == 0 || _partitions > 260
+        || table_offset < header_size || table_offset > _size
+        || _size - table_offset < _partitions * 16) {
+        *error_msg = "corrupt mapped database header";
+        return false;
+    }
+
+    for (size_t p = 0; p < _partitions; p++) {
+        uint64_t offset = get_le64(_table + p * 16);
+        uint64_t count = get_le64(_table + p * 16 + 8);
+
+        if (offset > _size || count > (_size - offset) / _entry_length) {
+            *error_msg = "corrupt mapped database directory";
+            return false;
+        }
+    }
+
+    uint64_t hash_offset = get_le64(_map + 48);
+    if (_hash_count && (_item_bytes == 0 || hash_offset > _size
+                        || _hash_count > (_size - hash_offset) / _item_bytes)) {
+        *error_msg = "corrupt mapped database hash table";
+        return false;
+    }
+
+    return true;
+}
+
+
+bool MappedStore::get(const uint8_t* key, size_t key_length,
+                      std::vector<char>& buffer,
+                      const uint8_t** value, size_t* value_length,
+                      CacheResult* cache_result)
+{
+    if (key_length == 1 + ordinal_bytes && key[0] == 'O') {
+        uint64_t ordinal = get_ordinal(key + 1);
+        if (ordinal >= _hash_count) {
+            return false;
+        }
+
+        *value = _hash_table + ordinal * _item_bytes;
+        *value_length = _item_bytes;
+        return true;
+    }
+
+    if (key_length == 3 && memcmp(key, "_on", 3) == 0 && _hash_count) {
+        // The ordinals are dense, so the counter is the hash count,
+        // big-endian like the Kyoto Cabinet counter record
+        buffer.resize(8);
+        uint64_t v = _hash_count;
+        for (int i = 7; i >= 0; i--, v >>= 8) {
+            buffer[i] = v;
+        }
+        *value = (const uint8_t*) buffer.data();
+        *value_length = 8;
+        return true;
+    }
+
+    if (key_length != _key_length || key[0] != 'P' || key[1] >= _partitions) {
+        return false;
+    }
+
+    const uint8_t* base = entries(key[1]);
+    const uint8_t* bits = key + 2;
+    const size_t bits_length = _key_length - 2;
+
+    // Binary search of the sorted directory
+    size_t low = 0;
+    size_t high = entry_count(key[1]);
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const uint8_t* entry = base + mid * _entry_length;
+
+        int cmp = memcmp(entry, bits, bits_length);
+        if (cmp == 0) {
+            return get_postings(entry, value, value_length);
+        }
+
+        if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return false;
+}
+
+
+void MappedStore::prefetch(const uint8_t* keys, size_t key_length, size_t count)
+{
+    static const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+    // Collect the pages of all records, so that each run of adjacent
+    // pages takes a single madvise() call
+    std::vector<std::pair<uintptr_t, uintptr_t> > ranges;
+    std::vector<char> buffer;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* value;
+        size_t value_length;
+
+        if (get(keys + i * key_length, key_length, buffer, &value, &value_length, NULL)
+            && value_length > 0 && value != (const uint8_t*) buffer.data()) {
+            uintptr_t start = uintptr_t(value) & ~page_mask;
+            uintptr_t end = (uintptr_t(value) + value_length + page_mask) & ~page_mask;
+            ranges.push_back(std::make_pair(start, end));
+        }
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+
+    for (size_t i = 0; i < ranges.size(); ) {
+        uintptr_t start = ranges[i].first;
+        uintptr_t end = ranges[i].second;
+        for (i++; i < ranges.size() && ranges[i].first <= end; i++) {
+            end = std::max(end, ranges[i].second);
+        }
+        madvise((void*) start, end - start, MADV_WILLNEED);
+    }
+}
+
+
+bool MappedStore::append(const uint8_t*, size_t,
+                         const uint8_t*, size_t,
+                         std::string* error_msg)
+{
+    *error_msg = "mapped databases are read-only";
+    return false;
+}
+
+
+bool MappedStore::iterate(Visitor& visitor, std::string* error_msg)
+{
+    std::vector<uint8_t> key(_key_length);
+
+    for (size_t p = 0; p < _partitions; p++) {
+        const uint8_t* entry = entries(p);
+        size_t count = entry_count(p);
+
+        key[0] = 'P';
+        key[1] = p;
+
+        for (size_t i = 0; i < count; i++, entry += _entry_length) {
+            const uint8_t* value;
+            size_t value_length;
+
+            if (!get_postings(entry, &value, &value_length)) {
+                *error_msg = "corrupt mapped database directory";
+                return false;
+            }
+
+            memcpy(&key[2], entry, _key_length - 2);
+
+            if (!visitor.visit(key.data(), key.size(), value, value_length)) {
+                return true;
+            }
+        }
+    }
+
+    uint8_t hash_key[1 + ordinal_bytes];
+    hash_key[0] = 'O';
+
+    for (uint64_t i = 0; i < _hash_count; i++) {
+        put_ordinal(hash_key + 1, i);
+        if (!visitor.visit(hash_key, sizeof(hash_key),
+                           _hash_table + i * _item_bytes, _item_bytes)) {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+
+bool MappedStore::close(std::string*)
+{
+    if (_map) {
+        munmap((void*) _map, _size);
+        ::close(_fd);
+        _map = NULL;
+    }
+
+    return true;
+}
+
+
+bool is_mapped_store(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    char magic[sizeof(mapped_magic)];
+    bool mapped = (read(fd, magic, sizeof(magic)) == sizeof(magic)
+                   && memcmp(magic, mapped_magic, sizeof(magic)) == 0);
+
+    ::close(fd);
+    return mapped;
+}
+
+
+PartitionStore* open_mapped_store(const std::string& path,
+                                  unsigned* hash_bits, unsigned* max_error,
+                                  unsigned* payload_bytes, bool* ordinals,
+                                  unsigned* substrings,
+                                  std::string* error_msg)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+
+    if (size_t(st.st_size) < header_size) {
+        *error_msg = "truncated mapped database";
+        ::close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+
+    const uint8_t* header = (const uint8_t*) map;
+    *hash_bits = get_le32(header + 8);
+    *max_error = get_le32(header + 12);
+    *payload_bytes = get_le32(header + 40);
+    *ordinals = get_le32(header + 44) & ordinals_flag;
+    *substrings = (get_le32(header + 44) & multi_index_flag) ? get_le32(header + 16) : 0;
+
+    MappedStore* store = new MappedStore(fd, header, st.st_size);
+    if (!store->validate(error_msg)) {
+        delete store;
+        return NULL;
+    }
+
+    return store;
+}
+
+
+/** Collects the hash records of an ordinal postings database and
+ * renumbers them densely.  Copies of the same hash and payload share
+ * one new ordinal, so the postings can be deduplicated on ordinals.
+ */
+class OrdinalCollector : public PartitionStore::Visitor
+{
+public:
+    OrdinalCollector(size_t item_bytes)
+        : _item_bytes(item_bytes)
+        { }
+
+    bool visit(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length) {
+        if (key_length == 1 + ordinal_bytes && key[0] == 'O'
+            && value_length == _item_bytes) {
+            _old.push_back(get_ordinal(key + 1));
+            _items.insert(_items.end(), value, value + value_length);
+        }
+        return true;
+    }
+
+    /** Assign the new ordinals, building the hash table in new
+     * ordinal order.
+     */
+    void renumber();
+
+    const std::vector<uint8_t>& table() const { return _table; }
+
+    /** Look up the new ordinal of old, returning false if the
+     * database has no hash record for it.
+     */
+    bool renumber(uint64_t old, uint64_t* ordinal) const {
+        std::vector<std::pair<uint64_t, uint64_t> >::const_iterator i =
+            std::lower_bound(_renumbered.begin(), _renumbered.end(),
+                             std::make_pair(old, uint64_t(0)));
+        if (i == _renumbered.end() || i->first != old) {
+            return false;
+        }
+        *ordinal = i->second;
+        return true;
+    }
+
+private:
+    struct ItemLess {
+        ItemLess(const uint8_t* i, size_t l) : items(i), length(l) {}
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(items + a * length, items + b * length, length) < 0;
+        }
+        const uint8_t* items;
+        size_t length;
+    };
+
+    size_t _item_bytes;
+    std::vector<uint64_t> _old;
+    std::vector<uint8_t> _items;
+    std::vector<uint8_t> _table;
+
+    // Pairs of old and new ordinals, sorted on the old ones
+    std::vector<std::pair<uint64_t, uint64_t> > _renumbered;
+};
+
+
+void OrdinalCollector::renumber()
+{
+    std::vector<size_t> order(_old.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), ItemLess(_items.data(), _item_bytes));
+
+    _renumbered.resize(order.size());
+    _table.clear();
+
+    for (size_t i = 0; i < order.size(); i++) {
+        const uint8_t* item = &_items[order[i] * _item_bytes];
+        if (i == 0 || memcmp(item, &_items[order[i - 1] * _item_bytes], _item_bytes) != 0) {
+            _table.insert(_table.end(), item, item + _item_bytes);
+        }
+        _renumbered[i] = std::make_pair(_old[order[i]], _table.size() / _item_bytes - 1);
+    }
+
+    std::sort(_renumbered.begin(), _renumbered.end());
+
+    std::vector<uint64_t>().swap(_old);
+    std::vector<uint8_t>().swap(_items);
+}
+
+
+/** Writes the postings of each visited record to the output file and
+ * collects the directory entries in memory.  Duplicate hashes with
+ * the same payload within a record are dropped, since they don't
+ * change lookup results.
+ *
+ * With an ordinal collector the postings are renumbered, sorted and
+ * deduplicated instead, and ordinals without a hash record dropped.
+ */
+class MappedWriter : public PartitionStore::Visitor
+{
+public:
+    MappedWriter(FILE* file, unsigned hash_bits, unsigned max_error,
+                 unsigned payload_bytes, size_t partitions, bool multi_index,
+                 size_t key_length, const OrdinalCollector* ordinals)
+        : _file(file)
+        , _hash_bits(hash_bits)
+        , _max_error(max_error)
+        , _payload_bytes(payload_bytes)
+        , _multi_index(multi_index)
+        , _offset(header_size)
+        , _records(0)
+        , _key_length(key_length)
+        , _entry_key_length(align8(key_length - 2))
+        , _entry_length(_entry_key_length + 16)
+        , _entries(partitions)
+        , _ordinals(ordinals)
+        , _hash_table(0)
+        , _hash_count(0)
+        , _failed(false)
+        { }
+
+    bool visit(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length);
+
+    bool finish();
+
+    bool failed() const { return _failed; }
+
+    /** Write the hash table of the ordinal collector, before any
+     * postings.
+     */
+    bool write_hash_table();
+
+private:
+    /** Orders directory entries on their key bytes.
+     */
+    struct EntryLess {
+        EntryLess(const uint8_t* e, size_t l, size_t k)
+            : entries(e), entry_length(l), key_length(k) {}
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(entries + a * entry_length, entries + b * entry_length, key_length) < 0;
+        }
+        const uint8_t* entries;
+        size_t entry_length;
+        size_t key_length;
+    };
+
+    /** Orders the hashes and payloads of a record on their bytes.
+     */
+    struct HashLess {
+        HashLess(const uint8_t* h, size_t l) : hashes(h), length(l) {}
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(hashes + a * length, hashes + b * length, length) < 0;
+        }
+        const uint8_t* hashes;
+        size_t length;
+    };
+
+    bool write(const void* data, size_t length);
+    bool write_unique(const uint8_t* hashes, size_t length);
+    bool write_ordinals(const uint8_t* ordinals, size_t length);
+    bool pad();
+
+    FILE* _file;
+    unsigned _hash_bits;
+    unsigned _max_error;
+    unsigned _payload_bytes;
+    bool _multi_index;
+    uint64_t _offset;
+    uint64_t _records;
+    size_t _key_length;
+    size_t _entry_key_length;
+    size_t _entry_length;
+    std::vector<std::vector<uint8_t> > _entries;
+    std::vector<size_t> _order;
+    const OrdinalCollector* _ordinals;
+    std::vector<uint64_t> _renumbered;
+    uint64_t _hash_table;
+    uint64_t _hash_count;
+    bool _failed;
+};
+
+
+bool MappedWriter::visit(const uint8_t* key, size_t key_length,
+                         const uint8_t* value, size_t value_length)
+{
+    // Skip the settings records
+    if (key_length != _key_length || key[0] != 'P' || key[1] >= _entries.size()) {
+        return true;
+    }
+
+    if (!pad()) {
+        return false;
+    }
+
+    std::vector<uint8_t>& entries = _entries[key[1]];
+    size_t pos = entries.size();
+    entries.resize(pos + _entry_length, 0);
+
+    memcpy(&entries[pos], key + 2, key_length - 2);
+    put_le64(&entries[pos + _entry_key_length], _offset);
+
+    uint64_t start = _offset;
+    if (_ordinals ? !write_ordinals(value, value_length) : !write_unique(value, value_length)) {
+        return false;
+    }
+    put_le64(&entries[pos + _entry_key_length + 8], _offset - start);
+
+    ++_records;
+    return true;
+}
+
+
+bool MappedWriter::write_unique(const uint8_t* hashes, size_t length)
+{
+    size_t item_bytes = _hash_bits / 8 + _payload_bytes;
+    size_t count = length / item_bytes;
+
+    _order.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        _order[i] = i;
+    }
+    std::sort(_order.begin(), _order.end(), HashLess(hashes, item_bytes));
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* item = hashes + _order[i] * item_bytes;
+        if (i > 0 && memcmp(item, hashes + _order[i - 1] * item_bytes, item_bytes) == 0) {
+            continue;
+        }
+        if (!write(item, item_bytes)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool MappedWriter::write_ordinals(const uint8_t* ordinals, size_t length)
+{
+    size_t count = length / ordinal_bytes;
+
+    _renumbered.clear();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t ordinal;
+        if (_ordinals->renumber(get_ordinal(ordinals + i * ordinal_bytes), &ordinal)) {
+            _renumbered.push_back(ordinal);
+        }
+    }
+
+    std::sort(_renumbered.begin(), _renumbered.end());
+    _renumbered.erase(std::unique(_renumbered.begin(), _renumbered.end()), _renumbered.end());
+
+    for (size_t i = 0; i < _renumbered.size(); i++) {
+        uint8_t item[ordinal_bytes];
+        put_ordinal(item, _renumbered[i]);
+        if (!write(item, sizeof(item))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool MappedWriter::write_hash_table()
+{
+    const std::vector<uint8_t>& table = _ordinals->table();
+
+    _hash_table = _offset;
+    _hash_count = table.size() / (_hash_bits / 8 + _payload_bytes);
+    return write(table.data(), table.size());
+}
+
+
+bool MappedWriter::finish()
+{
+    size_t partitions = _entries.size();
+    std::vector<uint8_t> table(partitions * 16);
+
+    if (!pad()) {
+        return false;
+    }
+
+    for (size_t p = 0; p < partitions; p++) {
+        const std::vector<uint8_t>& entries = _entries[p];
+        size_t count = entries.size() / _entry_length;
+
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(),
+                  EntryLess(entries.data(), _entry_length, _key_length - 2));
+
+        put_le64(&table[p * 16], _offset);
+        put_le64(&table[p * 16 + 8], count);
+
+        for (size_t i = 0; i < count; i++) {
+            if (!write(&entries[order[i] * _entry_length], _entry_length)) {
+                return false;
+            }
+        }
+    }
+
+    uint8_t header[header_size];
+    memset(header, 0, sizeof(header));
+    memcpy(header, mapped_magic, sizeof(mapped_magic));
+    put_le32(header + 8, _hash_bits);
+    put_le32(header + 12, _max_error);
+    put_le32(header + 16, partitions);
+    put_le32(header + 20, _key_length);
+    put_le64(header + 24, _offset);
+    put_le64(header + 32, _records);
+    put_le32(header + 40, _payload_bytes);
+    put_le32(header + 44, ((_ordinals ? ordinals_flag : 0)
+                           | (_multi_index ? multi_index_flag : 0)
+                           | sorted_flag));
+    put_le64(header + 48, _hash_table);
+    put_le64(header + 56, _hash_count);
+
+    if (!write(table.data(), table.size())) {
+        return false;
+    }
+
+    if (fseek(_file, 0, SEEK_SET) != 0
+        || fwrite(header, sizeof(header), 1, _file) != 1) {
+        _failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool MappedWriter::write(const void* data, size_t length)
+{
+    if (length && fwrite(data, length, 1, _file) != 1) {
+        _failed = true;
+        return false;
+    }
+
+    _offset += length;
+    return true;
+}
+
+
+bool MappedWriter::pad()
+{
+    static const uint8_t zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    return write(zeros, align8(_offset) - _offset);
+}
+
+
+bool write_mapped_store(PartitionStore& source, const std::string& path,
+                        unsigned hash_bits, unsigned max_error,
+                        unsigned payload_bytes, bool ordinals, unsigned substrings,
+                        size_t key_length, std::string* error_msg)
+{
+    size_t partitions = substrings > 0 ? substrings : (max_error + 3) / 2;
+
+    // Write to a temporary file and move it into place when complete
+    std::string tmp_path = path + ".tmp";
+
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        *error_msg = std::string("cannot create ") + tmp_path + ": " + strerror(errno);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    // Reserve space for the header, which is written last
+    uint8_t header[header_size];
+    memset(header, 0, sizeof(header));
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+    // With ordinals, the hash table is written first and the postings
+    // renumbered to match it
+    std::auto_ptr<OrdinalCollector> collector;
+    if (ordinals) {
+        collector.reset(new OrdinalCollector(hash_bits / 8 + payload_bytes));
+    }
+
+    MappedWriter writer(file, hash_bits, max_error, payload_bytes, partitions,
+                        substrings > 0, key_length, collector.get());
+    if (ok && collector.get()) {
+        ok = source.iterate(*collector, error_msg);
+        if (ok) {
+            collector->renumber();
+            ok = writer.write_hash_table();
+        }
+    }
+    if (ok) {
+        ok = source.iterate(writer, error_msg) && !writer.failed() && writer.finish();
+    }
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        if (error_msg->empty()) {
+            *error_msg = std::string("error writing ") + tmp_path + ": " + strerror(errno);
+        }
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        *error_msg = std::string("cannot rename ") + tmp_path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
@@ -0,0 +1,745 @@
+/* HmSearch hash lookup library - in-memory store and snapshots
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <kcthread.h>
+#include <kcutil.h>
+
+#include "store.h"
+
+/* The memory store keeps the partition records in a flat
+ * open-addressing table.  When the partition number and bits of the
+ * keys fit in 64 bits, which they do for all common hash widths, the
+ * table is keyed on them packed into an integer, so a lookup is a
+ * multiplication and usually a single integer compare.  The postings
+ * of each record are kept in a contiguous vector.  Other records,
+ * i.e. the settings and hash records, are kept in an ordinary map.
+ *
+ * A snapshot holds all records of a store in a single file.  All
+ * integers are little-endian.
+ *
+ * Header, 16 bytes:
+ *   0  magic "HMSSNAP1"
+ *   8  uint64 number of records
+ *
+ * Records: for each record an uint32 key length, uint32 value length,
+ * the key and the value.
+ */
+
+static const char snapshot_magic[8] = { 'H', 'M', 'S', 'S', 'N', 'A', 'P', '1' };
+static const size_t snapshot_header_size = 16;
+
+static const size_t initial_slots = 1024;
+
+
+static inline uint32_t get_le32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) | (uint32_t(p[1]) << 8)
+            | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24));
+}
+
+static inline uint64_t get_le64(const uint8_t* p)
+{
+    return uint64_t(get_le32(p)) | (uint64_t(get_le32(p + 4)) << 32);
+}
+
+static inline void put_le32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++, v >>= 8) {
+        p[i] = v;
+    }
+}
+
+static inline void put_le64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8) {
+        p[i] = v;
+    }
+}
+
+
+namespace {
+
+class MemoryStore : public PartitionStore
+{
+public:
+    MemoryStore(const std::string& path, bool writable)
+        : _path(path)
+        , _writable(writable)
+        , _dirty(false)
+        , _key_length(0)
+        , _packed(false)
+        , _mask(initial_slots - 1)
+        , _slots(initial_slots, 0)
+        { }
+
+    /** Load the records of a snapshot.
+     */
+    bool load(const uint8_t* data, size_t size, std::string* error_msg);
+
+    bool get(const uint8_t* key, size_t key_length,
+             std::vector<char>& buffer,
+             const uint8_t** value, size_t* value_length,
+             CacheResult* cache_result);
+
+    bool append(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                std::string* error_msg);
+
+    bool remove(const uint8_t* key, size_t key_length,
+                const uint8_t* value, size_t value_length,
+                size_t item_length, size_t* removed,
+                std::string* error_msg);
+
+    bool increment(const uint8_t* key, size_t key_length,
+                   int64_t num, int64_t* result,
+                   std::string* error_msg);
+
+    bool stamp(uint64_t* records, uint64_t* bytes);
+
+    bool iterate(Visitor& visitor, std::string* error_msg);
+
+    bool close(std::string* error_msg);
+
+private:
+    static const size_t npos = size_t(-1);
+
+    /** Return true if key belongs in the partition record table,
+     * fixing the partition key length on the first one.
+     */
+    bool partition_key(const uint8_t* key, size_t key_length) {
+        if (key_length < 2 || key[0] != 'P') {
+            return false;
+        }
+        if (_key_length == 0) {
+            _key_length = key_length;
+            _packed = key_length - 1 <= 8;
+        }
+        return key_length == _key_length;
+    }
+
+    /** The packed partition number and bits of key, or its hash if
+     * they don't fit.
+     */
+    uint64_t key_hash(const uint8_t* key) const {
+        if (!_packed) {
+            return kyotocabinet::hashmurmur(key, _key_length);
+        }
+
+        uint64_t v = 0;
+        for (size_t i = 1; i < _key_length; i++) {
+            v = (v << 8) | key[i];
+        }
+        return v;
+    }
+
+    size_t slot_for(uint64_t hash) const {
+        return (hash * 0x9e3779b97f4a7c15ULL) >> 32 & _mask;
+    }
+
+    /** Return the index of the record of key, or npos.
+     */
+    size_t find(const uint8_t* key) const;
+
+    /** Return the index of the record of key, adding it if necessary.
+     */
+    size_t find_or_add(const uint8_t* key);
+
+    void grow();
+
+    bool add_other(const uint8_t* key, size_t key_length,
+                   const uint8_t* value, size_t value_length);
+
+    std::string _path;
+    bool _writable;
+    bool _dirty;
+
+    size_t _key_length;
+    bool _packed;
+
+    // Index + 1 into the records, or 0 for an empty slot
+    size_t _mask;
+    std::vector<uint32_t> _slots;
+
+    std::vector<uint64_t> _hashes;
+    std::vector<uint8_t> _keys;
+    std::vector<std::vector<uint8_t> > _postings;
+
+    std::unordered_map<std::string, std::string> _other;
+
+    // Only taken by writable stores, since nothing changes otherwise
+    kyotocabinet::RWLock _lock;
+};
+
+
+size_t MemoryStore::find(const uint8_t* key) const
+{
+    uint64_t hash = key_hash(key);
+
+    for (size_t slot = slot_for(hash); _slots[slot]; slot = (slot + 1) & _mask) {
+        size_t i = _slots[slot] - 1;
+        if (_hashes[i] == hash
+            && (_packed || memcmp(&_keys[i * _key_length], key, _key_length) == 0)) {
+            return i;
+        }
+    }
+
+    return npos;
+}
+
+
+size_t MemoryStore::find_or_add(const uint8_t* key)
+{
+    uint64_t hash = key_hash(key);
+    size_t slot;
+
+    for (slot = slot_for(hash); _slots[slot]; slot = (slot + 1) & _mask) {
+        size_t i = _slots[slot] - 1;
+        if (_hashes[i] == hash
+            && (_packed || memcmp(&_keys[i * _key_length], key, _key_length) == 0)) {
+            return i;
+        }
+    }
+
+    size_t i = _postings.size();
+    _slots[slot] = i + 1;
+    _hashes.push_back(hash);
+    _keys.insert(_keys.end(), key, key + _key_length);
+    _postings.push_back(std::vector<uint8_t>());
+
+    // Keep the load factor below 1/2
+    if (_postings.size() * 2 > _slots.size()) {
+        grow();
+    }
+
+    return i;
+}
+
+
+void MemoryStore::grow()
+{
+    _slots.assign(_slots.size() * 2, 0);
+    _mask = _slots.size() - 1;
+
+    for (size_t i = 0; i < _postings.size(); i++) {
+        size_t slot = slot_for(_hashes[i]);
+        while (_slots[slot]) {
+            slot = (slot + 1) & _mask;
+        }
+        _slots[slot] = i + 1;
+    }
+}
+
+
+bool MemoryStore::add_other(const uint8_t* key, size_t key_length,
+                            const uint8_t* value, size_t value_length)
+{
+    _other[std::string((const char*) key, key_length)].append(
+        (const char*) value, value_length);
+    return true;
+}
+
+
+bool MemoryStore::load(const uint8_t* data, size_t size, std::string* error_msg)
+{
+    if (size < snapshot_header_size || memcmp(data, snapshot_magic, sizeof(snapshot_magic)) != 0) {
+        *error_msg = "not a snapshot";
+        return false;
+    }
+
+    uint64_t count = get_le64(data + 8);
+    size_t pos = snapshot_header_size;
+
+    // Size the table for the records up front instead of growing it
+    if (count < (uint64_t(1) << 31)) {
+        while (_slots.size() < count * 2) {
+            _slots.resize(_slots.size() * 2);
+        }
+        _mask = _slots.size() - 1;
+        _postings.reserve(count);
+        _hashes.reserve(count);
+    }
+
+    for (uint64_t n = 0; n < count; n++) {
+        if (size - pos < 8) {
+            *error_msg = "truncated snapshot";
+            return false;
+        }
+
+        size_t key_length = get_le32(data + pos);
+        size_t value_length = get_le32(data + pos + 4);
+        pos += 8;
+
+        if (key_length == 0 || size - pos < key_length
+            || size - pos - key_length < value_length) {
+            *error_msg = "truncated snapshot";
+            return false;
+        }
+
+        const uint8_t* key = data + pos;
+        const uint8_t* value = key + key_length;
+        pos += key_length + value_length;
+
+        if (partition_key(key, key_length)) {
+            std::vector<uint8_t>& postings = _postings[find_or_add(key)];
+            postings.insert(postings.end(), value, value + value_length);
+        }
+        else {
+            add_other(key, key_length, value, value_length);
+        }
+    }
+
+    return true;
+}
+
+
+bool MemoryStore::get(const uint8_t* key, size_t key_length,
+                      std::vector<char>& buffer,
+                      const uint8_t** value, size_t* value_length,
+                      CacheResult* cache_result)
+{
+    if (!_writable) {
+        // Nothing changes, so the records can be used in place
+        if (key_length == _key_length && key[0] == 'P') {
+            size_t i = find(key);
+            if (i == npos || _postings[i].empty()) {
+                return false;
+            }
+            *value = _postings[i].data();
+            *value_length = _postings[i].size();
+            return true;
+        }
+
+        std::unordered_map<std::string, std::string>::const_iterator i =
+            _other.find(std::string((const char*) key, key_length));
+        if (i == _other.end()) {
+            return false;
+        }
+        *value = (const uint8_t*) i->second.data();
+        *value_length = i->second.size();
+        return true;
+    }
+
+    // Copy the record out, since it may be moved by an append as soon
+    // as the lock is released
+    kyotocabinet::ScopedRWLock lock(&_lock, false);
+    const uint8_t* data;
+    size_t length;
+
+    if (key_length == _key_length && key[0] == 'P') {
+        size_t i = find(key);
+        if (i == npos || _postings[i].empty()) {
+            return false;
+        }
+        data = _postings[i].data();
+        length = _postings[i].size();
+    }
+    else {
+        std::unordered_map<std::string, std::string>::const_iterator i =
+            _other.find(std::string((const char*) key, key_length));
+        if (i == _other.end()) {
+            return false;
+        }
+        data = (const uint8_t*) i->second.data();
+        length = i->second.size();
+    }
+
+    if (buffer.size() < length) {
+        buffer.resize(length);
+    }
+    memcpy(buffer.data(), data, length);
+
+    *value = (const uint8_t*) buffer.data();
+    *value_length = length;
+    return true;
+}
+
+
+bool MemoryStore::append(const uint8_t* key, size_t key_length,
+                         const uint8_t* value, size_t value_length,
+                         std::string* error_msg)
+{
+    if (!_writable) {
+        *error_msg = "database is read-only";
+        return false;
+    }
+
+    kyotocabinet::ScopedRWLock lock(&_lock, true);
+    _dirty = true;
+
+    if (partition_key(key, key_length)) {
+        std::vector<uint8_t>& postings = _postings[find_or_add(key)];
+        postings.insert(postings.end(), value, value + value_length);
+        return true;
+    }
+
+    return add_other(key, key_length, value, value_length);
+}
+
+
+bool MemoryStore::remove(const uint8_t* key, size_t key_length,
+                         const uint8_t* value, size_t value_length,
+                         size_t item_length, size_t* removed,
+                         std::string* error_msg)
+{
+    if (!_writable) {
+        *error_msg = "database is read-only";
+        return false;
+    }
+
+    kyotocabinet::ScopedRWLock lock(&_lock, true);
+    *removed = 0;
+
+    if (key_length == _key_length && key[0] == 'P') {
+        size_t i = find(key);
+        if (i == npos) {
+            return true;
+        }
+
+        // Compact the record in place.  Emptied records keep their
+        // slot, and are treated as missing.
+        std::vector<uint8_t>& postings = _postings[i];
+        size_t kept = 0, n;
+        for (n = 0; n + item_length <= postings.size(); n += item_length) {
+            if (memcmp(&postings[n], value, value_length) == 0) {
+                ++*removed;
+            }
+            else {
+                memmove(&postings[kept], &postings[n], item_length);
+                kept += item_length;
+            }
+        }
+        // Keep any trailing partial item
+        memmove(&postings[kept], &postings[n], postings.size() - n);
+        postings.resize(kept + postings.size() - n);
+    }
+    else {
+        std::unordered_map<std::string, std::string>::iterator i =
+            _other.find(std::string((const char*) key, key_length));
+        if (i == _other.end()) {
+            return true;
+        }
+
+        std::string kept;
+        size_t n;
+        for (n = 0; n + item_length <= i->second.size(); n += item_length) {
+            if (i->second.compare(n, value_length, (const char*) value, value_length) == 0) {
+                ++*removed;
+            }
+            else {
+                kept.append(i->second, n, item_length);
+            }
+        }
+        kept.append(i->second, n, std::string::npos);
+
+        if (kept.empty()) {
+            _other.erase(i);
+        }
+        else {
+            i->second.swap(kept);
+        }
+    }
+
+    if (*removed) {
+        _dirty = true;
+    }
+    return true;
+}
+
+
+bool MemoryStore::increment(const uint8_t* key, size_t key_length,
+                            int64_t num, int64_t* result,
+                            std::string* error_msg)
+{
+    if (!_writable) {
+        *error_msg = "database is read-only";
+        return false;
+    }
+
+    kyotocabinet::ScopedRWLock lock(&_lock, true);
+
+    // Big-endian like the counters of Kyoto Cabinet, so that they
+    // survive a snapshot of a Kyoto Cabinet database
+    std::string& record = _other[std::string((const char*) key, key_length)];
+    if (!record.empty() && record.size() != 8) {
+        *error_msg = "invalid counter record";
+        return false;
+    }
+
+    uint64_t v = 0;
+    for (size_t i = 0; i < record.size(); i++) {
+        v = (v << 8) | uint8_t(record[i]);
+    }
+    v += num;
+
+    record.resize(8);
+    for (size_t i = 8; i > 0; i--) {
+        record[i - 1] = v;
+        v >>= 8;
+    }
+
+    *result = 0;
+    for (size_t i = 0; i < 8; i++) {
+        *result = (*result << 8) | uint8_t(record[i]);
+    }
+
+    _dirty = true;
+    return true;
+}
+
+
+bool MemoryStore::stamp(uint64_t* records, uint64_t* bytes)
+{
+    kyotocabinet::ScopedRWLock lock(&_lock, false);
+
+    *records = _other.size();
+    *bytes = 0;
+
+    for (size_t i = 0; i < _postings.size(); i++) {
+        if (!_postings[i].empty()) {
+            ++*records;
+            *bytes += _postings[i].size();
+        }
+    }
+
+    for (std::unordered_map<std::string, std::string>::const_iterator i = _other.begin();
+         i != _other.end();
+         ++i) {
+        *bytes += i->second.size();
+    }
+
+    return true;
+}
+
+
+bool MemoryStore::iterate(Visitor& visitor, std::string* error_msg)
+{
+    kyotocabinet::ScopedRWLock lock(&_lock, false);
+
+    for (std::unordered_map<std::string, std::string>::const_iterator i = _other.begin();
+         i != _other.end();
+         ++i) {
+        if (!visitor.visit((const uint8_t*) i->first.data(), i->first.size(),
+                           (const uint8_t*) i->second.data(), i->second.size())) {
+            return true;
+        }
+    }
+
+    for (size_t i = 0; i < _postings.size(); i++) {
+        if (!_postings[i].empty()
+            && !visitor.visit(&_keys[i * _key_length], _key_length,
+                              _postings[i].data(), _postings[i].size())) {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+
+bool MemoryStore::close(std::string* error_msg)
+{
+    if (!_dirty) {
+        return true;
+    }
+
+    _dirty = false;
+    return write_memory_snapshot(*this, _path, std::map<std::string, std::string>(), error_msg);
+}
+
+
+/** Writes the visited records to a snapshot, skipping the ones that
+ * have already been written as settings.
+ */
+class SnapshotWriter : public PartitionStore::Visitor
+{
+public:
+    SnapshotWriter(FILE* file, const std::map<std::string, std::string>& settings)
+        : _file(file), _settings(settings), _records(0), _failed(false)
+        { }
+
+    bool visit(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length) {
+        if (key[0] == '_'
+            && _settings.count(std::string((const char*) key, key_length))) {
+            return true;
+        }
+        return write(key, key_length, value, value_length);
+    }
+
+    bool write(const uint8_t* key, size_t key_length,
+               const uint8_t* value, size_t value_length) {
+        uint8_t lengths[8];
+        put_le32(lengths, key_length);
+        put_le32(lengths + 4, value_length);
+
+        if (fwrite(lengths, sizeof(lengths), 1, _file) != 1
+            || fwrite(key, key_length, 1, _file) != 1
+            || (value_length && fwrite(value, value_length, 1, _file) != 1)) {
+            _failed = true;
+            return false;
+        }
+
+        ++_records;
+        return true;
+    }
+
+    uint64_t records() const { return _records; }
+    bool failed() const { return _failed; }
+
+private:
+    FILE* _file;
+    const std::map<std::string, std::string>& _settings;
+    uint64_t _records;
+    bool _failed;
+};
+
+} // namespace
+
+
+bool is_memory_snapshot(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    char magic[sizeof(snapshot_magic)];
+    bool match = (fread(magic, sizeof(magic), 1, file) == 1
+                  && memcmp(magic, snapshot_magic, sizeof(magic)) == 0);
+    fclose(file);
+    return match;
+}
+
+
+PartitionStore* create_memory_store(const std::string& path, bool writable)
+{
+    return new MemoryStore(path, writable);
+}
+
+
+PartitionStore* load_memory_snapshot(const std::string& path, bool writable,
+                                     std::string* error_msg)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error_msg = strerror(errno);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        *error_msg = strerror(errno);
+        ::close(fd);
+        return NULL;
+    }
+
+    if (st.st_size < (off_t) snapshot_header_size) {
+        *error_msg = "not a snapshot";
+        ::close(fd);
+        return NULL;
+    }
+
+    // Map the file for a single sequential pass, and let it go again
+    // once the records are loaded
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        *error_msg = strerror(errno);
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    MemoryStore* store = new MemoryStore(path, writable);
+    bool ok = store->load((const uint8_t*) map, st.st_size, error_msg);
+    munmap(map, st.st_size);
+
+    if (!ok) {
+        delete store;
+        return NULL;
+    }
+
+    return store;
+}
+
+
+bool write_memory_snapshot(PartitionStore& source, const std::string& path,
+                           const std::map<std::string, std::string>& settings,
+                           std::string* error_msg)
+{
+    // Write to a temporary file and move it into place when complete
+    std::string tmp_path = path + ".tmp";
+
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        *error_msg = std::string("cannot create ") + tmp_path + ": " + strerror(errno);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    // The header is rewritten with the record count when complete
+    uint8_t header[snapshot_header_size];
+    memset(header, 0, sizeof(header));
+    memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+
+    SnapshotWriter writer(file, settings);
+    for (std::map<std::string, std::string>::const_iterator i = settings.begin();
+         ok && i != settings.end();
+         ++i) {
+        ok = writer.write((const uint8_t*) i->first.data(), i->first.size(),
+                          (const uint8_t*) i->second.data(), i->second.size());
+    }
+
+    if (ok) {
+        ok = source.iterate(writer, error_msg) && !writer.failed();
+    }
+
+    if (ok) {
+        put_le64(header + 8, writer.records());
+        ok = (fseek(file, 0, SEEK_SET) == 0
+              && fwrite(header, sizeof(header), 1, file) == 1);
+    }
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        if (error_msg->empty()) {
+            *error_msg = std::string("error writing ") + tmp_path + ": " + strerror(errno);
+        }
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        *error_msg = std::string("cannot rename ") + tmp_path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
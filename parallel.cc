@@ -0,0 +1,494 @@
+/* HmSearch hash lookup library - parallel lookups
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <kcthread.h>
+
+#include "hmsearch.h"
+
+/* The queries are split into chunks of chunk_size consecutive
+ * queries.  Each worker thread owns a deque of chunks, initially a
+ * contiguous share of them, and takes work from the front of it.
+ * When a worker's own deque is empty it steals from the back of the
+ * others, so threads that get the expensive queries (large partition
+ * records) don't hold up the rest.
+ *
+ * Finished chunks are delivered to the sink under a single lock.  In
+ * ordered mode a chunk that finishes early is parked until all
+ * chunks before it have been delivered, and whichever thread
+ * completes the next chunk in line delivers all the parked ones.
+ */
+
+// Small enough to balance the load, large enough to amortise the
+// locking and let lookup_batch() share records between queries
+static const size_t chunk_size = 64;
+
+namespace {
+
+class LookupPool
+{
+public:
+    LookupPool(HmSearch& db,
+               const std::vector<HmSearch::hash_string>& queries,
+               HmSearch::LookupSink& sink,
+               unsigned threads, bool ordered, int max_error)
+        : _db(db)
+        , _queries(queries)
+        , _sink(sink)
+        , _ordered(ordered)
+        , _max_error(max_error)
+        , _chunks((queries.size() + chunk_size - 1) / chunk_size)
+        , _next_delivery(0)
+        , _failed(false)
+        {
+            for (unsigned i = 0; i < threads; i++) {
+                _queues.push_back(new Queue());
+            }
+            for (size_t i = 0; i < _chunks.size(); i++) {
+                _queues[i * threads / _chunks.size()]->chunks.push_back(i);
+            }
+        }
+
+    ~LookupPool() {
+        for (size_t i = 0; i < _queues.size(); i++) {
+            delete _queues[i];
+        }
+    }
+
+    bool run(std::string* error_msg);
+
+private:
+    struct Chunk {
+        Chunk() : done(false) {}
+        std::vector<HmSearch::LookupResultList> results;
+        bool done;
+    };
+
+    struct Queue {
+        kyotocabinet::Mutex lock;
+        std::deque<size_t> chunks;
+    };
+
+    class Worker : public kyotocabinet::Thread
+    {
+    public:
+        Worker(LookupPool* pool, size_t id) : _pool(pool), _id(id) {}
+        void run() { _pool->work(_id); }
+
+    private:
+        LookupPool* _pool;
+        size_t _id;
+    };
+
+    bool next_chunk(size_t id, size_t* chunk);
+    void work(size_t id);
+    void deliver(size_t chunk);
+    void fail(const std::string& error_msg);
+
+    HmSearch& _db;
+    const std::vector<HmSearch::hash_string>& _queries;
+    HmSearch::LookupSink& _sink;
+    bool _ordered;
+    int _max_error;
+
+    std::vector<Chunk> _chunks;
+    std::vector<Queue*> _queues;
+
+    // Protects everything below, and serialises the sink calls
+    kyotocabinet::Mutex _delivery_lock;
+    size_t _next_delivery;
+    bool _failed;
+    std::string _error_msg;
+};
+
+
+bool LookupPool::run(std::string* error_msg)
+{
+    // The calling thread acts as worker 0
+    std::vector<Worker*> workers;
+    for (size_t i = 1; i < _queues.size(); i++) {
+        workers.push_back(new Worker(this, i));
+        workers.back()->start();
+    }
+
+    work(0);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    if (_failed) {
+        *error_msg = _error_msg;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool LookupPool::next_chunk(size_t id, size_t* chunk)
+{
+    {
+        kyotocabinet::ScopedMutex lock(&_queues[id]->lock);
+        if (!_queues[id]->chunks.empty()) {
+            *chunk = _queues[id]->chunks.front();
+            _queues[id]->chunks.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the other workers, starting with the next one
+    for (size_t i = 1; i < _queues.size(); i++) {
+        Queue* victim = _queues[(id + i) % _queues.size()];
+        kyotocabinet::ScopedMutex lock(&victim->lock);
+        if (!victim->chunks.empty()) {
+            *chunk = victim->chunks.back();
+            victim->chunks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void LookupPool::work(size_t id)
+{
+    size_t chunk;
+
+    while (next_chunk(id, &chunk)) {
+        {
+            kyotocabinet::ScopedMutex lock(&_delivery_lock);
+            if (_failed) {
+                return;
+            }
+        }
+
+        size_t first = chunk * chunk_size;
+        size_t last = std::min(first + chunk_size, _queries.size());
+        std::vector<HmSearch::hash_string> queries(
+            _queries.begin() + first, _queries.begin() + last);
+
+        std::string error_msg;
+        if (!_db.lookup_batch(queries, _chunks[chunk].results, _max_error, &error_msg)) {
+            fail(error_msg);
+            return;
+        }
+
+        deliver(chunk);
+    }
+}
+
+
+void LookupPool::deliver(size_t chunk)
+{
+    kyotocabinet::ScopedMutex lock(&_delivery_lock);
+
+    if (_failed) {
+        return;
+    }
+
+    if (!_ordered) {
+        if (!_sink.results(chunk * chunk_size, _chunks[chunk].results)) {
+            _failed = true;
+            _error_msg = "lookup aborted";
+        }
+        _chunks[chunk].results.clear();
+        return;
+    }
+
+    _chunks[chunk].done = true;
+
+    while (_next_delivery < _chunks.size() && _chunks[_next_delivery].done) {
+        Chunk& next = _chunks[_next_delivery];
+        if (!_sink.results(_next_delivery * chunk_size, next.results)) {
+            _failed = true;
+            _error_msg = "lookup aborted";
+            return;
+        }
+        next.results.clear();
+        _next_delivery++;
+    }
+}
+
+
+void LookupPool::fail(const std::string& error_msg)
+{
+    kyotocabinet::ScopedMutex lock(&_delivery_lock);
+
+    if (!_failed) {
+        _failed = true;
+        _error_msg = error_msg;
+    }
+}
+
+
+class CollectSink : public HmSearch::LookupSink
+{
+public:
+    CollectSink(std::vector<HmSearch::LookupResultList>& results)
+        : _results(results)
+        {}
+
+    bool results(size_t first, std::vector<HmSearch::LookupResultList>& results) {
+        for (size_t i = 0; i < results.size(); i++) {
+            _results[first + i].splice(_results[first + i].end(), results[i]);
+        }
+        return true;
+    }
+
+private:
+    std::vector<HmSearch::LookupResultList>& _results;
+};
+
+
+/** The queue of lookup_async() requests, served by a pool of
+ * threads that each take their share of the queued requests at a
+ * time, up to batch_size.  With a short queue each thread takes a
+ * single request, so lookups don't wait for a batch to fill up or
+ * for another thread to finish the batch it took.
+ */
+class AsyncQueue : public HmSearch::LookupQueue
+{
+public:
+    AsyncQueue(HmSearch& db, unsigned threads, size_t batch_size)
+        : _db(db)
+        , _batch_size(batch_size)
+        , _running(0)
+        , _stop(false)
+        {
+            for (unsigned i = 0; i < threads; i++) {
+                _workers.push_back(new Worker(this));
+                _workers.back()->start();
+            }
+        }
+
+    ~AsyncQueue();
+
+    bool lookup_async(const HmSearch::hash_string& query,
+                      HmSearch::LookupCallback& callback,
+                      int max_error = -1,
+                      std::string* error_msg = NULL);
+
+    void wait();
+
+private:
+    struct Request {
+        Request(const HmSearch::hash_string& query,
+                HmSearch::LookupCallback* callback,
+                int max_error)
+            : query(query), callback(callback), max_error(max_error)
+            {}
+
+        HmSearch::hash_string query;
+        HmSearch::LookupCallback* callback;
+        int max_error;
+    };
+
+    class Worker : public kyotocabinet::Thread
+    {
+    public:
+        Worker(AsyncQueue* queue) : _queue(queue) {}
+        void run() { _queue->work(); }
+
+    private:
+        AsyncQueue* _queue;
+    };
+
+    void work();
+
+    HmSearch& _db;
+    size_t _batch_size;
+    std::vector<Worker*> _workers;
+
+    // Protects everything below
+    kyotocabinet::Mutex _lock;
+    kyotocabinet::CondVar _queued;
+    kyotocabinet::CondVar _idle;
+    std::deque<Request> _requests;
+    size_t _running;
+    bool _stop;
+};
+
+
+AsyncQueue::~AsyncQueue()
+{
+    {
+        kyotocabinet::ScopedMutex lock(&_lock);
+        _stop = true;
+        _queued.broadcast();
+    }
+
+    // The workers drain the queue before stopping
+    for (size_t i = 0; i < _workers.size(); i++) {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+}
+
+
+bool AsyncQueue::lookup_async(const HmSearch::hash_string& query,
+                              HmSearch::LookupCallback& callback,
+                              int max_error,
+                              std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    error_msg->clear();
+
+    // Checked here, so that one bad query doesn't fail its whole batch
+    if (query.length() != _db.hash_bits() / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    kyotocabinet::ScopedMutex lock(&_lock);
+    _requests.push_back(Request(query, &callback, max_error));
+    _queued.signal();
+    return true;
+}
+
+
+void AsyncQueue::wait()
+{
+    kyotocabinet::ScopedMutex lock(&_lock);
+    while (_running > 0 || !_requests.empty()) {
+        _idle.wait(&_lock);
+    }
+}
+
+
+void AsyncQueue::work()
+{
+    std::vector<HmSearch::hash_string> queries;
+    std::vector<HmSearch::LookupCallback*> callbacks;
+    std::vector<HmSearch::LookupResultList> results;
+
+    for (;;) {
+        int max_error;
+
+        {
+            kyotocabinet::ScopedMutex lock(&_lock);
+            while (_requests.empty() && !_stop) {
+                _queued.wait(&_lock);
+            }
+            if (_requests.empty()) {
+                return;
+            }
+
+            // A batch shares the max_error of its first request, and
+            // leaves the rest of the queue to the other threads
+            max_error = _requests.front().max_error;
+            size_t share = (_requests.size() + _workers.size() - 1) / _workers.size();
+            size_t limit = std::min(_batch_size, share);
+            queries.clear();
+            callbacks.clear();
+
+            while (!_requests.empty() && queries.size() < limit
+                   && _requests.front().max_error == max_error) {
+                queries.push_back(_requests.front().query);
+                callbacks.push_back(_requests.front().callback);
+                _requests.pop_front();
+            }
+            _running += queries.size();
+        }
+
+        results.clear();
+        results.resize(queries.size());
+
+        std::string error_msg;
+        _db.lookup_batch(queries, results, max_error, &error_msg);
+
+        for (size_t i = 0; i < queries.size(); i++) {
+            callbacks[i]->complete(queries[i], results[i], error_msg);
+        }
+
+        {
+            kyotocabinet::ScopedMutex lock(&_lock);
+            _running -= queries.size();
+            if (_running == 0 && _requests.empty()) {
+                _idle.broadcast();
+            }
+        }
+    }
+}
+
+} // namespace
+
+
+bool HmSearch::parallel_lookup(const std::vector<hash_string>& queries,
+                               LookupSink& sink,
+                               unsigned threads,
+                               bool ordered,
+                               int max_error,
+                               std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    error_msg->clear();
+
+    if (queries.empty()) {
+        return true;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    // No point in having threads without any chunks to work on
+    size_t chunks = (queries.size() + chunk_size - 1) / chunk_size;
+    if (threads > chunks) {
+        threads = chunks;
+    }
+
+    LookupPool pool(*this, queries, sink, threads, ordered, max_error);
+    return pool.run(error_msg);
+}
+
+
+bool HmSearch::parallel_lookup(const std::vector<hash_string>& queries,
+                               std::vector<LookupResultList>& results,
+                               unsigned threads,
+                               int max_error,
+                               std::string* error_msg)
+{
+    if (results.size() < queries.size()) {
+        results.resize(queries.size());
+    }
+
+    CollectSink sink(results);
+    return parallel_lookup(queries, sink, threads, false, max_error, error_msg);
+}
+
+
+HmSearch::LookupQueue* HmSearch::lookup_queue(unsigned threads, size_t batch_size)
+{
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    return new AsyncQueue(*this, threads, std::max(batch_size, size_t(1)));
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
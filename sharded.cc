@@ -0,0 +1,1080 @@
+/* HmSearch hash lookup library - sharded databases
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <kcthread.h>
+
+#include "hmsearch.h"
+#include "sharded.h"
+
+/* A sharded database splits one logical index over several ordinary
+ * databases.  Each hash is stored in the shard chosen by its leading
+ * 32 bits, so each shard holds a contiguous range of the hash space
+ * and inserts only touch one file.  Since near matches can be in any
+ * range, lookups are performed on all shards and the results merged.
+ * Large batches look up each shard on its own thread.
+ *
+ * Routing on the hash rather than on the partition number keeps every
+ * shard a complete, self-contained database that can be inserted
+ * into, compacted or opened on its own.
+ *
+ * The shards are listed in a text manifest:
+ *
+ *   hmsearch-shards 1
+ *   hash_bits 256
+ *   max_error 10
+ *   payload_bytes 8
+ *   shard hashes-0.kch
+ *   shard hashes-1.kch
+ *
+ * payload_bytes is only written for databases with payloads.
+ * Relative shard paths are relative to the directory of the manifest.
+ */
+
+static const char manifest_magic[] = "hmsearch-shards 1";
+
+static const unsigned max_shards = 256;
+
+// Batches smaller than this are looked up on one shard at a time, since
+// starting the threads would cost more than it gains.
+// parallel_lookup() calls lookup_batch() with smaller chunks than this,
+// and is already spreading them over all CPUs.
+static const size_t parallel_batch_size = 256;
+
+struct Manifest {
+    Manifest() : hash_bits(0), max_error(0), payload_bytes(0) {}
+    unsigned hash_bits;
+    unsigned max_error;
+    unsigned payload_bytes;
+    std::vector<std::string> shards;
+};
+
+
+/** Return the directory part of path, including the trailing slash.
+ */
+static std::string path_dir(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+/** Return the file name of shard number i of manifest path, without
+ * the directory.
+ */
+static std::string shard_name(const std::string& path, unsigned i, const char* ext)
+{
+    std::string base = path.substr(path_dir(path).length());
+    size_t dot = base.rfind('.');
+    if (dot != std::string::npos && dot > 0) {
+        base.erase(dot);
+    }
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%u%s", i, ext);
+    return base + suffix;
+}
+
+static std::string shard_path(const std::string& path, const std::string& shard)
+{
+    return shard[0] == '/' ? shard : path_dir(path) + shard;
+}
+
+
+static bool write_manifest(const std::string& path, const Manifest& manifest,
+                           std::string* error_msg)
+{
+    std::string tmp_path = path + ".tmp";
+
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (!file) {
+        *error_msg = std::string("cannot create ") + tmp_path + ": " + strerror(errno);
+        return false;
+    }
+
+    fprintf(file, "%s\nhash_bits %u\nmax_error %u\n",
+            manifest_magic, manifest.hash_bits, manifest.max_error);
+
+    if (manifest.payload_bytes) {
+        fprintf(file, "payload_bytes %u\n", manifest.payload_bytes);
+    }
+
+    for (size_t i = 0; i < manifest.shards.size(); i++) {
+        fprintf(file, "shard %s\n", manifest.shards[i].c_str());
+    }
+
+    if (ferror(file) | fclose(file)) {
+        *error_msg = std::string("error writing ") + tmp_path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        *error_msg = std::string("cannot rename ") + tmp_path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+/** Read the next line from file into line, without the newline.
+ */
+static bool read_line(FILE* file, std::string& line)
+{
+    char buf[4096];
+
+    line.clear();
+    while (fgets(buf, sizeof(buf), file)) {
+        line += buf;
+        if (line[line.length() - 1] == '\n') {
+            line.erase(line.length() - 1);
+            return true;
+        }
+    }
+
+    return !line.empty();
+}
+
+
+static bool read_manifest(const std::string& path, Manifest* manifest,
+                          std::string* error_msg)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        *error_msg = std::string("cannot open ") + path + ": " + strerror(errno);
+        return false;
+    }
+
+    std::string line;
+    bool ok = read_line(file, line) && line == manifest_magic;
+
+    while (ok && read_line(file, line)) {
+        if (line.compare(0, 10, "hash_bits ") == 0) {
+            manifest->hash_bits = strtoul(line.c_str() + 10, NULL, 10);
+        }
+        else if (line.compare(0, 10, "max_error ") == 0) {
+            manifest->max_error = strtoul(line.c_str() + 10, NULL, 10);
+        }
+        else if (line.compare(0, 14, "payload_bytes ") == 0) {
+            manifest->payload_bytes = strtoul(line.c_str() + 14, NULL, 10);
+        }
+        else if (line.compare(0, 6, "shard ") == 0 && line.length() > 6) {
+            manifest->shards.push_back(line.substr(6));
+        }
+        else if (!line.empty()) {
+            ok = false;
+        }
+    }
+
+    fclose(file);
+
+    if (!ok || !manifest->hash_bits || !manifest->max_error
+        || manifest->shards.empty() || manifest->shards.size() > max_shards) {
+        *error_msg = "invalid shard manifest";
+        return false;
+    }
+
+    return true;
+}
+
+
+bool is_shard_manifest(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        return false;
+    }
+
+    char buf[sizeof(manifest_magic)];
+    bool ok = (fread(buf, 1, sizeof(buf), file) == sizeof(buf)
+               && memcmp(buf, manifest_magic, sizeof(buf) - 1) == 0
+               && buf[sizeof(buf) - 1] == '\n');
+
+    fclose(file);
+    return ok;
+}
+
+
+namespace {
+
+class ShardedHmSearch : public HmSearch
+{
+public:
+    ShardedHmSearch(const std::vector<HmSearch*>& shards,
+                    unsigned hash_bits, unsigned max_error, unsigned payload_bytes)
+        : _shards(shards)
+        , _hash_bits(hash_bits)
+        , _max_error(max_error)
+        , _payload_bytes(payload_bytes)
+        { }
+
+    ~ShardedHmSearch() {
+        close();
+    }
+
+    bool insert(const hash_string& hash,
+                const hash_string& payload,
+                std::string* error_msg = NULL);
+
+    bool insert_unique(const hash_string& hash,
+                       const hash_string& payload,
+                       bool* inserted = NULL,
+                       std::string* error_msg = NULL);
+
+    using HmSearch::insert;
+    using HmSearch::insert_unique;
+
+    bool remove(const hash_string& hash,
+                size_t* removed = NULL,
+                std::string* error_msg = NULL);
+
+    bool flush(std::string* error_msg = NULL);
+
+    bool lookup(const hash_string& query,
+                LookupResultList& result,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    bool lookup(const hash_string& query,
+                ResultVisitor& visitor,
+                int max_error = -1,
+                std::string* error_msg = NULL,
+                LookupStats* stats = NULL);
+
+    using HmSearch::lookup;
+
+    bool lookup_topk(const hash_string& query,
+                     size_t k,
+                     LookupResultList& result,
+                     int max_error = -1,
+                     std::string* error_msg = NULL,
+                     LookupStats* stats = NULL);
+
+    bool lookup_first(const hash_string& query,
+                      LookupResultList& result,
+                      int max_error = -1,
+                      std::string* error_msg = NULL,
+                      LookupStats* stats = NULL);
+
+    bool contains(const hash_string& hash,
+                  bool* found,
+                  std::string* error_msg = NULL);
+
+    bool lookup_exact(const hash_string& query,
+                      LookupResultList& result,
+                      std::string* error_msg = NULL,
+                      LookupStats* stats = NULL);
+
+    bool lookup_batch(const std::vector<hash_string>& queries,
+                      std::vector<LookupResultList>& results,
+                      int max_error = -1,
+                      std::string* error_msg = NULL);
+
+    BulkLoader* bulk_load(const std::string& tmp_dir = "",
+                          size_t memory_limit = 0,
+                          unsigned threads = 1,
+                          std::string* error_msg = NULL);
+
+    bool compact(const std::string& path,
+                 std::string* error_msg = NULL);
+
+    bool save_snapshot(const std::string& path,
+                       std::string* error_msg = NULL);
+
+    bool apply_log(const std::string& path,
+                   uint64_t* sequence = NULL,
+                   std::string* error_msg = NULL);
+
+    bool merge(const std::string& path,
+               std::string* error_msg = NULL);
+
+    bool close(std::string* error_msg = NULL);
+
+    unsigned hash_bits() const { return _hash_bits; }
+    unsigned max_error() const { return _max_error; }
+    unsigned payload_bytes() const { return _payload_bytes; }
+
+    void dump();
+
+private:
+    /** Looks up a batch in one shard on a separate thread.
+     */
+    class ShardLookup : public kyotocabinet::Thread
+    {
+    public:
+        ShardLookup(HmSearch* shard, const std::vector<hash_string>& queries,
+                    int max_error)
+            : _shard(shard), _queries(queries), _max_error(max_error), _ok(false)
+            {}
+
+        void run() {
+            _ok = _shard->lookup_batch(_queries, results, _max_error, &error_msg);
+        }
+
+        bool ok() const { return _ok; }
+
+        std::vector<LookupResultList> results;
+        std::string error_msg;
+
+    private:
+        HmSearch* _shard;
+        const std::vector<hash_string>& _queries;
+        int _max_error;
+        bool _ok;
+    };
+
+    /** Bulk loads all shards, routing each hash to its loader.
+     */
+    class ShardedBulkLoader : public BulkLoader
+    {
+    public:
+        ShardedBulkLoader(const ShardedHmSearch& db,
+                          const std::vector<BulkLoader*>& loaders)
+            : _db(db), _loaders(loaders)
+            {}
+
+        ~ShardedBulkLoader() {
+            for (size_t i = 0; i < _loaders.size(); i++) {
+                delete _loaders[i];
+            }
+        }
+
+        bool add(const hash_string& hash, const hash_string& payload,
+                 std::string* error_msg = NULL) {
+            std::string dummy;
+            if (!error_msg) {
+                error_msg = &dummy;
+            }
+            *error_msg = "";
+
+            if (hash.length() != _db._hash_bits / 8) {
+                *error_msg = "incorrect hash length";
+                return false;
+            }
+
+            return _loaders[_db.shard_for(hash)]->add(hash, payload, error_msg);
+        }
+
+        using BulkLoader::add;
+
+        bool commit(std::string* error_msg = NULL) {
+            for (size_t i = 0; i < _loaders.size(); i++) {
+                if (!_loaders[i]->commit(error_msg)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        const ShardedHmSearch& _db;
+        std::vector<BulkLoader*> _loaders;
+    };
+
+    size_t shard_for(const hash_string& hash) const {
+        uint32_t prefix = 0;
+        for (size_t i = 0; i < 4; i++) {
+            prefix = (prefix << 8) | (i < hash.length() ? hash[i] : 0);
+        }
+        return (uint64_t(prefix) * _shards.size()) >> 32;
+    }
+
+    std::vector<HmSearch*> _shards;
+    unsigned _hash_bits;
+    unsigned _max_error;
+    unsigned _payload_bytes;
+};
+
+
+bool ShardedHmSearch::insert(const hash_string& hash,
+                             const hash_string& payload,
+                             std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return _shards[shard_for(hash)]->insert(hash, payload, error_msg);
+}
+
+
+bool ShardedHmSearch::insert_unique(const hash_string& hash,
+                                    const hash_string& payload,
+                                    bool* inserted,
+                                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return _shards[shard_for(hash)]->insert_unique(hash, payload, inserted, error_msg);
+}
+
+
+bool ShardedHmSearch::remove(const hash_string& hash,
+                             size_t* removed,
+                             std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return _shards[shard_for(hash)]->remove(hash, removed, error_msg);
+}
+
+
+bool ShardedHmSearch::flush(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        if (!_shards[i]->flush(error_msg)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool ShardedHmSearch::lookup(const hash_string& query,
+                             LookupResultList& result,
+                             int reduced_error,
+                             std::string* error_msg,
+                             LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        if (!_shards[i]->lookup(query, result, reduced_error, error_msg, stats)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool nearer(const HmSearch::LookupResult& a, const HmSearch::LookupResult& b)
+{
+    return a.distance < b.distance;
+}
+
+
+/* Near hashes usually share the prefix that shards are routed on, so
+ * the shard of the query is tried first.  Once k matches have been
+ * found, the remaining shards are only asked for matches at most as
+ * distant as the k:th, which lets them stop probing sooner.
+ */
+bool ShardedHmSearch::lookup_topk(const hash_string& query,
+                                  size_t k,
+                                  LookupResultList& result,
+                                  int reduced_error,
+                                  std::string* error_msg,
+                                  LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    LookupResultList found;
+    size_t first = shard_for(query);
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        HmSearch* shard = _shards[(first + i) % _shards.size()];
+        if (!shard->lookup_topk(query, k, found, reduced_error, error_msg, stats)) {
+            return false;
+        }
+
+        found.sort(nearer);
+        if (found.size() >= k) {
+            LookupResultList::iterator end = found.begin();
+            std::advance(end, k);
+            found.erase(end, found.end());
+            reduced_error = found.back().distance;
+        }
+    }
+
+    result.splice(result.end(), found);
+    return true;
+}
+
+
+bool ShardedHmSearch::lookup_first(const hash_string& query,
+                                   LookupResultList& result,
+                                   int reduced_error,
+                                   std::string* error_msg,
+                                   LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    size_t first = shard_for(query);
+    size_t before = result.size();
+
+    for (size_t i = 0; i < _shards.size() && result.size() == before; i++) {
+        HmSearch* shard = _shards[(first + i) % _shards.size()];
+        if (!shard->lookup_first(query, result, reduced_error, error_msg, stats)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool ShardedHmSearch::contains(const hash_string& hash,
+                               bool* found,
+                               std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (hash.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    // All copies of a hash are in the shard it is routed to
+    return _shards[shard_for(hash)]->contains(hash, found, error_msg);
+}
+
+
+bool ShardedHmSearch::lookup_exact(const hash_string& query,
+                                   LookupResultList& result,
+                                   std::string* error_msg,
+                                   LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    return _shards[shard_for(query)]->lookup_exact(query, result, error_msg, stats);
+}
+
+
+/** Passes matches on to another visitor, noting if it stopped the lookup.
+ */
+class ShardVisitor : public HmSearch::ResultVisitor
+{
+public:
+    ShardVisitor(HmSearch::ResultVisitor& visitor) : _visitor(visitor), _stopped(false) {}
+
+    bool visit(const uint8_t* hash, int distance) {
+        _stopped = !_visitor.visit(hash, distance);
+        return !_stopped;
+    }
+
+    bool stopped() const { return _stopped; }
+
+private:
+    HmSearch::ResultVisitor& _visitor;
+    bool _stopped;
+};
+
+
+bool ShardedHmSearch::lookup(const hash_string& query,
+                             ResultVisitor& visitor,
+                             int reduced_error,
+                             std::string* error_msg,
+                             LookupStats* stats)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (query.length() != _hash_bits / 8) {
+        *error_msg = "incorrect hash length";
+        return false;
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    ShardVisitor shard_visitor(visitor);
+    for (size_t i = 0; i < _shards.size() && !shard_visitor.stopped(); i++) {
+        if (!_shards[i]->lookup(query, shard_visitor, reduced_error, error_msg, stats)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool ShardedHmSearch::lookup_batch(const std::vector<hash_string>& queries,
+                                   std::vector<LookupResultList>& results,
+                                   int reduced_error,
+                                   std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    for (size_t q = 0; q < queries.size(); q++) {
+        if (queries[q].length() != _hash_bits / 8) {
+            *error_msg = "incorrect hash length";
+            return false;
+        }
+    }
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    // Collect the shard results separately, so nothing is added if
+    // any shard fails
+    std::vector<ShardLookup*> lookups;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        lookups.push_back(new ShardLookup(_shards[i], queries, reduced_error));
+    }
+
+    if (queries.size() >= parallel_batch_size && lookups.size() > 1) {
+        for (size_t i = 1; i < lookups.size(); i++) {
+            lookups[i]->start();
+        }
+        lookups[0]->run();
+        for (size_t i = 1; i < lookups.size(); i++) {
+            lookups[i]->join();
+        }
+    }
+    else {
+        for (size_t i = 0; i < lookups.size() && (i == 0 || lookups[i - 1]->ok()); i++) {
+            lookups[i]->run();
+        }
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < lookups.size() && ok; i++) {
+        if (!lookups[i]->ok()) {
+            *error_msg = lookups[i]->error_msg;
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        if (results.size() < queries.size()) {
+            results.resize(queries.size());
+        }
+
+        for (size_t i = 0; i < lookups.size(); i++) {
+            std::vector<LookupResultList>& shard_results = lookups[i]->results;
+            for (size_t q = 0; q < shard_results.size(); q++) {
+                results[q].splice(results[q].end(), shard_results[q]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < lookups.size(); i++) {
+        delete lookups[i];
+    }
+
+    return ok;
+}
+
+
+HmSearch::BulkLoader* ShardedHmSearch::bulk_load(const std::string& tmp_dir,
+                                                 size_t memory_limit,
+                                                 unsigned threads,
+                                                 std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return NULL;
+    }
+
+    // Split the memory between the shards, so the total stays the same
+    if (memory_limit == 0) {
+        memory_limit = size_t(256) << 20;
+    }
+
+    // The shards are committed one at a time, each on all threads
+    std::vector<BulkLoader*> loaders;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        BulkLoader* loader = _shards[i]->bulk_load(
+            tmp_dir, memory_limit / _shards.size() + 1, threads, error_msg);
+
+        if (!loader) {
+            for (size_t j = 0; j < loaders.size(); j++) {
+                delete loaders[j];
+            }
+            return NULL;
+        }
+
+        loaders.push_back(loader);
+    }
+
+    return new ShardedBulkLoader(*this, loaders);
+}
+
+
+bool ShardedHmSearch::compact(const std::string& path,
+                              std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    Manifest manifest;
+    manifest.hash_bits = _hash_bits;
+    manifest.max_error = _max_error;
+    manifest.payload_bytes = _payload_bytes;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string name = shard_name(path, i, ".hmm");
+        if (!_shards[i]->compact(shard_path(path, name), error_msg)) {
+            return false;
+        }
+        manifest.shards.push_back(name);
+    }
+
+    return write_manifest(path, manifest, error_msg);
+}
+
+
+bool ShardedHmSearch::save_snapshot(const std::string& path,
+                                    std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    Manifest manifest;
+    manifest.hash_bits = _hash_bits;
+    manifest.max_error = _max_error;
+    manifest.payload_bytes = _payload_bytes;
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string name = shard_name(path, i, ".hmsnap");
+        if (!_shards[i]->save_snapshot(shard_path(path, name), error_msg)) {
+            return false;
+        }
+        manifest.shards.push_back(name);
+    }
+
+    return write_manifest(path, manifest, error_msg);
+}
+
+
+bool ShardedHmSearch::apply_log(const std::string& path,
+                                uint64_t* sequence,
+                                std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+
+    // Each shard keeps its own log, with its own sequence numbers
+    *error_msg = "insert logs must be applied to each shard";
+    return false;
+}
+
+
+bool ShardedHmSearch::merge(const std::string& path,
+                            std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (_shards.empty()) {
+        *error_msg = "database is closed";
+        return false;
+    }
+
+    // Hashes are routed on their leading bits, so a delta sharded the
+    // same way can be merged shard by shard
+    Manifest manifest;
+    if (!is_shard_manifest(path) || !read_manifest(path, &manifest, error_msg)
+        || manifest.shards.size() != _shards.size()) {
+        if (error_msg->empty()) {
+            *error_msg = "can only merge a database with the same number of shards";
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < _shards.size(); i++) {
+        if (!_shards[i]->merge(shard_path(path, manifest.shards[i]), error_msg)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool ShardedHmSearch::close(std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    // Close all shards even if some fail, reporting the first error
+    bool ok = true;
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::string shard_error;
+        if (!_shards[i]->close(&shard_error) && ok) {
+            *error_msg = shard_error;
+            ok = false;
+        }
+        delete _shards[i];
+    }
+
+    _shards.clear();
+    return ok;
+}
+
+
+void ShardedHmSearch::dump()
+{
+    for (size_t i = 0; i < _shards.size(); i++) {
+        std::cout << "Shard " << i << std::endl << std::endl;
+        _shards[i]->dump();
+    }
+}
+
+} // namespace
+
+
+HmSearch* open_sharded(const std::string& path,
+                       HmSearch::OpenMode mode,
+                       const HmSearch::OpenOptions& options,
+                       std::string* error_msg)
+{
+    Manifest manifest;
+    if (!read_manifest(path, &manifest, error_msg)) {
+        return NULL;
+    }
+
+    std::vector<HmSearch*> shards;
+    for (size_t i = 0; i < manifest.shards.size(); i++) {
+        std::string sp = shard_path(path, manifest.shards[i]);
+        HmSearch* shard = HmSearch::open(sp, mode, options, error_msg);
+
+        if (shard && (shard->hash_bits() != manifest.hash_bits
+                      || shard->max_error() != manifest.max_error
+                      || shard->payload_bytes() != manifest.payload_bytes)) {
+            *error_msg = "settings differ from the manifest";
+            delete shard;
+            shard = NULL;
+        }
+
+        if (!shard) {
+            *error_msg = sp + ": " + *error_msg;
+            for (size_t j = 0; j < shards.size(); j++) {
+                delete shards[j];
+            }
+            return NULL;
+        }
+
+        shards.push_back(shard);
+    }
+
+    return new ShardedHmSearch(shards, manifest.hash_bits, manifest.max_error,
+                               manifest.payload_bytes);
+}
+
+
+bool HmSearch::init_sharded(const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned shards,
+                            std::string* error_msg)
+{
+    return init_sharded(path, hash_bits, max_error, num_hashes, shards,
+                        InitOptions(), error_msg);
+}
+
+
+bool HmSearch::init_sharded(const std::string& path,
+                            unsigned hash_bits, unsigned max_error,
+                            uint64_t num_hashes, unsigned shards,
+                            const InitOptions& options,
+                            std::string* error_msg)
+{
+    std::string dummy;
+    if (!error_msg) {
+        error_msg = &dummy;
+    }
+    *error_msg = "";
+
+    if (shards == 0 || shards > max_shards) {
+        *error_msg = "invalid number of shards";
+        return false;
+    }
+
+    Manifest manifest;
+    manifest.hash_bits = hash_bits;
+    manifest.max_error = max_error;
+    manifest.payload_bytes = options.payload_bytes;
+
+    for (unsigned i = 0; i < shards; i++) {
+        std::string name = shard_name(path, i, options.snapshot ? ".hmsnap" : ".kch");
+        if (!init(shard_path(path, name), hash_bits, max_error,
+                  (num_hashes + shards - 1) / shards, options, error_msg)) {
+            *error_msg = name + ": " + *error_msg;
+            return false;
+        }
+        manifest.shards.push_back(name);
+    }
+
+    return write_manifest(path, manifest, error_msg);
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
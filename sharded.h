@@ -0,0 +1,36 @@
+/* HmSearch hash lookup library - sharded databases
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __SHARDED_H_INCLUDED__
+#define __SHARDED_H_INCLUDED__
+
+#include <string>
+
+#include "hmsearch.h"
+
+/** Return true if path is a shard manifest written by
+ * HmSearch::init_sharded() or HmSearch::compact().
+ */
+bool is_shard_manifest(const std::string& path);
+
+/** Open all shards listed in a manifest.
+ *
+ * Returns the database object, or NULL on error.
+ */
+HmSearch* open_sharded(const std::string& path,
+                       HmSearch::OpenMode mode,
+                       const HmSearch::OpenOptions& options,
+                       std::string* error_msg);
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __SHARDED_H_INCLUDED__
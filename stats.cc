@@ -0,0 +1,240 @@
+/* HmSearch hash lookup library - lookup statistics
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+#include "hmsearch.h"
+#include "stats.h"
+
+std::atomic<bool> global_stats_enabled(false);
+
+namespace {
+
+/** The process-wide counters, updated with one atomic addition per
+ * counter and lookup.
+ */
+struct GlobalStats {
+    std::atomic<uint64_t> lookups;
+    std::atomic<uint64_t> gets;
+    std::atomic<uint64_t> get_hits;
+    std::atomic<uint64_t> posting_bytes;
+    std::atomic<uint64_t> largest_record;
+    std::atomic<uint64_t> candidates;
+    std::atomic<uint64_t> within_distance;
+    std::atomic<uint64_t> results;
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<uint64_t> cache_misses;
+    std::atomic<uint64_t> filter_skips;
+    std::atomic<uint64_t> hash_fetches;
+    std::atomic<uint64_t> probe_ns;
+    std::atomic<uint64_t> verify_ns;
+};
+
+GlobalStats global;
+
+// Output format for the exit dump, if requested by HMSEARCH_STATS
+bool exit_dump_json;
+
+void dump_at_exit()
+{
+    std::string s = HmSearch::format_stats(HmSearch::global_stats(), exit_dump_json);
+    fputs(s.c_str(), stderr);
+}
+
+/** Reads HMSEARCH_STATS when the library is loaded.
+ */
+struct StatsEnvironment {
+    StatsEnvironment() {
+        const char* env = getenv("HMSEARCH_STATS");
+        if (env && *env && strcmp(env, "0") != 0) {
+            exit_dump_json = strcmp(env, "json") == 0;
+            global_stats_enabled = true;
+            atexit(dump_at_exit);
+        }
+    }
+} stats_environment;
+
+} // namespace
+
+
+void HmSearch::LookupStats::clear()
+{
+    lookups = 0;
+    gets = 0;
+    get_hits = 0;
+    posting_bytes = 0;
+    largest_record = 0;
+    candidates = 0;
+    within_distance = 0;
+    results = 0;
+    cache_hits = 0;
+    cache_misses = 0;
+    filter_skips = 0;
+    hash_fetches = 0;
+    probe_ns = 0;
+    verify_ns = 0;
+}
+
+
+void HmSearch::LookupStats::add(const LookupStats& other)
+{
+    lookups += other.lookups;
+    gets += other.gets;
+    get_hits += other.get_hits;
+    posting_bytes += other.posting_bytes;
+    if (other.largest_record > largest_record) {
+        largest_record = other.largest_record;
+    }
+    candidates += other.candidates;
+    within_distance += other.within_distance;
+    results += other.results;
+    cache_hits += other.cache_hits;
+    cache_misses += other.cache_misses;
+    filter_skips += other.filter_skips;
+    hash_fetches += other.hash_fetches;
+    probe_ns += other.probe_ns;
+    verify_ns += other.verify_ns;
+}
+
+
+void add_stats(const HmSearch::LookupStats& local, HmSearch::LookupStats* stats)
+{
+    if (stats) {
+        stats->add(local);
+    }
+
+    if (!global_stats_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    const std::memory_order relaxed = std::memory_order_relaxed;
+
+    global.lookups.fetch_add(local.lookups, relaxed);
+    global.gets.fetch_add(local.gets, relaxed);
+    global.get_hits.fetch_add(local.get_hits, relaxed);
+    global.posting_bytes.fetch_add(local.posting_bytes, relaxed);
+    global.candidates.fetch_add(local.candidates, relaxed);
+    global.within_distance.fetch_add(local.within_distance, relaxed);
+    global.results.fetch_add(local.results, relaxed);
+    global.cache_hits.fetch_add(local.cache_hits, relaxed);
+    global.cache_misses.fetch_add(local.cache_misses, relaxed);
+    global.filter_skips.fetch_add(local.filter_skips, relaxed);
+    global.hash_fetches.fetch_add(local.hash_fetches, relaxed);
+    global.probe_ns.fetch_add(local.probe_ns, relaxed);
+    global.verify_ns.fetch_add(local.verify_ns, relaxed);
+
+    uint64_t largest = global.largest_record.load(relaxed);
+    while (local.largest_record > largest
+           && !global.largest_record.compare_exchange_weak(largest, local.largest_record, relaxed)) {
+    }
+}
+
+
+void HmSearch::enable_global_stats(bool enable)
+{
+    global_stats_enabled = enable;
+}
+
+
+HmSearch::LookupStats HmSearch::global_stats()
+{
+    LookupStats stats;
+
+    stats.lookups = global.lookups;
+    stats.gets = global.gets;
+    stats.get_hits = global.get_hits;
+    stats.posting_bytes = global.posting_bytes;
+    stats.largest_record = global.largest_record;
+    stats.candidates = global.candidates;
+    stats.within_distance = global.within_distance;
+    stats.results = global.results;
+    stats.cache_hits = global.cache_hits;
+    stats.cache_misses = global.cache_misses;
+    stats.filter_skips = global.filter_skips;
+    stats.hash_fetches = global.hash_fetches;
+    stats.probe_ns = global.probe_ns;
+    stats.verify_ns = global.verify_ns;
+
+    return stats;
+}
+
+
+void HmSearch::reset_global_stats()
+{
+    global.lookups = 0;
+    global.gets = 0;
+    global.get_hits = 0;
+    global.posting_bytes = 0;
+    global.largest_record = 0;
+    global.candidates = 0;
+    global.within_distance = 0;
+    global.results = 0;
+    global.cache_hits = 0;
+    global.cache_misses = 0;
+    global.filter_skips = 0;
+    global.hash_fetches = 0;
+    global.probe_ns = 0;
+    global.verify_ns = 0;
+}
+
+
+std::string HmSearch::format_stats(const LookupStats& stats, bool json)
+{
+    const struct {
+        const char* name;
+        uint64_t value;
+    } fields[] = {
+        { "lookups", stats.lookups },
+        { "gets", stats.gets },
+        { "get_hits", stats.get_hits },
+        { "posting_bytes", stats.posting_bytes },
+        { "largest_record", stats.largest_record },
+        { "candidates", stats.candidates },
+        { "within_distance", stats.within_distance },
+        { "results", stats.results },
+        { "cache_hits", stats.cache_hits },
+        { "cache_misses", stats.cache_misses },
+        { "filter_skips", stats.filter_skips },
+        { "hash_fetches", stats.hash_fetches },
+        { "probe_ns", stats.probe_ns },
+        { "verify_ns", stats.verify_ns },
+    };
+    const size_t count = sizeof(fields) / sizeof(fields[0]);
+
+    std::string s = json ? "{" : "";
+    char buf[64];
+
+    for (size_t i = 0; i < count; i++) {
+        if (json) {
+            snprintf(buf, sizeof(buf), "%s\"%s\": %llu", i ? ", " : "",
+                     fields[i].name, (unsigned long long) fields[i].value);
+        }
+        else {
+            snprintf(buf, sizeof(buf), "%s %llu\n",
+                     fields[i].name, (unsigned long long) fields[i].value);
+        }
+        s += buf;
+    }
+
+    if (json) {
+        s += "}\n";
+    }
+
+    return s;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
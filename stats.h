@@ -0,0 +1,55 @@
+/* HmSearch hash lookup library - lookup statistics
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __STATS_H_INCLUDED__
+#define __STATS_H_INCLUDED__
+
+#include <time.h>
+
+#include <atomic>
+
+#include "hmsearch.h"
+
+extern std::atomic<bool> global_stats_enabled;
+
+/** Return the object that lookups should count into, or NULL if no
+ * statistics should be collected.  local is used when the caller
+ * didn't ask for stats but the global statistics are enabled.
+ */
+static inline HmSearch::LookupStats* select_stats(HmSearch::LookupStats* stats,
+                                                  HmSearch::LookupStats* local)
+{
+#ifdef HMSEARCH_NO_STATS
+    return NULL;
+#else
+    if (stats || global_stats_enabled.load(std::memory_order_relaxed)) {
+        return local;
+    }
+    return NULL;
+#endif
+}
+
+/** Add the stats of a finished lookup to the caller's stats, if any,
+ * and to the global statistics if enabled.
+ */
+void add_stats(const HmSearch::LookupStats& local, HmSearch::LookupStats* stats);
+
+static inline uint64_t stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __STATS_H_INCLUDED__
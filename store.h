@@ -0,0 +1,264 @@
+/* HmSearch hash lookup library - partition record storage
+ *
+ * Copyright 2014 Commons Machinery http://commonsmachinery.se/
+ * Distributed under an MIT license, please see LICENSE in the top dir.
+ */
+
+#ifndef __STORE_H_INCLUDED__
+#define __STORE_H_INCLUDED__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/** Storage of the records of a HmSearch database.
+ *
+ * The keys are the partition keys described in hmsearch.cc, and the
+ * values the concatenated hashes in each partition.  A store must
+ * allow concurrent get() calls from multiple threads.
+ */
+class PartitionStore
+{
+public:
+    /** Called by iterate() for each record in the store.
+     */
+    class Visitor
+    {
+    public:
+        /** Return false to stop the iteration.
+         */
+        virtual bool visit(const uint8_t* key, size_t key_length,
+                           const uint8_t* value, size_t value_length) = 0;
+
+        virtual ~Visitor() {}
+    };
+
+    /** How a get() was served, for the lookup statistics.
+     */
+    enum CacheResult {
+        UNCACHED,       // No cache in front of the store
+        CACHE_HIT,
+        CACHE_MISS,
+        FILTERED        // The key filter showed that there is no record
+    };
+
+    virtual ~PartitionStore() {}
+
+    /** Get the record for a key.
+     *
+     * On success *value points either into buffer, which is grown if
+     * necessary, or into memory owned by the store that remains valid
+     * until the store is closed.
+     *
+     * If cache_result is not NULL, a caching store sets it to
+     * CACHE_HIT or CACHE_MISS, and a filtering store to FILTERED.
+     * Other stores leave it untouched.
+     *
+     * Returns false if there is no such record.
+     */
+    virtual bool get(const uint8_t* key, size_t key_length,
+                     std::vector<char>& buffer,
+                     const uint8_t** value, size_t* value_length,
+                     CacheResult* cache_result) = 0;
+
+    /** Append data to the record for a key, creating it if necessary.
+     */
+    virtual bool append(const uint8_t* key, size_t key_length,
+                        const uint8_t* value, size_t value_length,
+                        std::string* error_msg) = 0;
+
+    /** Remove all items starting with value from the record for key.
+     *
+     * The record is treated as a sequence of item_length byte items,
+     * and the ones whose first value_length bytes equal value are cut
+     * out.  The record is deleted if no items remain.  The number of
+     * removed items is stored in *removed.
+     */
+    virtual bool remove(const uint8_t* key, size_t key_length,
+                        const uint8_t* value, size_t value_length,
+                        size_t item_length, size_t* removed,
+                        std::string* error_msg) = 0;
+
+    /** Add num to the 64-bit integer record for key, creating it as
+     * 0 if necessary, and store the new value in *result.  The update
+     * is atomic and never buffered.
+     */
+    virtual bool increment(const uint8_t* key, size_t key_length,
+                           int64_t num, int64_t* result,
+                           std::string* error_msg) {
+        *error_msg = "store has no counters";
+        return false;
+    }
+
+    /** How the records are going to be accessed, see advise().
+     */
+    enum Advice {
+        ADVISE_NORMAL,
+        ADVISE_RANDOM,
+        ADVISE_WILLNEED
+    };
+
+    /** Pass a hint on the access pattern on to the operating system,
+     * if the store can.
+     */
+    virtual void advise(Advice advice) {}
+
+    /** Start reading the records of count keys of key_length bytes,
+     * stored back to back in keys, so that the get() calls that
+     * follow don't wait for the device one after another.  This is
+     * only a hint, and stores that can't locate the records without
+     * reading them ignore it.
+     */
+    virtual void prefetch(const uint8_t* keys, size_t key_length, size_t count) {}
+
+    /** Return true if the postings of every record are sorted on
+     * their bytes without duplicates, and the values returned by
+     * get() stay valid until the store is closed rather than only
+     * until the next get().
+     */
+    virtual bool sorted_postings() const { return false; }
+
+    /** Write any buffered appends to the underlying storage.
+     */
+    virtual bool flush(std::string* error_msg) {
+        return true;
+    }
+
+    /** Get values identifying the current contents of the store, for
+     * checking that data derived from it and saved elsewhere is still
+     * valid.  records and bytes change whenever the records do.
+     *
+     * Returns false if the store can't provide this.
+     */
+    virtual bool stamp(uint64_t* records, uint64_t* bytes) {
+        return false;
+    }
+
+    /** Call visitor for each record in the store.
+     */
+    virtual bool iterate(Visitor& visitor, std::string* error_msg) = 0;
+
+    /** Sync and close the store.  No other calls may be made after this.
+     */
+    virtual bool close(std::string* error_msg) = 0;
+};
+
+
+/** Wrap a store in one that buffers appends in memory.
+ *
+ * Appends are collected in sharded buffers, merging all data for the
+ * same key, and written to store by flush() or when buffer_size bytes
+ * have been buffered.  If flush_interval > 0, a background thread
+ * also flushes the buffers that often.  get() only sees data that has
+ * been written to store.
+ *
+ * The returned store takes ownership of store.
+ */
+PartitionStore* create_buffered_store(PartitionStore* store,
+                                      size_t buffer_size,
+                                      double flush_interval);
+
+/** Wrap a store in one that caches records in memory.
+ *
+ * Both found records and missing keys are cached, using up to
+ * cache_size bytes.  Entries are evicted with the CLOCK algorithm and
+ * invalidated by append() and remove().
+ *
+ * The returned store takes ownership of store.
+ */
+PartitionStore* create_cached_store(PartitionStore* store, size_t cache_size);
+
+/** Wrap a store in one that keeps a Bloom filter of the partition
+ * keys, so that get() of most missing keys doesn't have to reach the
+ * store.  append() adds keys to the filter.
+ *
+ * The filter is loaded from the sidecar file at filter_path if it
+ * matches the stamp() of store, and otherwise built by iterating
+ * over all records.  It is saved to filter_path again on close(),
+ * after any changes.  If writable, the sidecar file is removed when
+ * loaded, so that it is not left stale if the process dies before
+ * closing the store.
+ *
+ * The returned store takes ownership of store.  On errors NULL is
+ * returned, and store is left to the caller.
+ */
+PartitionStore* create_filtered_store(PartitionStore* store,
+                                      const std::string& filter_path,
+                                      bool writable,
+                                      std::string* error_msg);
+
+/** Return true if path is a file in the memory-mapped format.
+ */
+bool is_mapped_store(const std::string& path);
+
+/** Open a read-only memory-mapped store, returning the database
+ * settings from the file header.  substrings is set to the number of
+ * multi-index substrings, or 0 for HmSearch partitions.
+ *
+ * Returns the new store, or NULL on error.
+ */
+PartitionStore* open_mapped_store(const std::string& path,
+                                  unsigned* hash_bits, unsigned* max_error,
+                                  unsigned* payload_bytes, bool* ordinals,
+                                  unsigned* substrings,
+                                  std::string* error_msg);
+
+/** Write all partition records in source to a new file in the
+ * memory-mapped format.
+ *
+ * If ordinals is true, the partition records hold hash ordinals
+ * that refer to the hash records of source.  The ordinals are then
+ * renumbered densely in the file.  If substrings > 0, the partition
+ * keys are the substrings of multi-index hashing.
+ *
+ * Returns true if the file could be written, false on errors.
+ */
+bool write_mapped_store(PartitionStore& source, const std::string& path,
+                        unsigned hash_bits, unsigned max_error,
+                        unsigned payload_bytes, bool ordinals,
+                        unsigned substrings, size_t key_length,
+                        std::string* error_msg);
+
+
+/** Return true if path is a file in the snapshot format of the
+ * memory store.
+ */
+bool is_memory_snapshot(const std::string& path);
+
+/** Create an empty store that keeps all records in memory.
+ *
+ * If writable, close() saves the records as a snapshot at path when
+ * they have changed.
+ */
+PartitionStore* create_memory_store(const std::string& path, bool writable);
+
+/** Load a memory store from the snapshot at path.
+ *
+ * Returns the new store, or NULL on error.
+ */
+PartitionStore* load_memory_snapshot(const std::string& path, bool writable,
+                                     std::string* error_msg);
+
+/** Write all records in source to a new snapshot at path, preceded
+ * by the settings records.  Records in source with the same keys as
+ * the settings are skipped.
+ *
+ * The snapshot is written to a temporary file first and then renamed
+ * to path, so a snapshot being written never replaces a valid one.
+ *
+ * Returns true if the file could be written, false on errors.
+ */
+bool write_memory_snapshot(PartitionStore& source, const std::string& path,
+                           const std::map<std::string, std::string>& settings,
+                           std::string* error_msg);
+
+
+/*
+  Local Variables:
+  c-file-style: "stroustrup"
+  indent-tabs-mode:nil
+  End:
+*/
+
+#endif // __STORE_H_INCLUDED__